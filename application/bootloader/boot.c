@@ -0,0 +1,174 @@
+/** \file boot.c
+ * \brief Bootloader for attiny85 nodes: receives a new application over the bus.
+ *
+ * The bootloader sits in the first LOADER_APP_START bytes of flash and
+ * the application is linked to start right after it. The attiny85 can't
+ * move its interrupt vectors, so the bootloader owns the table at 0 and
+ * forwards every interrupt to the application's table, except the ones
+ * tiny485 uses, which go to the bootloader's handlers while
+ * BOOT_FLAG_ACTIVE is set in GPIOR2.
+ *
+ * After a reset, a node with a valid application listens for
+ * BOOT_WINDOW ms and starts the application unless a bootloader frame
+ * for it came in. A node without one stays in the bootloader. Applications
+ * can reset into the bootloader with the watchdog when they see a
+ * BOOT_TYPE_START themselves.
+ *
+ * The attiny85 halts the CPU while it erases or writes flash, so nothing
+ * can be received then; the host leaves LOADER_PROG_TIME between pages.
+ */
+
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+#include "loader.h"
+
+#if !defined(__AVR_ATtiny85__)
+#error "the vector table below is laid out for the attiny85"
+#endif
+
+#define BOOT_WINDOW		1000	/**< ms to wait for an update before starting the application */
+#define BOOT_FLAG_ACTIVE	0	/**< bit in GPIOR2: the bootloader handles tiny485's interrupts */
+
+/* EEPROM layout */
+#define BOOT_EE_ADDRESS		((uint8_t *) 0)	/**< the node's address, 0xFF if none -- kept there by lib/lease */
+#define BOOT_EE_VALID		((uint8_t *) 1)	/**< BOOT_VALID_MAGIC when the application has been verified */
+#define BOOT_VALID_MAGIC	0xA5
+
+/* vector table */
+#define BOOT_STR_(x)	#x
+#define BOOT_STR(x)	BOOT_STR_(x)
+
+/** pass vector n on to the application */
+#define BOOT_FORWARD(n) \
+	void __vector_##n(void) __attribute__((naked, used, externally_visible)); \
+	void __vector_##n(void) { \
+		__asm__ __volatile__("rjmp " BOOT_STR(LOADER_APP_START) " + 2 * " #n); \
+	}
+
+/** pass vector n on to tiny485 in the bootloader, or to the application */
+#define BOOT_SHARED(n, v) \
+	void __vector_##n(void) __attribute__((naked, used, externally_visible)); \
+	void __vector_##n(void) { \
+		__asm__ __volatile__("sbis %[gpior], %[bit]\n\t" \
+			     "rjmp " BOOT_STR(LOADER_APP_START) " + 2 * " #n "\n\t" \
+			     "rjmp __vector_boot_" #v \
+			     :: [gpior] "I" (_SFR_IO_ADDR(GPIOR2)), [bit] "I" (BOOT_FLAG_ACTIVE)); \
+	}
+
+BOOT_FORWARD(1)			/* INT0 */
+BOOT_SHARED(2, PCINT0_vect)
+BOOT_FORWARD(3)			/* TIMER1_COMPA */
+BOOT_FORWARD(4)			/* TIMER1_OVF */
+BOOT_FORWARD(5)			/* TIMER0_OVF */
+BOOT_FORWARD(6)			/* EE_RDY */
+BOOT_FORWARD(7)			/* ANA_COMP */
+BOOT_FORWARD(8)			/* ADC */
+BOOT_FORWARD(9)			/* TIMER1_COMPB */
+BOOT_SHARED(10, TIM0_COMPA_vect)
+BOOT_FORWARD(11)		/* TIMER0_COMPB */
+BOOT_FORWARD(12)		/* WDT */
+BOOT_FORWARD(13)		/* USI_START */
+BOOT_SHARED(14, USI_OVF_vect)
+
+static volatile uint8_t boot_stay = 0;	/**< an update is under way */
+static volatile uint8_t boot_run = 0;	/**< the new application checked out */
+
+/* link layer callbacks */
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	/* any bootloader frame means a host is talking to us, not just START */
+	if(loader_frame_received(header, payload))
+		boot_stay = 1;
+}
+
+void frame_sent() {
+	loader_frame_sent();
+}
+
+/* loader hooks */
+void loader_program(uint16_t addr, uint8_t *data) {
+	uint8_t i, sreg;
+
+	sreg = SREG;
+	cli();
+
+	eeprom_busy_wait();
+
+	boot_page_erase(addr);
+	boot_spm_busy_wait();
+
+	for(i=0; i<LOADER_PAGE_SIZE; i+=2)
+		boot_page_fill(addr + i, data[i] | (data[i+1] << 8));
+
+	boot_page_write(addr);
+	boot_spm_busy_wait();
+
+	SREG = sreg;
+}
+
+uint8_t loader_read(uint16_t addr) {
+	return pgm_read_byte(addr);
+}
+
+void loader_valid(uint8_t valid) {
+	eeprom_update_byte(BOOT_EE_VALID, valid ? BOOT_VALID_MAGIC : 0xFF);
+}
+
+void loader_start() {
+	boot_run = 1;
+}
+
+/** hand the chip over to the application */
+static void boot_start_app() {
+	cli();
+
+	/* leave the hardware the way reset would */
+	GIMSK = 0;
+	PCMSK = 0;
+	TIMSK = 0;
+	TCCR0A = 0;
+	TCCR0B = 0;
+	USICR = 0;
+	GPIOR2 = 0;
+
+	((void (*)(void)) (LOADER_APP_START / 2))();
+}
+
+int main(void) {
+	uint8_t address;
+	uint16_t i;
+
+	/* an application may have reset us with the watchdog */
+	MCUSR = 0;
+	wdt_disable();
+
+	GPIOR2 = _BV(BOOT_FLAG_ACTIVE);
+
+	address = eeprom_read_byte(BOOT_EE_ADDRESS);
+
+	hw_init();
+	sblp_init();
+	if(address != 0xFF)
+		sblp_set_address(address);
+	loader_init(address);
+
+	if(eeprom_read_byte(BOOT_EE_VALID) == BOOT_VALID_MAGIC) {
+		for(i=0; i<BOOT_WINDOW/10 && !boot_stay; i++)
+			_delay_ms(10);
+
+		if(!boot_stay)
+			boot_start_app();
+	}
+
+	while(1) {
+		if(boot_run)
+			boot_start_app();
+	}
+}
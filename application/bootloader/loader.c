@@ -0,0 +1,233 @@
+/** \file loader.c
+ * \brief Implements the bootloader's side of the image transfer.
+ *
+ * The host announces an image with BOOT_TYPE_START, sends it a page per
+ * BOOT_TYPE_PAGE frame and finishes with BOOT_TYPE_DONE. Pages are not
+ * acknowledged: each is programmed as soon as its frame is in, and the
+ * host leaves just enough room between frames for that. Once the image
+ * is complete, the loader reads the application area back, compares its
+ * CRC with the announced one and reports the result to the host.
+ *
+ * The same image can go to many nodes at once by sending it to a group
+ * or to everyone. Frames sent that way are never answered, so the nodes
+ * don't talk over each other. Every node keeps a bitmap of the pages it
+ * hasn't got yet, which the host collects with BOOT_TYPE_QUERY; it then
+ * sends the pages any node is missing once more, to all of them. Pages a
+ * node already has are not programmed again. A node that has no image
+ * announced, because it missed the START or was reset since, answers the
+ * query with LOADER_NO_IMAGE instead, so the host announces it again.
+ */
+
+#include "loader.h"
+
+/** internal data for the loader */
+static struct {
+	uint8_t		address;		/**< our address, used as source */
+	uint16_t	length;			/**< length of the image announced, 0 if none */
+	uint16_t	crc;			/**< its CRC */
+	uint8_t		missing[LOADER_MAP_SIZE];	/**< pages of the image not received yet */
+
+	uint8_t		checked;		/**< the image has been verified since the last page came in */
+	uint8_t		status;			/**< result of that */
+	uint16_t	flash_crc;
+
+	uint8_t		ok;			/**< set when the status sent said the image is good */
+	volatile uint8_t busy;			/**< a reply is being sent */
+	uint8_t		xmit[LOADER_MAP_SIZE];	/**< payload of that reply */
+} loader_data;
+
+uint16_t loader_crc16(uint16_t crc, uint8_t b) {
+	uint8_t i;
+
+	crc ^= b;
+	for(i=0; i<8; i++) {
+		if(crc & 1)
+			crc = (crc >> 1) ^ 0xA001;
+		else
+			crc = (crc >> 1);
+	}
+
+	return crc;
+}
+
+void loader_init(uint8_t address) {
+	loader_data.address = address;
+	loader_data.length = 0;
+	loader_data.checked = 0;
+	loader_data.busy = 0;
+}
+
+/** send a reply to the host */
+static void loader_reply(uint8_t dest, uint8_t type, uint8_t length) {
+	struct sblp_header header;
+
+	header.type	= type;
+	header.length	= length;
+	header.dest	= dest;
+	header.src	= loader_data.address;
+
+	loader_data.busy = 1;
+	if(!send_frame(&header, loader_data.xmit)) {
+		/* the host will ask again */
+		loader_data.busy = 0;
+	}
+}
+
+/** send a status reply to the host */
+static void loader_status(uint8_t dest, uint8_t status, uint16_t crc) {
+	if(loader_data.busy)
+		return;
+
+	loader_data.xmit[0] = status;
+	loader_data.xmit[1] = crc >> 8;
+	loader_data.xmit[2] = crc & 0xFF;
+
+	loader_data.ok = status == LOADER_OK;
+	loader_reply(dest, BOOT_TYPE_STATUS, 3);
+}
+
+/** send the bitmap of missing pages to the host */
+static void loader_missing(uint8_t dest) {
+	uint8_t i;
+
+	if(loader_data.busy)
+		return;
+
+	for(i=0; i<LOADER_MAP_SIZE; i++)
+		loader_data.xmit[i] = loader_data.missing[i];
+
+	loader_data.ok = 0;
+	loader_reply(dest, BOOT_TYPE_MISSING, LOADER_MAP_SIZE);
+}
+
+/** check the image, unless that's been done already */
+static void loader_verify() {
+	uint16_t addr, crc = 0xFFFF;
+	uint8_t i;
+
+	if(loader_data.checked)
+		return;
+
+	loader_data.checked = 1;
+	loader_data.flash_crc = 0;
+
+	if(!loader_data.length) {
+		loader_data.status = LOADER_NO_IMAGE;
+		return;
+	}
+
+	for(i=0; i<LOADER_MAP_SIZE; i++) {
+		if(loader_data.missing[i]) {
+			loader_data.status = LOADER_INCOMPLETE;
+			return;
+		}
+	}
+
+	for(addr=LOADER_APP_START; addr<LOADER_APP_START+loader_data.length; addr++)
+		crc = loader_crc16(crc, loader_read(addr));
+
+	loader_data.flash_crc = crc;
+	loader_data.status = crc == loader_data.crc ? LOADER_OK : LOADER_BAD_CRC;
+
+	if(loader_data.status == LOADER_OK)
+		loader_valid(1);
+}
+
+/** start receiving an image, unless it's the one we're already receiving */
+static void loader_start_image(uint16_t length, uint16_t crc) {
+	uint16_t page, pages;
+
+	if(loader_data.length && length == loader_data.length && crc == loader_data.crc)
+		return;
+
+	/* until it's verified, the old application is gone */
+	loader_valid(0);
+	loader_data.checked = 0;
+
+	if(length > LOADER_FLASH_END - LOADER_APP_START) {
+		loader_data.length = 0;
+		return;
+	}
+
+	loader_data.length = length;
+	loader_data.crc = crc;
+
+	pages = (length + LOADER_PAGE_SIZE - 1) / LOADER_PAGE_SIZE;
+	for(page=0; page<LOADER_MAP_SIZE*8; page++) {
+		if(page < pages)
+			loader_data.missing[page >> 3] |= (1 << (page & 7));
+		else
+			loader_data.missing[page >> 3] &= ~(1 << (page & 7));
+	}
+}
+
+uint8_t loader_frame_received(struct sblp_header *header, uint8_t *payload) {
+	uint8_t quiet = header->dest == SBLP_BROADCAST || SBLP_IS_GROUP(header->dest);
+	uint16_t addr, page;
+
+	switch(header->type) {
+		case BOOT_TYPE_START:
+			if(header->length < 4)
+				break;
+
+			loader_start_image((payload[0] << 8) | payload[1], (payload[2] << 8) | payload[3]);
+
+			if(!quiet)
+				loader_status(header->src, loader_data.length ? LOADER_READY : LOADER_NO_IMAGE, loader_data.crc);
+			break;
+
+		case BOOT_TYPE_PAGE:
+			if(header->length != 2 + LOADER_PAGE_SIZE || !loader_data.length)
+				break;
+
+			/* never overwrite the bootloader */
+			addr = (payload[0] << 8) | payload[1];
+			if(addr < LOADER_APP_START || addr >= LOADER_FLASH_END || addr % LOADER_PAGE_SIZE)
+				break;
+
+			/* a page repeated for another node -- we've got it */
+			page = (addr - LOADER_APP_START) / LOADER_PAGE_SIZE;
+			if(!(loader_data.missing[page >> 3] & (1 << (page & 7))))
+				break;
+
+			loader_program(addr, payload + 2);
+			loader_data.missing[page >> 3] &= ~(1 << (page & 7));
+			loader_data.checked = 0;
+			break;
+
+		case BOOT_TYPE_QUERY:
+			if(quiet)
+				break;
+
+			/* an empty bitmap would say we have it all */
+			if(loader_data.length)
+				loader_missing(header->src);
+			else
+				loader_status(header->src, LOADER_NO_IMAGE, 0);
+			break;
+
+		case BOOT_TYPE_DONE:
+			/* everyone checks at once; the host then asks each node for the result */
+			loader_verify();
+
+			if(!quiet)
+				loader_status(header->src, loader_data.status, loader_data.flash_crc);
+			break;
+
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+uint8_t loader_frame_sent() {
+	if(!loader_data.busy)
+		return 0;
+
+	loader_data.busy = 0;
+	if(loader_data.ok)
+		loader_start();
+
+	return 1;
+}
@@ -0,0 +1,46 @@
+/** \file loader.h
+ * Header file for the bootloader's protocol handling.
+ *
+ * The loader doesn't touch the hardware: the bootloader firmware passes it
+ * the frames sblp receives and supplies the flash and EEPROM functions
+ * below, and so does the host simulation.
+ */
+
+#ifndef _LOADER_H
+
+#include "interop.h"
+
+#define LOADER_PAGE_SIZE	64		/**< flash page size (SPM_PAGESIZE on the attiny85) */
+#define LOADER_APP_START	0x0800		/**< the application is linked here; below is the bootloader */
+#define LOADER_FLASH_END	0x2000		/**< end of flash */
+#define LOADER_PROG_TIME	9000		/**< us the CPU is halted to erase and write a page (2 x 4.5 ms) */
+#define LOADER_PAGES		((LOADER_FLASH_END - LOADER_APP_START) / LOADER_PAGE_SIZE)
+#define LOADER_MAP_SIZE		((LOADER_PAGES + 7) / 8)	/**< bytes in a bitmap of pages */
+
+/* status codes in a BOOT_TYPE_STATUS reply */
+#define LOADER_OK		0x00	/**< image verified, starting it */
+#define LOADER_BAD_CRC		0x01	/**< image in flash doesn't match the CRC announced */
+#define LOADER_NO_IMAGE		0x02	/**< no BOOT_TYPE_START seen, or the image doesn't fit */
+#define LOADER_READY		0x03	/**< BOOT_TYPE_START seen, send the pages */
+#define LOADER_INCOMPLETE	0x04	/**< pages are still missing */
+
+/** initialise the loader, answering status requests from the given address */
+void loader_init(uint8_t address);
+
+/** offer a received frame to the loader; returns nonzero when it was a bootloader frame */
+uint8_t loader_frame_received(struct sblp_header *header, uint8_t *payload);
+
+/** the loader's status reply has been sent; returns nonzero when it was ours */
+uint8_t loader_frame_sent();
+
+/** CRC-16 as in avr-libc's _crc16_update() */
+uint16_t loader_crc16(uint16_t crc, uint8_t b);
+
+/* supplied by the hardware side */
+extern void loader_program(uint16_t addr, uint8_t *data);	/**< erase and write one page */
+extern uint8_t loader_read(uint16_t addr);			/**< read back a byte of flash */
+extern void loader_valid(uint8_t valid);			/**< mark the application (in)valid */
+extern void loader_start();					/**< the status reply for a good image is out -- run it */
+
+#define _LOADER_H
+#endif
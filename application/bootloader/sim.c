@@ -0,0 +1,379 @@
+/** \file sim.c
+ * \brief Host simulation of an image transfer to the bootloader.
+ *
+ * Runs sblp and the loader against a simulated bus with a byte-accurate
+ * clock. While the loader programs a page the simulated CPU is halted for
+ * LOADER_PROG_TIME, as the attiny85's is, and every byte that arrives then
+ * is lost. A random image is sent three ways:
+ *
+ *	no gap		pages back-to-back with nothing in between
+ *	pipelined	pages back-to-back, LOADER_PROG_TIME plus a bit apart
+ *	acked		each page waits for a (hypothetical) acknowledgement
+ *
+ * and the result is checked against the image. The times are compared
+ * with the line rate (the time the image alone takes on the wire) and
+ * with sending the frames with no gap, which is the best this frame
+ * format can do.
+ *
+ * Then the image is broadcast to a number of nodes, each of which misses
+ * a given share of the frames, and repaired by asking every node for the
+ * pages it's missing and sending their union again until none are. The
+ * first node runs the loader, the others are only bitmaps. That is
+ * compared with updating the nodes one at a time.
+ *
+ * usage: sim [image-bytes [baud [seed [nodes [loss-percent]]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* sblp is built in, so it calls the simulated bus like it would tiny485 in node.o */
+#define INTEROP_UNITY
+#include "interop.h"
+#include "loader.h"
+#include "sblp/sblp.c"
+
+#define SIM_ADDRESS	0x10		/**< the node being updated */
+#define SIM_HOST	0x01		/**< the host sending the image */
+#define SIM_TURNAROUND	2000		/**< us a host needs to react to a reply */
+#define SIM_MAX_NODES	256
+#define SIM_MAX_ROUNDS	20
+
+static uint8_t		flash[LOADER_FLASH_END];
+static double		now;		/**< us */
+static double		halted_until;
+static double		byte_time;	/**< us per byte on the wire: start + 8 data + stop */
+
+static int		valid, started, status;
+static unsigned long	lost;
+
+/* transmit side of the node -- only replies */
+static int	tx_active;
+static uint8_t	tx_buf[1 + HEADER_LENGTH + LOADER_MAP_SIZE];
+static unsigned int tx_len;
+
+void begin_transmission() {
+	tx_active = 1;
+	tx_len = 0;
+}
+
+void end_transmission() {
+	tx_active = 0;
+	status = tx_len > 6 ? tx_buf[6] : -1;	/* sync, 5 header bytes, status */
+}
+
+void send_byte(uint8_t b) {
+	if(tx_len < sizeof(tx_buf))
+		tx_buf[tx_len++] = b;
+}
+
+void send_sync() {
+	send_byte(0xFF);
+}
+
+void hw_init() {
+}
+
+/* the simulated bus calls sblp from the same loop */
+uint8_t hw_lock() {
+	return 0;
+}
+
+void hw_unlock(uint8_t state) {
+	(void) state;
+}
+
+/* link layer callbacks */
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	loader_frame_received(header, payload);
+}
+
+void frame_sent() {
+	loader_frame_sent();
+}
+
+/* loader hooks */
+void loader_program(uint16_t addr, uint8_t *data) {
+	memcpy(flash + addr, data, LOADER_PAGE_SIZE);
+	halted_until = now + LOADER_PROG_TIME;
+}
+
+uint8_t loader_read(uint16_t addr) {
+	return flash[addr];
+}
+
+void loader_valid(uint8_t v) {
+	valid = v;
+}
+
+void loader_start() {
+	started = 1;
+}
+
+/** put one byte on the wire, escaped; it's lost if the node is halted when it starts */
+static void sim_wire(uint8_t b, int sync) {
+	int escape = !sync && (b == 0xFF || b == 0x55);
+	int ok = now >= halted_until;
+
+	now += byte_time;
+	if(escape) {
+		ok = ok && now >= halted_until;
+		now += byte_time;
+	}
+
+	if(!ok) {
+		lost++;
+		return;
+	}
+
+	if(sync)
+		sync_received();
+	else
+		byte_received(b);
+
+	/* let the node get its reply out */
+	while(tx_active)
+		byte_sent();
+}
+
+/** send a frame from the host */
+static void sim_frame_to(uint8_t dest, uint8_t type, uint8_t *payload, uint16_t length) {
+	uint16_t i;
+
+	sim_wire(0xFF, 1);
+	sim_wire(type, 0);
+	sim_wire(length >> 8, 0);
+	sim_wire(length & 0xFF, 0);
+	sim_wire(dest, 0);
+	sim_wire(SIM_HOST, 0);
+	for(i=0; i<length; i++)
+		sim_wire(payload[i], 0);
+}
+
+static void sim_frame(uint8_t type, uint8_t *payload, uint16_t length) {
+	sim_frame_to(SIM_ADDRESS, type, payload, length);
+}
+
+/** time a frame takes on the wire, without escapes */
+static double sim_frame_time(uint16_t length) {
+	return (1 + HEADER_LENGTH + length) * byte_time;
+}
+
+/** send the image with the given gap after every page; returns the time it took */
+static double sim_run(uint8_t *image, uint16_t length, double gap) {
+	uint8_t buf[2 + LOADER_PAGE_SIZE];
+	uint16_t crc = 0xFFFF, addr, i;
+
+	memset(flash, 0xFF, sizeof(flash));
+	now = halted_until = 0;
+	valid = started = lost = 0;
+	status = -1;
+
+	hw_init();
+	sblp_init();
+	sblp_set_address(SIM_ADDRESS);
+	loader_init(SIM_ADDRESS);
+
+	for(i=0; i<length; i++)
+		crc = loader_crc16(crc, image[i]);
+
+	buf[0] = length >> 8;
+	buf[1] = length & 0xFF;
+	buf[2] = crc >> 8;
+	buf[3] = crc & 0xFF;
+	sim_frame(BOOT_TYPE_START, buf, 4);
+	now += SIM_TURNAROUND;
+
+	for(addr=0; addr<length; addr+=LOADER_PAGE_SIZE) {
+		buf[0] = (LOADER_APP_START + addr) >> 8;
+		buf[1] = (LOADER_APP_START + addr) & 0xFF;
+		for(i=0; i<LOADER_PAGE_SIZE; i++)
+			buf[2 + i] = addr + i < length ? image[addr + i] : 0xFF;
+
+		sim_frame(BOOT_TYPE_PAGE, buf, sizeof(buf));
+		now += gap;
+	}
+
+	sim_frame(BOOT_TYPE_DONE, NULL, 0);
+	return now;
+}
+
+/** fill buf with page number page of the image */
+static void sim_page(uint8_t *buf, uint8_t *image, uint16_t length, uint16_t page) {
+	uint16_t addr = page * LOADER_PAGE_SIZE, i;
+
+	buf[0] = (LOADER_APP_START + addr) >> 8;
+	buf[1] = (LOADER_APP_START + addr) & 0xFF;
+	for(i=0; i<LOADER_PAGE_SIZE; i++)
+		buf[2 + i] = addr + i < length ? image[addr + i] : 0xFF;
+}
+
+/** broadcast the image to nodes nodes, each missing loss% of the frames, and repair it.
+ * Returns the time it took, or a negative number if the first node didn't get it right.
+ */
+static double sim_broadcast(uint8_t *image, uint16_t length, unsigned int nodes, unsigned int loss, unsigned int *rounds) {
+	static uint8_t missing[SIM_MAX_NODES][LOADER_MAP_SIZE];
+	static uint8_t complete[SIM_MAX_NODES];
+	uint8_t buf[2 + LOADER_PAGE_SIZE], send[LOADER_MAP_SIZE];
+	uint16_t crc = 0xFFFF, page, pages, i;
+	unsigned int n, any, asked;
+	double t;
+
+	memset(flash, 0xFF, sizeof(flash));
+	now = halted_until = 0;
+	valid = started = lost = 0;
+
+	sblp_init();
+	sblp_set_address(SIM_ADDRESS);
+	loader_init(SIM_ADDRESS);
+
+	for(i=0; i<length; i++)
+		crc = loader_crc16(crc, image[i]);
+
+	buf[0] = length >> 8;
+	buf[1] = length & 0xFF;
+	buf[2] = crc >> 8;
+	buf[3] = crc & 0xFF;
+	sim_frame_to(SBLP_BROADCAST, BOOT_TYPE_START, buf, 4);
+	now += SIM_TURNAROUND;
+
+	pages = (length + LOADER_PAGE_SIZE - 1) / LOADER_PAGE_SIZE;
+	memset(missing, 0, sizeof(missing));
+	memset(complete, 0, sizeof(complete));
+	memset(send, 0, sizeof(send));
+	for(page=0; page<pages; page++) {
+		send[page >> 3] |= 1 << (page & 7);
+		for(n=0; n<nodes; n++)
+			missing[n][page >> 3] |= 1 << (page & 7);
+	}
+
+	for(*rounds=0; *rounds<SIM_MAX_ROUNDS; (*rounds)++) {
+		/* send what anyone is missing */
+		for(page=0, any=0; page<pages; page++) {
+			if(!(send[page >> 3] & (1 << (page & 7))))
+				continue;
+			any = 1;
+
+			/* the loader decides for itself whether it needs it */
+			sim_page(buf, image, length, page);
+			if((unsigned int) (rand() % 100) >= loss)
+				sim_frame_to(SBLP_BROADCAST, BOOT_TYPE_PAGE, buf, sizeof(buf));
+			else
+				now += sim_frame_time(sizeof(buf));
+			now += LOADER_PROG_TIME + byte_time / 10;
+
+			for(n=1; n<nodes; n++)
+				if((unsigned int) (rand() % 100) >= loss)
+					missing[n][page >> 3] &= ~(1 << (page & 7));
+		}
+
+		if(!any)
+			break;
+
+		/* ask the nodes that weren't complete yet what they're missing; the first one for real */
+		if(!complete[0]) {
+			sim_frame(BOOT_TYPE_QUERY, NULL, 0);
+			if(tx_len != sizeof(tx_buf))
+				return -1;
+			memcpy(missing[0], tx_buf + 1 + HEADER_LENGTH, LOADER_MAP_SIZE);
+			now += sim_frame_time(LOADER_MAP_SIZE) + 2 * SIM_TURNAROUND;
+		}
+
+		for(n=1, asked=0; n<nodes; n++)
+			asked += !complete[n];
+		now += asked * (sim_frame_time(0) + sim_frame_time(LOADER_MAP_SIZE) + 2 * SIM_TURNAROUND);
+
+		memset(send, 0, sizeof(send));
+		for(n=0; n<nodes; n++) {
+			for(i=0, any=0; i<LOADER_MAP_SIZE; i++) {
+				send[i] |= missing[n][i];
+				any |= missing[n][i];
+			}
+			complete[n] = !any;
+		}
+	}
+
+	/* everyone checks their image at once, then each is asked for the result */
+	sim_frame_to(SBLP_BROADCAST, BOOT_TYPE_DONE, NULL, 0);
+	t = now;
+	sim_frame(BOOT_TYPE_DONE, NULL, 0);
+	now = t + nodes * (sim_frame_time(0) + sim_frame_time(3) + 2 * SIM_TURNAROUND);
+
+	if(status != LOADER_OK || !started || memcmp(flash + LOADER_APP_START, image, length))
+		return -1;
+
+	return now;
+}
+
+int main(int argc, char **argv) {
+	unsigned long length = LOADER_FLASH_END - LOADER_APP_START, baud = 1200, i;
+	unsigned int nodes = 60, loss = 1, rounds;
+	double line, wire, t, ack;
+	uint8_t *image;
+	int failed = 0;
+
+	if(argc > 1) length = strtoul(argv[1], NULL, 0);
+	if(argc > 2) baud = strtoul(argv[2], NULL, 0);
+	srand(argc > 3 ? strtoul(argv[3], NULL, 0) : 1);
+	if(argc > 4) nodes = strtoul(argv[4], NULL, 0);
+	if(argc > 5) loss = strtoul(argv[5], NULL, 0);
+
+	if(!length || length > LOADER_FLASH_END - LOADER_APP_START || !baud ||
+	   !nodes || nodes > SIM_MAX_NODES || loss > 50) {
+		fprintf(stderr, "usage: %s [image-bytes (max %u) [baud [seed [nodes (max %u) [loss-percent (max 50)]]]]]\n",
+			argv[0], LOADER_FLASH_END - LOADER_APP_START, SIM_MAX_NODES);
+		return 1;
+	}
+
+	image = malloc(length);
+	for(i=0; i<length; i++)
+		image[i] = rand();
+
+	byte_time = 10e6 / baud;
+	line = length * byte_time;
+
+	/* an acknowledgement costs a frame (sync, header, status) and two turnarounds */
+	ack = LOADER_PROG_TIME + 9 * byte_time + 2 * SIM_TURNAROUND;
+
+	printf("%lu bytes (%lu pages) at %lu baud, line rate %.2f s\n",
+		length, (length + LOADER_PAGE_SIZE - 1) / LOADER_PAGE_SIZE, baud, line / 1e6);
+
+	/* the same frames with nothing in between are as fast as it gets */
+	wire = sim_run(image, length, 0);
+	printf("no gap     %7.2f s  %5.1f%% of line rate, %lu bytes lost, status %d, %s\n",
+		wire / 1e6, 100 * line / wire, lost, status, started && valid ? "started" : "NOT started");
+
+	t = sim_run(image, length, LOADER_PROG_TIME + byte_time / 10);
+	printf("pipelined  %7.2f s  %5.1f%% of line rate, %lu bytes lost, status %d, %s, %.1f%% slower than no gap\n",
+		t / 1e6, 100 * line / t, lost, status, started && valid ? "started" : "NOT started",
+		100 * (t - wire) / wire);
+	if(!started || !valid || memcmp(flash + LOADER_APP_START, image, length))
+		failed = 1;
+
+	t = sim_run(image, length, ack);
+	printf("acked      %7.2f s  %5.1f%% of line rate, %.1f%% slower than no gap\n",
+		t / 1e6, 100 * line / t, 100 * (t - wire) / wire);
+
+	/* one at a time, that's the pipelined time for every node */
+	wire = sim_run(image, length, LOADER_PROG_TIME + byte_time / 10);
+
+	t = sim_broadcast(image, length, nodes, loss, &rounds);
+	if(t < 0) {
+		printf("broadcast  to %u nodes with %u%% loss: first node FAILED\n", nodes, loss);
+		failed = 1;
+	} else {
+		printf("broadcast  %7.2f s  to %u nodes with %u%% loss, %u repair rounds; one at a time %.2f s\n",
+			t / 1e6, nodes, loss, rounds ? rounds - 1 : 0, nodes * wire / 1e6);
+	}
+
+	free(image);
+
+	if(failed) {
+		printf("FAILED\n");
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
@@ -3,13 +3,23 @@
  * elevator lighting.
  *
  * Targets an attiny85 with two relays connected to PB3 and PB4.
+ *
+ * Commands arrive as ELRC_TYPE_COMMAND frames and are carried out from
+ * frame_received(), as soon as the frame is in. tiny485 is built with
+ * T485_DEFER, so the link layer runs from the main loop, which polls it
+ * whenever an interrupt wakes the CPU. Timer1 only runs while the coil is
+ * energised and releases it after COIL_DELAY ms. With the coil off
+ * and the link quiet it powers down, and the next frame's preamble wakes
+ * it up (see T485_PREAMBLE in the Makefile); otherwise idle sleep keeps
+ * timer1 and tiny485's receiver running.
  */
 
+#include <avr/interrupt.h>
 #include <avr/io.h>
-#define F_CPU 1000000UL  // 1 MHz
-#include <util/delay.h>
+
 #include "interop.h"
 #include "tiny485.h"
+#include "elrc.h"
 
 #define ELRC_PORT	PORTB	/**< Port to which the ELRC is connected */
 #define ELRC_DIR	DDRB
@@ -19,84 +29,78 @@
 #define LAMP_DIR	DDRB
 #define LAMP_PIN	3
 
-#define COIL_DELAY	10000
-
-/** \brief context data to be passed to callbacks */
-typedef struct {
-  volatile int elrc; /**< requested coil relay status (reset to 0 after timeout) */
-  volatile int lamp; /**< requested lamp relay status */
-} elrc_data_t;
-
-/*
-** \brief Callback function for received bytes.
-**
-** Function called when a byte is received, runs in interrupt
-** context.
-** Interprets the byte, and takes action accordingly.
-**
-** @param b the byte that was received
-** @param data user data passed in the initialization function
-**
-*/
-void byte_received(uint8_t b,void *data) {
-  elrc_data_t *elrc = (elrc_data_t *)data;
-  switch(b) {
-    case 1: elrc->elrc=1; break;
-    case 2: elrc->elrc=0; break;
-    case 3: elrc->lamp=1; break;
-    case 4: elrc->lamp=0; break;
-    default: break; //ignore unknown bytes
-  }
+#define COIL_DELAY	10000	/**< ms the coil stays energised */
+#define COIL_TICK	100	/**< ms per timer1 interrupt */
+
+/* timer1: CTC on OCR1C, clk/1024 -- (97 + 1) * 1024 us is about 100 ms at 1 MHz */
+#define TIM1_TOP	97
+#define TIM1_ON()	TCCR1 = _BV(CTC1) | _BV(CS13) | _BV(CS11) | _BV(CS10)
+#define TIM1_OFF()	TCCR1 = 0
+
+static volatile uint8_t coil_ticks = 0;	/**< timer1 interrupts left until the coil is released */
+
+/** energise the coil, or keep it energised for another COIL_DELAY ms */
+static void coil_on() {
+	coil_ticks = COIL_DELAY / COIL_TICK;
+	ELRC_PORT |= _BV(ELRC_PIN);
+
+	TCNT1 = 0;
+	TIM1_ON();
 }
 
-/*
-** \brief Callback function for received bytes.
-**
-** Function called when a byte is sent, runs in interrupt
-** context.
-** Does nothing right now.
-**
-** @param data user data passed in the initialization function
-**
-*/
-void byte_sent(void *data) {
-  
+static void coil_off() {
+	TIM1_OFF();
+	coil_ticks = 0;
+	ELRC_PORT &= ~_BV(ELRC_PIN);
 }
 
-int main(void) {
-  struct hw_interface cb;
-  elrc_data_t data={0,0};
-  int counter=0;
-
-  /* initialize relay i/o */
-  ELRC_DIR |= (1<<ELRC_PIN);
-  LAMP_DIR |= (1<<LAMP_PIN);
-
-  /* reset relays */
-  ELRC_PORT &= ~_BV(ELRC_PIN);
-  LAMP_PORT &= ~_BV(LAMP_PIN);
-
-  /** initialize spacebus link layer
-   ** \todo use SBP instead of raw frames */
-  cb.u_byte_received=byte_received;
-  cb.u_byte_sent=byte_sent;
-  cb.c_data=&data;
-
-  tiny485(&cb);
-  
-  while(1) {
-	if(data.elrc) {
-		counter=COIL_DELAY/100;
-		data.elrc=0;
+ISR(TIMER1_COMPA_vect) {
+	if(--coil_ticks == 0)
+		coil_off();
+}
+
+/* link layer callbacks, called from hw_poll() */
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	if(header->type != ELRC_TYPE_COMMAND || header->length < 1)
+		return;
+
+	switch(payload[0]) {
+		case ELRC_COIL_ON:	coil_on(); break;
+		case ELRC_COIL_OFF:	coil_off(); break;
+		case ELRC_LAMP_ON:	LAMP_PORT |=  _BV(LAMP_PIN); break;
+		case ELRC_LAMP_OFF:	LAMP_PORT &= ~_BV(LAMP_PIN); break;
+		default: break; // ignore unknown commands
 	}
-	if(counter) {
-		ELRC_PORT|=_BV(ELRC_PIN);
-		counter--;
-	} else {
-		ELRC_PORT&=~_BV(ELRC_PIN);
+}
+
+void frame_sent() { }
+
+int main(void) {
+	/* initialize relay i/o */
+	ELRC_DIR |= (1<<ELRC_PIN);
+	LAMP_DIR |= (1<<LAMP_PIN);
+
+	/* reset relays */
+	ELRC_PORT &= ~_BV(ELRC_PIN);
+	LAMP_PORT &= ~_BV(LAMP_PIN);
+
+	/* timer1 is started by coil_on() */
+	OCR1C = TIM1_TOP;
+	OCR1A = TIM1_TOP;
+	TIMSK |= _BV(OCIE1A);
+
+	/** initialize spacebus link layer
+	 ** \todo use SBP instead of raw frames */
+	hw_init();
+	sblp_init();
+	sblp_set_address(ELRC_ADDRESS);
+
+	while(1) {
+		while(hw_poll())
+			;
+
+		/* timer1 stops in power-down, so only go there with the coil off */
+		cli();
+		t485_sleep(!coil_ticks && sblp_idle());
 	}
-	if(data.lamp) LAMP_PORT|=_BV(LAMP_PIN); else LAMP_PORT&=~_BV(LAMP_PIN);
-	// waste cycles
-	_delay_ms(100);
-  }
 }
@@ -0,0 +1,17 @@
+/** \file elrc.h
+ * Frames understood by the elevator lock release controller.
+ */
+
+#ifndef _ELRC_H
+
+#define ELRC_ADDRESS		0x30	/**< address of the elrc on the bus */
+#define ELRC_TYPE_COMMAND	0x01	/**< frame type: a single command byte */
+
+/* commands */
+#define ELRC_COIL_ON		1	/**< release the lock for COIL_DELAY ms */
+#define ELRC_COIL_OFF		2	/**< lock again right away */
+#define ELRC_LAMP_ON		3
+#define ELRC_LAMP_OFF		4
+
+#define _ELRC_H
+#endif
@@ -1,5 +1,5 @@
 /** \file test.c
- * \brief Test application, sends bytes to the bus that can be interpreted
+ * \brief Test application, sends commands to the bus that can be interpreted
  * by the elrc application.
  *
  * Targets an attiny85 connected to the space bus.
@@ -10,59 +10,72 @@
 #include <util/delay.h>
 
 #include "interop.h"
-#include "tiny485.h"
+#include "elrc.h"
 
-typedef struct {
-  volatile int sent;
-} test_data_t;
+#define TEST_ADDRESS	0x31
 
-void byte_received(uint8_t b,void *data) {
+static uint8_t command;
+static volatile uint8_t sent;
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
 
 }
 
-void byte_sent(void *data) {
-  test_data_t *test = (test_data_t*)data;
-  test->sent=1;
+void frame_sent() {
+	sent = 1;
 }
 
-void send(uint8_t b, struct hw_interface *cb, test_data_t *data) {
-        data->sent=0;
-	cb->d_begin_transmission();
-	cb->d_send_byte(b);
-        while(data->sent==0);
-        cb->d_end_transmission();
+/** wait for a while, keeping the link layer going (tiny485 is built with T485_DEFER) */
+static void wait(uint16_t ms) {
+	while(ms--) {
+		while(hw_poll())
+			;
+		_delay_ms(1);
+	}
 }
 
-int main(void) {
-  struct hw_interface cb;
-  test_data_t data;
-  uint8_t lamp_state=0;
+/** send a command to the elrc, waiting until it's on the bus */
+static void send(uint8_t b) {
+	struct sblp_header header;
 
-  /* initialize spacebus link layer */
-  cb.u_byte_received=&byte_received;
-  cb.u_byte_sent=&byte_sent;
-  cb.c_data=(void *)&data;
+	header.type	= ELRC_TYPE_COMMAND;
+	header.length	= 1;
+	header.dest	= ELRC_ADDRESS;
+	header.src	= TEST_ADDRESS;
 
-  tiny485(&cb);
+	command = b;
+	sent = 0;
+	while(!send_frame(&header, &command))
+		wait(10);
+	while(!sent)
+		hw_poll();
+}
+
+int main(void) {
+	uint8_t lamp_state=0;
+
+	hw_init();
+	sblp_init();
+	sblp_set_address(TEST_ADDRESS);
 
 	// set inputs
-  DDRB &= ~_BV(3);
-  DDRB &= ~_BV(4);
+	DDRB &= ~_BV(3);
+	DDRB &= ~_BV(4);
 
 	// enable pull-up
-  PORTB |= _BV(3);
-  PORTB |= _BV(4);
- 
-  while(1) {
-	if(!(PINB&_BV(3))) {
-		send(1,&cb,&data);
-		_delay_ms(1000);
-	}
-	if(!(PINB&_BV(4))) {
-		lamp_state=1-lamp_state;
-		send(lamp_state?3:4,&cb,&data);
-		_delay_ms(1000);
+	PORTB |= _BV(3);
+	PORTB |= _BV(4);
+
+	while(1) {
+		if(!(PINB&_BV(3))) {
+			send(ELRC_COIL_ON);
+			wait(1000);
+		}
+		if(!(PINB&_BV(4))) {
+			lamp_state=1-lamp_state;
+			send(lamp_state?ELRC_LAMP_ON:ELRC_LAMP_OFF);
+			wait(1000);
+		}
+		wait(100);
 	}
-	_delay_ms(100);
-  }
 }
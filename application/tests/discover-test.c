@@ -0,0 +1,25 @@
+#include <avr/io.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+
+#define TEST_ADDRESS	0x11
+#define TEST_ID		0x12345678UL	/* must be unique on the bus */
+
+void frame_sent() {
+	discover_frame_sent();
+}
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	discover_frame_received(header, payload);
+}
+
+int main(void) {
+	hw_init();
+	sblp_init();
+	sblp_set_address(TEST_ADDRESS);
+	discover_init(TEST_ID, TEST_ADDRESS);
+
+	while(1) _delay_ms(500);
+}
@@ -0,0 +1,47 @@
+#include <avr/io.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+
+#define TEST_ADDRESS	0x11
+
+/* the message is streamed, so it can be any size */
+uint8_t good;
+
+void frame_sent() {
+	frag_frame_sent();
+}
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	frag_frame_received(header, payload);
+}
+
+void message_received(uint8_t src, uint16_t offset, uint8_t *data, uint16_t length, uint16_t total) {
+	uint16_t i;
+
+	if(offset == 0)
+		good = 1;
+
+	/* frag-send-test sends 0, 1, 2, ... */
+	for(i=0; i<length; i++)
+		if(data[i] != ((offset + i) & 0xFF))
+			good = 0;
+
+	if(offset + length == total) {
+		if(good)	PORTA |=  _BV(PA0);
+		else		PORTA &= ~_BV(PA0);
+	}
+}
+
+int main(void) {
+	hw_init();
+	sblp_init();
+	sblp_set_address(TEST_ADDRESS);
+	frag_init(TEST_ADDRESS);
+	frag_receive(0, 0);
+
+	DDRA |= _BV(PA0);
+
+	while(1) _delay_ms(500);
+}
@@ -0,0 +1,42 @@
+#include <avr/io.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+
+#define TEST_ADDRESS	0x10
+#define TEST_DEST	0x11
+#define TEST_DATA_LEN	120	/* three fragments */
+
+uint8_t data[TEST_DATA_LEN];
+
+void frame_sent() {
+	frag_frame_sent();
+}
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	frag_frame_received(header, payload);
+}
+
+void message_received(uint8_t src, uint16_t offset, uint8_t *data, uint16_t length, uint16_t total) {
+	/* not receiving anything */
+}
+
+int main(void) {
+	uint8_t i;
+
+	for(i=0; i<TEST_DATA_LEN; i++)
+		data[i] = i;
+
+	hw_init();
+	sblp_init();
+	frag_init(TEST_ADDRESS);
+
+	while(1) {
+		if(!frag_busy())
+			frag_send(TEST_DEST, data, TEST_DATA_LEN);
+		frag_poll();
+
+		_delay_ms(1000);
+	}
+}
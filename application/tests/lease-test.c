@@ -0,0 +1,38 @@
+#include <avr/io.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+
+#define TEST_ID		0x12345678UL	/* must be unique on the bus */
+
+void frame_sent() {
+	if(!lease_frame_sent())
+		discover_frame_sent();
+}
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	if(!lease_frame_received(header, payload))
+		discover_frame_received(header, payload);
+}
+
+void address_changed(uint8_t address) {
+	discover_init(TEST_ID, address);
+
+	if(address != LEASE_NONE)	PORTA |=  _BV(PA0);
+	else				PORTA &= ~_BV(PA0);
+}
+
+int main(void) {
+	hw_init();
+	sblp_init();
+	lease_init(TEST_ID);
+	address_changed(lease_address());
+
+	DDRA |= _BV(PA0);
+
+	while(1) {
+		lease_tick();
+		_delay_ms(100);
+	}
+}
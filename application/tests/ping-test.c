@@ -0,0 +1,33 @@
+#include <avr/io.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+
+#define TEST_ADDRESS	0x10
+#define TEST_PEER	0x11	/* pinged once a second; read the histogram with stats485 -l */
+
+void frame_sent() {
+}
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	/* empty for now */
+}
+
+/* timer1 runs freely at clk/64: 64 us ticks */
+uint16_t sblp_clock() {
+	return TCNT1;
+}
+
+int main(void) {
+	TCCR1B = _BV(CS11) | _BV(CS10);
+
+	hw_init();
+	sblp_init();
+	sblp_set_address(TEST_ADDRESS);
+
+	while(1) {
+		sblp_ping(TEST_PEER);
+		_delay_ms(1000);
+	}
+}
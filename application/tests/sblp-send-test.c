@@ -4,6 +4,7 @@
 
 #include "interop.h"
 
+#define TEST_ADDRESS	0x10
 
 uint8_t test_data[2] = {0, 0};
 #define TEST_DATA_LEN 2
@@ -21,9 +22,11 @@ int main(void) {
 	struct sblp_header head;
 	hw_init();
 	sblp_init();
+	sblp_set_address(TEST_ADDRESS);
 	
 	head.type = 1;
-	head.length = TEST_DATA_LEN + HEADER_LENGTH;
+	head.length = TEST_DATA_LEN;
+	head.dest = SBLP_BROADCAST;
 
 	while(1) {
 		if(test_data[0]) {
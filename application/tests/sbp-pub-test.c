@@ -0,0 +1,38 @@
+#include <avr/io.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+
+#define TEST_ADDRESS	0x10
+#define TEST_TOPIC	1
+
+void frame_sent() {
+	sbp_frame_sent();
+}
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	sbp_frame_received(header, payload);
+}
+
+void topic_received(uint8_t topic, uint8_t src, uint8_t *data, uint8_t length) {
+	/* not subscribed to anything */
+}
+
+int main(void) {
+	hw_init();
+	sblp_init();
+	sbp_init(TEST_ADDRESS);
+
+	/* button between PB3 and ground */
+	DDRB  &= ~_BV(PB3);
+	PORTB |=  _BV(PB3);
+
+	while(1) {
+		/* only changes go out on the bus */
+		sbp_set(TEST_TOPIC, !(PINB & _BV(PB3)));
+		sbp_poll();
+
+		_delay_ms(20);
+	}
+}
@@ -0,0 +1,32 @@
+#include <avr/io.h>
+#define F_CPU 1000000UL	// 1 MHz
+#include <util/delay.h>
+
+#include "interop.h"
+
+#define TEST_ADDRESS	0x11
+#define TEST_TOPIC	1
+
+void frame_sent() {
+	sbp_frame_sent();
+}
+
+void frame_received(struct sblp_header *header, uint8_t *payload) {
+	sbp_frame_received(header, payload);
+}
+
+void topic_received(uint8_t topic, uint8_t src, uint8_t *data, uint8_t length) {
+	if(length && data[0])	PORTB |=  _BV(PA0);
+	else			PORTB &= ~_BV(PA0);
+}
+
+int main(void) {
+	hw_init();
+	sblp_init();
+	sbp_init(TEST_ADDRESS);
+	sbp_subscribe(TEST_TOPIC);
+
+	DDRB |= _BV(PA0);
+
+	while(1) _delay_ms(500);
+}
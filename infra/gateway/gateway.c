@@ -0,0 +1,730 @@
+/** \file gateway.c
+ * \brief Ethernet<->SpaceBus gateway daemon.
+ *
+ * Bridges SBLP frames between one or more buses (attached through RS485
+ * serial adapters) and UDP. A datagram carries exactly one frame: the
+ * unescaped header followed by the payload.
+ *
+ * Addresses are translated in both directions:
+ *	\li every UDP peer is given an SBLP address with -p. Frames on any bus
+ *	    destined for that address are sent to the peer, and frames from
+ *	    the peer get their source address rewritten to it.
+ *	\li the bus a destination lives on is learned from the source address
+ *	    of frames seen on each bus, or fixed with -r. Frames for unknown
+ *	    destinations are sent to all buses.
+ *
+ * With -d, the gateway finds the nodes on every bus before it starts
+ * (see lib/discover), so their routes are known from the first frame.
+ *
+ * With -a, it hands out addresses from a pool to nodes that ask for one
+ * (see lib/lease). Leases are only kept in memory: nodes keep their
+ * address in EEPROM and ask for it again when they reset, which is when
+ * the gateway learns about them after a restart of its own.
+ *
+ * The buses are half-duplex, so frames for a bus are held while a node on
+ * it is in the middle of sending one, and go out once its decoder is
+ * between frames again -- or once the node has been quiet for
+ * GW_RX_TIMEOUT, in case it stopped halfway.
+ *
+ * Everything runs from a single epoll loop. Datagrams are received with
+ * recvmmsg and the ones generated while handling a wakeup are sent in one
+ * go with sendmmsg.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+
+#define GW_MAX_BUSES	8			/**< number of buses a gateway can serve */
+#define GW_MAX_PEERS	64			/**< number of UDP peers */
+#define GW_BATCH	32			/**< datagrams per recvmmsg/sendmmsg call */
+#define GW_MAX_PAYLOAD	(1472 - HEADER_LENGTH)	/**< largest frame payload that fits an ethernet MTU */
+#define GW_TXBUF	16384			/**< per-bus transmit buffer */
+#define GW_READ_CHUNK	4096			/**< bytes read from a bus at a time */
+#define GW_RX_TIMEOUT	100			/**< ms a node may stall in the middle of a frame before we send over it */
+#define GW_DEFAULT_PORT	5485
+
+#define GW_NO_ROUTE	0xFF			/**< route table entry for an unknown destination */
+#define GW_NO_PEER	0xFF			/**< peer table entry for an address that is on a bus */
+
+/* epoll tags for non-bus file descriptors */
+#define GW_TAG_SOCKET	0x100
+#define GW_TAG_SIGNAL	0x101
+
+/** a bus attached to the gateway */
+struct gw_bus {
+	const char	*path;
+	unsigned int	 baud;
+	int		 fd;
+
+	struct h485_decoder dec;
+	uint8_t		 payload[GW_MAX_PAYLOAD];
+	long long	 rx_time;		/**< when bytes last came in, in ms */
+
+	uint8_t		 txbuf[GW_TXBUF];	/**< encoded bytes waiting for the serial port, in wire order */
+	size_t		 txlen;
+	uint8_t		 writing;		/**< set when waiting for EPOLLOUT */
+
+	unsigned long	 rx_frames, tx_frames, tx_drops;
+};
+
+/** a UDP peer with its SBLP address */
+struct gw_peer {
+	struct sockaddr_in addr;
+	uint8_t		 sblp;
+};
+
+static struct gw_bus	gw_buses[GW_MAX_BUSES];
+static unsigned int	gw_nbuses = 0;
+
+static struct gw_peer	gw_peers[GW_MAX_PEERS];
+static unsigned int	gw_npeers = 0;
+
+static uint8_t		gw_peer_of[256];	/**< SBLP address -> index in gw_peers */
+static uint8_t		gw_route[256];		/**< SBLP address -> index in gw_buses */
+static uint8_t		gw_static[256];		/**< set for routes given on the command line */
+
+static int		gw_epoll, gw_sock;
+static int		gw_verbose = 0;
+static uint8_t		gw_self = 0x01;		/**< our address on the buses */
+static int		gw_discover = 0;	/**< find the nodes on every bus at startup */
+
+/* address leases */
+static int		gw_pool_first = -1;	/**< first address to hand out, -1 for none */
+static int		gw_pool_last;
+static uint8_t		gw_leased[256];		/**< set for addresses leased to a node */
+static uint32_t		gw_lease_id[256];	/**< id of that node */
+
+/* outgoing datagrams, flushed once per loop iteration */
+static struct mmsghdr	gw_out[GW_BATCH];
+static struct iovec	gw_out_iov[GW_BATCH];
+static uint8_t		gw_out_buf[GW_BATCH][HEADER_LENGTH + GW_MAX_PAYLOAD];
+static unsigned int	gw_nout = 0;
+
+/* incoming datagrams */
+static struct mmsghdr	gw_in[GW_BATCH];
+static struct iovec	gw_in_iov[GW_BATCH];
+static struct sockaddr_in gw_in_addr[GW_BATCH];
+static uint8_t		gw_in_buf[GW_BATCH][HEADER_LENGTH + GW_MAX_PAYLOAD];
+
+static unsigned long	gw_udp_rx, gw_udp_tx, gw_udp_drops, gw_udp_unknown;
+
+static void die(const char *what) {
+	perror(what);
+	exit(1);
+}
+
+/** send all queued datagrams */
+static void gw_flush() {
+	unsigned int done = 0;
+	int n;
+
+	while(done < gw_nout) {
+		n = sendmmsg(gw_sock, gw_out + done, gw_nout - done, 0);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+
+			/* socket buffer full or peer gone -- drop the rest */
+			gw_udp_drops += gw_nout - done;
+			break;
+		}
+
+		gw_udp_tx += n;
+		done += n;
+	}
+
+	gw_nout = 0;
+}
+
+/** queue a frame as a datagram to the given peer */
+static void gw_queue_datagram(struct gw_peer *peer, struct sblp_header *header, uint8_t *payload) {
+	if(gw_nout == GW_BATCH)
+		gw_flush();
+
+	h485_pack_header(header, gw_out_buf[gw_nout]);
+	memcpy(gw_out_buf[gw_nout] + HEADER_LENGTH, payload, header->length);
+
+	gw_out_iov[gw_nout].iov_len		= HEADER_LENGTH + header->length;
+	gw_out[gw_nout].msg_hdr.msg_name	= &peer->addr;
+	gw_out[gw_nout].msg_hdr.msg_namelen	= sizeof(peer->addr);
+	gw_nout++;
+}
+
+/** monotonic time in ms */
+static long long gw_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/** can we start sending on a bus? Not while a node is halfway through a frame, unless it went quiet */
+static int gw_bus_clear(struct gw_bus *bus) {
+	return bus->writing || h485_idle(&bus->dec) || gw_now() - bus->rx_time >= GW_RX_TIMEOUT;
+}
+
+/** try to push out the transmit buffer of a bus, arming EPOLLOUT if it doesn't all fit */
+static void gw_bus_write(struct gw_bus *bus) {
+	struct epoll_event ev;
+	ssize_t n;
+
+	if(!gw_bus_clear(bus))
+		return;		/* held until the node is done, see the main loop */
+
+	while(bus->txlen) {
+		n = write(bus->fd, bus->txbuf, bus->txlen);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				fprintf(stderr, "%s: write: %s\n", bus->path, strerror(errno));
+			break;
+		}
+
+		memmove(bus->txbuf, bus->txbuf + n, bus->txlen - n);
+		bus->txlen -= n;
+	}
+
+	if(!!bus->txlen != bus->writing) {
+		bus->writing = !!bus->txlen;
+
+		ev.events = EPOLLIN | (bus->writing ? EPOLLOUT : 0);
+		ev.data.u32 = bus - gw_buses;
+		epoll_ctl(gw_epoll, EPOLL_CTL_MOD, bus->fd, &ev);
+	}
+}
+
+/** queue a frame for transmission on a bus */
+static void gw_bus_send(struct gw_bus *bus, struct sblp_header *header, uint8_t *payload) {
+	size_t len;
+
+	if(bus->fd < 0)
+		return;
+
+	if(bus->txlen + H485_ENCODED_SIZE(header->length) > GW_TXBUF) {
+		bus->tx_drops++;
+		return;
+	}
+
+	len = h485_encode(header, payload, bus->txbuf + bus->txlen);
+	h485_wire_order(bus->txbuf + bus->txlen, len);
+	bus->txlen += len;
+	bus->tx_frames++;
+
+	if(!bus->writing)
+		gw_bus_write(bus);
+}
+
+/** read a 32-bit value, MSB first */
+static uint32_t gw_get32(uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/** can the node with this id have this address? */
+static int gw_lease_ok(uint8_t a, uint32_t id) {
+	if(a >= SBLP_GROUP_FIRST || a == gw_self || gw_peer_of[a] != GW_NO_PEER)
+		return 0;
+
+	return !gw_leased[a] || gw_lease_id[a] == id;
+}
+
+/** record a lease */
+static void gw_lease_set(uint8_t a, uint32_t id) {
+	unsigned int i;
+
+	/* a node only has one address */
+	for(i=0; i<256; i++)
+		if(gw_leased[i] && gw_lease_id[i] == id)
+			gw_leased[i] = 0;
+
+	gw_leased[a] = 1;
+	gw_lease_id[a] = id;
+}
+
+/** answer a node asking for an address */
+static void gw_lease(struct gw_bus *bus, uint8_t *payload) {
+	struct sblp_header header;
+	uint32_t id = gw_get32(payload);
+	uint8_t grant[5];
+	int i, a = -1;
+
+	for(i=0; i<256 && a < 0; i++)
+		if(gw_leased[i] && gw_lease_id[i] == id)
+			a = i;
+
+	/* a node coming back with the address it had keeps it, if nobody else has it */
+	if(a < 0 && gw_lease_ok(payload[4], id))
+		a = payload[4];
+
+	/* otherwise, any address from the pool that hasn't been seen on a bus */
+	for(i=gw_pool_first; i<=gw_pool_last && a < 0; i++)
+		if(gw_lease_ok(i, id) && gw_route[i] == GW_NO_ROUTE)
+			a = i;
+
+	if(a < 0) {
+		fprintf(stderr, "%s: no address left for node %08x\n", bus->path, id);
+		return;
+	}
+
+	gw_lease_set(a, id);
+	if(!gw_static[a])
+		gw_route[a] = bus - gw_buses;
+
+	if(gw_verbose)
+		fprintf(stderr, "%s: node %08x gets address %02x\n", bus->path, id, a);
+
+	memcpy(grant, payload, 4);
+	grant[4] = a;
+
+	header.type	= LEASE_TYPE_GRANT;
+	header.length	= 5;
+	header.dest	= SBLP_BROADCAST;
+	header.src	= gw_self;
+	gw_bus_send(bus, &header, grant);
+}
+
+/** a node told another one it can't have its address */
+static void gw_lease_taken(uint8_t *payload) {
+	uint8_t a = payload[4];
+
+	/* it'll ask again; don't give it the same one */
+	if(gw_leased[a] && gw_lease_id[a] == gw_get32(payload))
+		gw_leased[a] = 0;
+}
+
+/** a frame was received from a bus */
+static void gw_bus_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	struct gw_bus *bus = ctx;
+	uint8_t peer;
+
+	bus->rx_frames++;
+
+	/* learn where the sender lives; nodes without an address send from the broadcast address */
+	if(header->src < SBLP_GROUP_FIRST && !gw_static[header->src])
+		gw_route[header->src] = bus - gw_buses;
+
+	if(gw_pool_first >= 0 && header->length == 5) {
+		if(header->type == LEASE_TYPE_REQUEST)
+			gw_lease(bus, payload);
+		else if(header->type == LEASE_TYPE_TAKEN)
+			gw_lease_taken(payload);
+	}
+
+	if((peer = gw_peer_of[header->dest]) != GW_NO_PEER) {
+		if(gw_verbose)
+			fprintf(stderr, "%s: frame %02x -> %02x (%u bytes) to udp\n",
+				bus->path, header->src, header->dest, header->length);
+		gw_queue_datagram(&gw_peers[peer], header, payload);
+	}
+}
+
+/** read whatever a bus has for us */
+static void gw_bus_read(struct gw_bus *bus) {
+	struct epoll_event ev;
+	uint8_t buf[GW_READ_CHUNK];
+	ssize_t n;
+
+	while((n = read(bus->fd, buf, sizeof(buf))) > 0) {
+		bus->rx_time = gw_now();
+		h485_wire_order(buf, n);
+		h485_decode(&bus->dec, buf, n);
+	}
+
+	if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+		/* serial port went away -- stop serving this bus */
+		fprintf(stderr, "%s: %s, bus disabled\n", bus->path, n ? strerror(errno) : "end of file");
+		epoll_ctl(gw_epoll, EPOLL_CTL_DEL, bus->fd, &ev);
+		close(bus->fd);
+		bus->fd = -1;
+	}
+}
+
+/** a node was found on a bus during discovery */
+static void gw_bus_found(void *ctx, uint32_t id, uint8_t address) {
+	struct gw_bus *bus = ctx;
+
+	fprintf(stderr, "%s: node %08x at address %02x\n", bus->path, id, address);
+
+	if(address >= SBLP_GROUP_FIRST)
+		return;
+
+	if(!gw_static[address])
+		gw_route[address] = bus - gw_buses;
+	if(gw_pool_first >= 0 && gw_lease_ok(address, id))
+		gw_lease_set(address, id);
+}
+
+/** find the peer a datagram came from */
+static struct gw_peer *gw_find_peer(struct sockaddr_in *addr) {
+	unsigned int i;
+
+	for(i=0; i<gw_npeers; i++)
+		if(gw_peers[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		   gw_peers[i].addr.sin_port == addr->sin_port)
+			return &gw_peers[i];
+
+	return NULL;
+}
+
+/** handle all pending datagrams */
+static void gw_sock_read() {
+	struct sblp_header header;
+	struct gw_peer *peer;
+	unsigned int i, b;
+	int n;
+
+	do {
+		for(i=0; i<GW_BATCH; i++)
+			gw_in[i].msg_hdr.msg_namelen = sizeof(gw_in_addr[i]);
+
+		n = recvmmsg(gw_sock, gw_in, GW_BATCH, MSG_DONTWAIT, NULL);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EINTR)
+				perror("recvmmsg");
+			return;
+		}
+
+		for(i=0; i<(unsigned int) n; i++) {
+			gw_udp_rx++;
+
+			if(!(peer = gw_find_peer(&gw_in_addr[i]))) {
+				gw_udp_unknown++;
+				continue;
+			}
+
+			h485_unpack_header(&header, gw_in_buf[i]);
+			if(gw_in[i].msg_len < HEADER_LENGTH ||
+			   header.length != gw_in[i].msg_len - HEADER_LENGTH) {
+				gw_udp_drops++;
+				continue;
+			}
+
+			/* translate the source address, then route on the destination */
+			header.src = peer->sblp;
+
+			if(gw_route[header.dest] != GW_NO_ROUTE) {
+				gw_bus_send(&gw_buses[gw_route[header.dest]], &header, gw_in_buf[i] + HEADER_LENGTH);
+			} else {
+				for(b=0; b<gw_nbuses; b++)
+					gw_bus_send(&gw_buses[b], &header, gw_in_buf[i] + HEADER_LENGTH);
+			}
+		}
+	} while(n == GW_BATCH);
+}
+
+static void gw_dump_stats() {
+	unsigned int i;
+	struct gw_bus *bus;
+
+	fprintf(stderr, "udp: %lu in, %lu out, %lu dropped, %lu from unknown peers\n",
+		gw_udp_rx, gw_udp_tx, gw_udp_drops, gw_udp_unknown);
+
+	for(i=0; i<gw_nbuses; i++) {
+		bus = &gw_buses[i];
+		fprintf(stderr, "bus %u (%s): %lu in, %lu out, %lu dropped, %lu syncs, %lu preambles, %lu truncated, %lu bad escapes, %lu overruns\n",
+			i, bus->path, bus->rx_frames, bus->tx_frames, bus->tx_drops,
+			bus->dec.syncs, bus->dec.preambles, bus->dec.truncated, bus->dec.bad_escapes, bus->dec.overruns);
+	}
+}
+
+/** resolve host:port into an IPv4 socket address */
+static int gw_resolve(const char *spec, struct sockaddr_in *addr) {
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *port;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags    = AI_PASSIVE;
+
+	if((port = strrchr(spec, ':'))) {
+		if((size_t) (port - spec) >= sizeof(host))
+			return -1;
+		memcpy(host, spec, port - spec);
+		host[port - spec] = '\0';
+		port++;
+	} else {
+		port = spec;
+	}
+
+	if(getaddrinfo(port == spec ? NULL : host, port, &hints, &res))
+		return -1;
+
+	memcpy(addr, res->ai_addr, sizeof(*addr));
+	freeaddrinfo(res);
+	return 0;
+}
+
+/** parse "addr=rest", returning rest */
+static const char *gw_parse_mapping(const char *spec, uint8_t *sblp) {
+	unsigned long a;
+	char *end;
+
+	a = strtoul(spec, &end, 0);
+	if(end == spec || *end != '=' || a > 255)
+		return NULL;
+
+	*sblp = a;
+	return end + 1;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s [-v] [-d] [-a first-last] [-s addr] [-w syncs] [-l [host:]port] -b tty[@baud] ... [-p addr=host:port] ... [-r addr=bus] ...\n"
+		"\t-l  listen for datagrams on this address (default port %d)\n"
+		"\t-b  serve the bus attached to this serial port (default %d baud)\n"
+		"\t-p  give a UDP peer an SBLP address\n"
+		"\t-r  fix the bus (numbered from 0 in -b order) an SBLP address lives on\n"
+		"\t-s  our own address on the buses (default 0x01)\n"
+		"\t-d  find the nodes on every bus at startup\n"
+		"\t-a  lease addresses in this range to nodes that ask for one\n"
+		"\t-w  send this many extra syncs before each frame to wake sleeping nodes\n"
+		"\t-v  log every forwarded frame\n"
+		"send SIGUSR1 for statistics\n",
+		argv0, GW_DEFAULT_PORT, H485_DEFAULT_BAUD);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct sockaddr_in listen_addr;
+	struct epoll_event ev, events[16];
+	struct signalfd_siginfo si;
+	struct gw_bus *bus;
+	const char *rest;
+	char *at;
+	sigset_t sigs;
+	unsigned long n;
+	unsigned int i;
+	uint8_t a;
+	long long wait;
+	int opt, sfd, nev, queries, timeout, running = 1;
+
+	memset(gw_peer_of, GW_NO_PEER, sizeof(gw_peer_of));
+	memset(gw_route, GW_NO_ROUTE, sizeof(gw_route));
+	memset(&listen_addr, 0, sizeof(listen_addr));
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_port = htons(GW_DEFAULT_PORT);
+
+	while((opt = getopt(argc, argv, "vds:a:w:l:b:p:r:")) != -1) {
+		switch(opt) {
+			case 'v':
+				gw_verbose = 1;
+				break;
+
+			case 'd':
+				gw_discover = 1;
+				break;
+
+			case 's':
+				n = strtoul(optarg, NULL, 0);
+				if(n >= SBLP_GROUP_FIRST)
+					usage(argv[0]);
+				gw_self = n;
+				break;
+
+			case 'a':
+				gw_pool_first = strtoul(optarg, &at, 0);
+				if(*at != '-')
+					usage(argv[0]);
+				gw_pool_last = strtoul(at + 1, NULL, 0);
+				if(gw_pool_first > gw_pool_last || gw_pool_last >= SBLP_GROUP_FIRST)
+					usage(argv[0]);
+				break;
+
+			case 'w':
+				n = strtoul(optarg, NULL, 0);
+				if(n > H485_MAX_PREAMBLE)
+					usage(argv[0]);
+				h485_set_preamble(n);
+				break;
+
+			case 'l':
+				if(gw_resolve(optarg, &listen_addr))
+					usage(argv[0]);
+				break;
+
+			case 'b':
+				if(gw_nbuses == GW_MAX_BUSES)
+					usage(argv[0]);
+
+				bus = &gw_buses[gw_nbuses++];
+				bus->path = optarg;
+				bus->baud = H485_DEFAULT_BAUD;
+				if((at = strchr(optarg, '@'))) {
+					*at = '\0';
+					bus->baud = strtoul(at + 1, NULL, 10);
+				}
+				break;
+
+			case 'p':
+				if(gw_npeers == GW_MAX_PEERS ||
+				   !(rest = gw_parse_mapping(optarg, &a)) ||
+				   gw_resolve(rest, &gw_peers[gw_npeers].addr))
+					usage(argv[0]);
+
+				gw_peers[gw_npeers].sblp = a;
+				gw_peer_of[a] = gw_npeers++;
+				break;
+
+			case 'r':
+				if(!(rest = gw_parse_mapping(optarg, &a)))
+					usage(argv[0]);
+
+				n = strtoul(rest, NULL, 0);
+				gw_route[a] = n;
+				gw_static[a] = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(!gw_nbuses)
+		usage(argv[0]);
+
+	for(i=0; i<256; i++)
+		if(gw_static[i] && gw_route[i] >= gw_nbuses)
+			usage(argv[0]);
+
+	if((gw_epoll = epoll_create1(0)) < 0)
+		die("epoll_create1");
+
+	/* buses */
+	for(i=0; i<gw_nbuses; i++) {
+		bus = &gw_buses[i];
+
+		if((bus->fd = h485_open_tty(bus->path, bus->baud)) < 0)
+			die(bus->path);
+
+		/* whatever the nodes caught of the line so far, they start out in step with us */
+		if(h485_send_break(bus->fd, bus->baud) < 0)
+			die(bus->path);
+
+		h485_decoder_init(&bus->dec, bus->payload, sizeof(bus->payload), gw_bus_frame, bus);
+
+		if(gw_discover) {
+			if((queries = h485_discover(bus->fd, bus->baud, gw_self, gw_bus_found, bus)) < 0)
+				die(bus->path);
+			fprintf(stderr, "%s: discovery took %d queries\n", bus->path, queries);
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if(epoll_ctl(gw_epoll, EPOLL_CTL_ADD, bus->fd, &ev) < 0)
+			die("epoll_ctl");
+	}
+
+	/* UDP socket */
+	if((gw_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0)
+		die("socket");
+	if(bind(gw_sock, (struct sockaddr *) &listen_addr, sizeof(listen_addr)) < 0)
+		die("bind");
+
+	for(i=0; i<GW_BATCH; i++) {
+		gw_in_iov[i].iov_base		= gw_in_buf[i];
+		gw_in_iov[i].iov_len		= sizeof(gw_in_buf[i]);
+		gw_in[i].msg_hdr.msg_iov	= &gw_in_iov[i];
+		gw_in[i].msg_hdr.msg_iovlen	= 1;
+		gw_in[i].msg_hdr.msg_name	= &gw_in_addr[i];
+
+		gw_out_iov[i].iov_base		= gw_out_buf[i];
+		gw_out[i].msg_hdr.msg_iov	= &gw_out_iov[i];
+		gw_out[i].msg_hdr.msg_iovlen	= 1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = GW_TAG_SOCKET;
+	if(epoll_ctl(gw_epoll, EPOLL_CTL_ADD, gw_sock, &ev) < 0)
+		die("epoll_ctl");
+
+	/* signals are handled from the loop as well */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	if((sfd = signalfd(-1, &sigs, SFD_NONBLOCK)) < 0)
+		die("signalfd");
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = GW_TAG_SIGNAL;
+	if(epoll_ctl(gw_epoll, EPOLL_CTL_ADD, sfd, &ev) < 0)
+		die("epoll_ctl");
+
+	while(running) {
+		/* wake up when a held bus times out */
+		timeout = -1;
+		for(i=0; i<gw_nbuses; i++) {
+			bus = &gw_buses[i];
+			if(bus->fd < 0 || !bus->txlen || bus->writing)
+				continue;
+
+			wait = bus->rx_time + GW_RX_TIMEOUT - gw_now();
+			if(wait < 0)
+				wait = 0;
+			if(timeout < 0 || wait < timeout)
+				timeout = wait;
+		}
+
+		if((nev = epoll_wait(gw_epoll, events, 16, timeout)) < 0) {
+			if(errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+
+		for(i=0; i<(unsigned int) nev; i++) {
+			switch(events[i].data.u32) {
+				case GW_TAG_SOCKET:
+					gw_sock_read();
+					break;
+
+				case GW_TAG_SIGNAL:
+					while(read(sfd, &si, sizeof(si)) == sizeof(si)) {
+						if(si.ssi_signo == SIGUSR1)
+							gw_dump_stats();
+						else
+							running = 0;
+					}
+					break;
+
+				default:
+					bus = &gw_buses[events[i].data.u32];
+					if(bus->fd < 0)
+						break;
+
+					if(events[i].events & EPOLLOUT)
+						gw_bus_write(bus);
+					if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+						gw_bus_read(bus);
+					break;
+			}
+		}
+
+		/* send what was held for buses whose nodes are done */
+		for(i=0; i<gw_nbuses; i++)
+			if(gw_buses[i].fd >= 0 && gw_buses[i].txlen && !gw_buses[i].writing)
+				gw_bus_write(&gw_buses[i]);
+
+		gw_flush();
+	}
+
+	gw_dump_stats();
+	return 0;
+}
@@ -0,0 +1,307 @@
+/** \file sim.c
+ * \brief Test of the gateway on pseudo terminals and a loopback socket.
+ *
+ * Starts the gateway on the slave ends of SIM_BUSES pty pairs, with one
+ * UDP peer on 127.0.0.1. The test plays the nodes on the master ends and
+ * the peer on its own socket:
+ *
+ *	flood		a datagram for an unknown address goes to every bus, from the peer's address
+ *	to udp		a frame for the peer's address comes out as a datagram
+ *	route		once a node has been heard, datagrams for it only go to its bus
+ *	hold		nothing goes out on a bus while a node on it is halfway through a frame
+ *	stale		unless that node has gone quiet
+ *
+ * The exit status is non-zero when something is off.
+ *
+ * usage: sim [gateway]
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+
+#define SIM_BUSES	2
+#define SIM_PEER	0x80		/**< SBLP address of the UDP peer */
+#define SIM_NODE	0x10		/**< a node on bus 0 */
+#define SIM_MAX_PAYLOAD	1024
+#define SIM_QUIET	300		/**< ms without output before a step is over */
+#define SIM_SEEN	10		/**< ms for bytes written to a pty to reach the other end */
+#define SIM_HOLD	30		/**< ms a bus must stay silent while its node is sending, well below GW_RX_TIMEOUT */
+
+/** one bus as its nodes see it */
+static struct sim_bus {
+	int		 fd;		/**< master end */
+	char		 path[64];	/**< slave end, for the gateway */
+
+	struct h485_decoder dec;
+	uint8_t		 payload[SIM_MAX_PAYLOAD];
+	unsigned int	 frames;	/**< frames come out here */
+	unsigned int	 bad;		/**< of which with a payload that isn't what was sent */
+	struct sblp_header last;
+} sim_buses[SIM_BUSES];
+
+/** the peer */
+static int		 sim_sock;
+static struct sockaddr_in sim_gateway;
+static unsigned int	 sim_datagrams, sim_bad_datagrams;
+static struct sblp_header sim_last_datagram;
+
+static unsigned int	 sim_errors;
+
+/** the payload of frame seq: varied enough to contain syncs and escapes */
+static void sim_fill(uint8_t *payload, uint16_t length, uint8_t seq) {
+	uint16_t i;
+
+	for(i=0; i<length; i++)
+		payload[i] = seq + i * 7;
+}
+
+/** the payload is what sim_fill() makes of its first byte */
+static int sim_good(uint8_t *payload, uint16_t length) {
+	uint8_t expect[SIM_MAX_PAYLOAD];
+
+	if(!payload)
+		return 0;
+
+	sim_fill(expect, length, length ? payload[0] : 0);
+	return !memcmp(payload, expect, length);
+}
+
+static void sim_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	struct sim_bus *bus = ctx;
+
+	bus->frames++;
+	bus->last = *header;
+	if(!sim_good(payload, header->length))
+		bus->bad++;
+}
+
+static void sim_check(const char *what, int ok) {
+	if(!ok) {
+		printf("FAIL %s\n", what);
+		sim_errors++;
+	}
+}
+
+/** encode a frame in wire order, returning its length */
+static size_t sim_encode(uint8_t *buf, uint8_t src, uint8_t dest, uint16_t length, uint8_t seq) {
+	uint8_t payload[SIM_MAX_PAYLOAD];
+	struct sblp_header header = { 0x10, length, dest, src };
+	size_t len;
+
+	sim_fill(payload, length, seq);
+	len = h485_encode(&header, payload, buf);
+	h485_wire_order(buf, len);
+	return len;
+}
+
+/** put bytes on a bus, as one of its nodes */
+static void sim_write(int bus, const uint8_t *buf, size_t len) {
+	size_t off = 0;
+	ssize_t n;
+
+	while(off < len) {
+		if((n = write(sim_buses[bus].fd, buf + off, len - off)) < 0) {
+			poll(&(struct pollfd) { sim_buses[bus].fd, POLLOUT, 0 }, 1, 100);
+			continue;
+		}
+		off += n;
+	}
+}
+
+/** put a frame on a bus */
+static void sim_send(int bus, uint8_t src, uint8_t dest, uint16_t length, uint8_t seq) {
+	uint8_t buf[H485_ENCODED_SIZE(SIM_MAX_PAYLOAD)];
+
+	sim_write(bus, buf, sim_encode(buf, src, dest, length, seq));
+}
+
+/** send a frame to the gateway as the peer. The source address is the gateway's to fill in. */
+static void sim_datagram(uint8_t dest, uint16_t length, uint8_t seq) {
+	uint8_t buf[HEADER_LENGTH + SIM_MAX_PAYLOAD];
+	struct sblp_header header = { 0x10, length, dest, 0 };
+
+	h485_pack_header(&header, buf);
+	sim_fill(buf + HEADER_LENGTH, length, seq);
+	sendto(sim_sock, buf, HEADER_LENGTH + length, 0, (struct sockaddr *) &sim_gateway, sizeof(sim_gateway));
+}
+
+/** nothing comes out on a bus for ms */
+static int sim_silent(int bus, int ms) {
+	return poll(&(struct pollfd) { sim_buses[bus].fd, POLLIN, 0 }, 1, ms) == 0;
+}
+
+/** read what the gateway sends until it has been quiet for SIM_QUIET ms */
+static void sim_collect() {
+	struct pollfd pfd[SIM_BUSES + 1];
+	uint8_t buf[4096];
+	unsigned int i;
+	ssize_t len;
+
+	for(i=0; i<SIM_BUSES; i++) {
+		sim_buses[i].frames = sim_buses[i].bad = 0;
+		pfd[i].fd = sim_buses[i].fd;
+		pfd[i].events = POLLIN;
+	}
+	sim_datagrams = sim_bad_datagrams = 0;
+	pfd[SIM_BUSES].fd = sim_sock;
+	pfd[SIM_BUSES].events = POLLIN;
+
+	while(poll(pfd, SIM_BUSES + 1, SIM_QUIET) > 0) {
+		for(i=0; i<SIM_BUSES; i++) {
+			if(!(pfd[i].revents & POLLIN) || (len = read(pfd[i].fd, buf, sizeof(buf))) <= 0)
+				continue;
+
+			h485_wire_order(buf, len);
+			h485_decode(&sim_buses[i].dec, buf, len);
+		}
+
+		if((pfd[SIM_BUSES].revents & POLLIN) && (len = recv(sim_sock, buf, sizeof(buf), 0)) >= HEADER_LENGTH) {
+			sim_datagrams++;
+			h485_unpack_header(&sim_last_datagram, buf);
+			if(sim_last_datagram.length != len - HEADER_LENGTH ||
+			   !sim_good(buf + HEADER_LENGTH, sim_last_datagram.length))
+				sim_bad_datagrams++;
+		}
+	}
+}
+
+/** the frame came out on exactly the buses in mask, whole and from src */
+static void sim_expect(const char *what, unsigned int mask, uint8_t src, uint16_t length) {
+	unsigned int i;
+
+	for(i=0; i<SIM_BUSES; i++) {
+		if(mask & (1 << i))
+			sim_check(what, sim_buses[i].frames == 1 && !sim_buses[i].bad &&
+				sim_buses[i].last.src == src && sim_buses[i].last.length == length);
+		else
+			sim_check(what, sim_buses[i].frames == 0);
+	}
+}
+
+/** a single whole datagram came out, from src */
+static void sim_expect_datagram(const char *what, uint8_t src, uint16_t length) {
+	sim_check(what, sim_datagrams == 1 && !sim_bad_datagrams && sim_last_datagram.src == src &&
+		sim_last_datagram.dest == SIM_PEER && sim_last_datagram.length == length);
+}
+
+/** bind a loopback UDP socket to a free port */
+static int sim_bind(struct sockaddr_in *addr) {
+	socklen_t addrlen = sizeof(*addr);
+	int fd;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0 ||
+	   bind(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0 ||
+	   getsockname(fd, (struct sockaddr *) addr, &addrlen) < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	return fd;
+}
+
+int main(int argc, char **argv) {
+	const char *gateway = argc > 1 ? argv[1] : "./gateway";
+	uint8_t buf[H485_ENCODED_SIZE(SIM_MAX_PAYLOAD)];
+	char listen[32], peer[40];
+	struct sockaddr_in addr;
+	struct termios tio;
+	size_t len;
+	int i, fd;
+	pid_t pid;
+
+	for(i=0; i<SIM_BUSES; i++) {
+		struct sim_bus *bus = &sim_buses[i];
+
+		if((bus->fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(bus->fd) || unlockpt(bus->fd)) {
+			perror("posix_openpt");
+			return 1;
+		}
+		snprintf(bus->path, sizeof(bus->path), "%s", ptsname(bus->fd));
+
+		/* raw from the start, or the line discipline echoes what we send */
+		tcgetattr(bus->fd, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(bus->fd, TCSANOW, &tio);
+		fcntl(bus->fd, F_SETFL, O_NONBLOCK);
+
+		h485_decoder_init(&bus->dec, bus->payload, sizeof(bus->payload), sim_frame, bus);
+	}
+
+	/* the peer's socket, and a free port for the gateway's */
+	sim_sock = sim_bind(&addr);
+	snprintf(peer, sizeof(peer), "%d=127.0.0.1:%d", SIM_PEER, ntohs(addr.sin_port));
+	fd = sim_bind(&sim_gateway);
+	close(fd);
+	snprintf(listen, sizeof(listen), "127.0.0.1:%d", ntohs(sim_gateway.sin_port));
+
+	if(!(pid = fork())) {
+		/* quiet: only its statistics on the way out */
+		if((fd = open("/dev/null", O_WRONLY)) >= 0)
+			dup2(fd, 2);
+		execl(gateway, gateway, "-l", listen, "-b", sim_buses[0].path, "-b", sim_buses[1].path, "-p", peer, (char *) NULL);
+		_exit(1);
+	}
+	usleep(300000);		/* let it open the ports */
+
+	/* flood: nothing is known yet */
+	sim_datagram(SIM_NODE, 20, 1);
+	sim_collect();
+	sim_expect("flood", 0x3, SIM_PEER, 20);
+
+	/* to udp: the node answers, and is now known to be on bus 0 */
+	sim_send(0, SIM_NODE, SIM_PEER, 200, 2);
+	sim_collect();
+	sim_expect("to udp", 0x0, 0, 0);
+	sim_expect_datagram("to udp", SIM_NODE, 200);
+
+	/* route */
+	sim_datagram(SIM_NODE, 0, 3);
+	sim_collect();
+	sim_expect("route", 0x1, SIM_PEER, 0);
+
+	/* hold: the node is halfway through a frame when a datagram for it comes in; that one waits for the end */
+	len = sim_encode(buf, SIM_NODE, SIM_PEER, 100, 4);
+	sim_write(0, buf, len / 2);
+	usleep(SIM_SEEN * 1000);	/* the gateway must have read it, or it's a plain collision */
+	sim_datagram(SIM_NODE, 20, 5);
+	sim_check("hold: held", sim_silent(0, SIM_HOLD));
+	sim_write(0, buf + len / 2, len - len / 2);
+	sim_collect();
+	sim_expect("hold", 0x1, SIM_PEER, 20);
+	sim_expect_datagram("hold", SIM_NODE, 100);
+
+	/* stale: this time it stops halfway, and the gateway sends over it after a while */
+	len = sim_encode(buf, SIM_NODE, SIM_PEER, 100, 6);
+	sim_write(0, buf, len / 2);
+	sim_datagram(SIM_NODE, 20, 7);
+	sim_collect();
+	sim_expect("stale", 0x1, SIM_PEER, 20);
+	sim_check("stale", sim_datagrams == 0);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	if(!sim_errors)
+		printf("OK\n");
+	return sim_errors != 0;
+}
@@ -0,0 +1,481 @@
+/** \file router.c
+ * \brief Multi-segment SpaceBus router.
+ *
+ * Connects several bus segments (each attached through an RS485 serial
+ * adapter) and forwards frames between them by destination address.
+ *
+ * The routing table is a direct-indexed array holding the segment every
+ * address lives on. Entries are learned from the source address of frames
+ * seen on each segment, or fixed with -r. Only unicast addresses are
+ * learned: unleased nodes send from the broadcast address, and frames to
+ * groups and broadcasts are always flooded.
+ *
+ * Frames are forwarded cut-through: as soon as the destination byte of a
+ * header is in, the router starts sending the frame on the egress segment
+ * and passes every following byte on as it arrives, so a frame crossing
+ * the router is delayed by a few bytes rather than by a full frame time.
+ * When the egress segment is still busy with another cut-through frame,
+ * its transmit buffer hasn't room for the whole frame, or the destination
+ * is unknown, the frame is stored and forwarded once complete instead.
+ *
+ * Segments are half-duplex: nothing is started on one while a node on it
+ * is in the middle of a frame. Frames for it wait in its transmit buffer
+ * until its decoder is between frames again, or until the node has been
+ * quiet for RT_RX_TIMEOUT, in case it stopped halfway; and a frame for it
+ * isn't cut through then, but stored.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+
+#define RT_MAX_SEGMENTS	8		/**< number of segments a router can connect */
+#define RT_MAX_PAYLOAD	1024		/**< largest payload that can be stored and forwarded */
+#define RT_TXBUF	16384		/**< per-segment transmit buffer */
+#define RT_BACKLOG	16384		/**< per-segment buffer for frames waiting on a cut-through */
+#define RT_READ_CHUNK	256		/**< bytes read at a time -- small keeps cut-through latency low */
+#define RT_RX_TIMEOUT	100		/**< ms a node may stall in the middle of a frame before we send over it */
+
+#define RT_NO_ROUTE	0xFF		/**< route table entry for an unknown destination */
+#define RT_NONE		-1		/**< no segment */
+
+#define RT_TAG_SIGNAL	0x100		/**< epoll tag for the signalfd */
+
+/** a segment connected to the router */
+struct rt_segment {
+	const char	*path;
+	unsigned int	 baud;
+	int		 fd;
+
+	struct h485_decoder dec;
+	uint8_t		 payload[RT_MAX_PAYLOAD];
+	long long	 rx_time;		/**< when bytes last came in, in ms */
+
+	uint8_t		 txbuf[RT_TXBUF];	/**< bytes waiting for the serial port, in wire order */
+	size_t		 txlen;
+	uint8_t		 writing;		/**< set when waiting for EPOLLOUT */
+
+	uint8_t		 backlog[RT_BACKLOG];	/**< stored frames held back while cut_from is streaming */
+	size_t		 backlog_len;
+
+	int		 cut_from;		/**< segment currently cutting through to us */
+	int		 cut_to;		/**< segment our current frame is cut through to */
+
+	unsigned long	 rx_frames, cut_frames, stored_frames, aborted, drops;
+};
+
+static struct rt_segment rt_segments[RT_MAX_SEGMENTS];
+static unsigned int	 rt_nsegments = 0;
+
+static uint8_t		 rt_route[256];		/**< address -> segment */
+static uint8_t		 rt_static[256];	/**< set for routes given on the command line */
+
+static int		 rt_epoll;
+static int		 rt_verbose = 0;
+
+/** the segment a destination lives on, or RT_NO_ROUTE to flood the frame */
+static uint8_t rt_route_of(uint8_t dest) {
+	if(dest >= SBLP_GROUP_FIRST)
+		return RT_NO_ROUTE;
+
+	return rt_route[dest];
+}
+
+static void die(const char *what) {
+	perror(what);
+	exit(1);
+}
+
+/** append wire-order bytes to a buffer, returning 0 if they don't fit */
+static int rt_append(uint8_t *buf, size_t *len, size_t size, const uint8_t *data, size_t n) {
+	if(*len + n > size)
+		return 0;
+
+	memcpy(buf + *len, data, n);
+	h485_wire_order(buf + *len, n);
+	*len += n;
+	return 1;
+}
+
+/** monotonic time in ms */
+static long long rt_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/** can we send on a segment? Not while a node is halfway through a frame, unless it went quiet.
+ * Once something of ours is on the wire -- a write waiting for EPOLLOUT or a cut-through frame -- it's finished regardless.
+ */
+static int rt_clear(struct rt_segment *seg) {
+	return seg->writing || seg->cut_from != RT_NONE || h485_idle(&seg->dec) ||
+		rt_now() - seg->rx_time >= RT_RX_TIMEOUT;
+}
+
+/** push out as much of the transmit buffer as the serial port takes */
+static void rt_write(struct rt_segment *seg) {
+	struct epoll_event ev;
+	ssize_t n;
+
+	if(!rt_clear(seg))
+		return;		/* held until the node is done, see the main loop */
+
+	while(seg->txlen) {
+		n = write(seg->fd, seg->txbuf, seg->txlen);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				fprintf(stderr, "%s: write: %s\n", seg->path, strerror(errno));
+			break;
+		}
+
+		memmove(seg->txbuf, seg->txbuf + n, seg->txlen - n);
+		seg->txlen -= n;
+	}
+
+	if(!!seg->txlen != seg->writing) {
+		seg->writing = !!seg->txlen;
+
+		ev.events = EPOLLIN | (seg->writing ? EPOLLOUT : 0);
+		ev.data.u32 = seg - rt_segments;
+		epoll_ctl(rt_epoll, EPOLL_CTL_MOD, seg->fd, &ev);
+	}
+}
+
+/** queue a complete frame on a segment */
+static void rt_store(struct rt_segment *seg, struct sblp_header *header, uint8_t *payload) {
+	uint8_t buf[H485_ENCODED_SIZE(RT_MAX_PAYLOAD)];
+	size_t len;
+	int ok;
+
+	if(seg->fd < 0)
+		return;
+
+	len = h485_encode(header, payload, buf);
+
+	/* frames can't be slotted in the middle of a cut-through frame */
+	if(seg->cut_from == RT_NONE)
+		ok = rt_append(seg->txbuf, &seg->txlen, RT_TXBUF, buf, len);
+	else
+		ok = rt_append(seg->backlog, &seg->backlog_len, RT_BACKLOG, buf, len);
+
+	if(ok)
+		seg->stored_frames++;
+	else
+		seg->drops++;
+}
+
+/** a cut-through to this segment has ended -- release the held back frames */
+static void rt_release(struct rt_segment *seg) {
+	seg->cut_from = RT_NONE;
+
+	if(seg->backlog_len) {
+		if(seg->txlen + seg->backlog_len <= RT_TXBUF) {
+			memcpy(seg->txbuf + seg->txlen, seg->backlog, seg->backlog_len);
+			seg->txlen += seg->backlog_len;
+		} else {
+			seg->drops++;
+		}
+		seg->backlog_len = 0;
+	}
+}
+
+/** append a single byte to a segment's transmit buffer, escaping it if needed */
+static int rt_put(struct rt_segment *seg, uint8_t b) {
+	uint8_t buf[2];
+	size_t len = 0;
+
+	switch(b) {
+		case H485_SYNC_BYTE:
+			buf[len++] = H485_ESCAPE_BYTE;
+			buf[len++] = H485_ESCAPED_SYNC;
+			break;
+
+		case H485_ESCAPE_BYTE:
+			buf[len++] = H485_ESCAPE_BYTE;
+			buf[len++] = H485_ESCAPED_ESCAPE;
+			break;
+
+		default:
+			buf[len++] = b;
+			break;
+	}
+
+	return rt_append(seg->txbuf, &seg->txlen, RT_TXBUF, buf, len);
+}
+
+/** destination known: decide whether to cut through */
+static int rt_cut(void *ctx, struct sblp_header *header) {
+	struct rt_segment *in = ctx, *out;
+	uint8_t sync = H485_SYNC_BYTE;
+
+	if(rt_route_of(header->dest) == RT_NO_ROUTE)
+		return 0;	/* unknown or a group -- flood it once complete */
+
+	out = &rt_segments[rt_route_of(header->dest)];
+	if(out == in || out->fd < 0 || out->cut_from != RT_NONE || out->backlog_len || !rt_clear(out))
+		return 0;
+
+	/* the whole frame must fit, escaped, or we store instead: once it's going, there's no taking bytes back */
+	if(out->txlen + H485_ENCODED_SIZE(header->length) > RT_TXBUF)
+		return 0;
+
+	/* replay the header up to here, the rest follows through rt_stream */
+	rt_append(out->txbuf, &out->txlen, RT_TXBUF, &sync, 1);
+	rt_put(out, header->type);
+	rt_put(out, (header->length >> 8) & 0xFF);
+	rt_put(out, header->length & 0xFF);
+	rt_put(out, header->dest);
+
+	out->cut_from = in - rt_segments;
+	in->cut_to = out - rt_segments;
+	return 1;
+}
+
+/** pass on a byte of a cut-through frame */
+static void rt_stream(void *ctx, uint8_t b) {
+	struct rt_segment *in = ctx, *out = &rt_segments[in->cut_to];
+
+	if(!rt_put(out, b))
+		out->drops++;	/* can't happen: rt_cut() made room for all of it */
+}
+
+/** a cut-through frame was cut short on the ingress side */
+static void rt_abort(void *ctx) {
+	struct rt_segment *in = ctx;
+
+	/* the egress receivers will see the truncation at the next sync */
+	in->aborted++;
+	rt_release(&rt_segments[in->cut_to]);
+	in->cut_to = RT_NONE;
+}
+
+/** a frame is complete */
+static void rt_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	struct rt_segment *in = ctx;
+	unsigned int i, seg = in - rt_segments;
+
+	in->rx_frames++;
+
+	if(header->src < SBLP_GROUP_FIRST && !rt_static[header->src])
+		rt_route[header->src] = seg;
+
+	if(in->cut_to != RT_NONE) {
+		/* already forwarded */
+		if(rt_verbose)
+			fprintf(stderr, "%s: %02x -> %02x cut through to %s\n",
+				in->path, header->src, header->dest, rt_segments[in->cut_to].path);
+
+		in->cut_frames++;
+		rt_release(&rt_segments[in->cut_to]);
+		in->cut_to = RT_NONE;
+		return;
+	}
+
+	if(!payload)
+		return;
+
+	if(rt_route_of(header->dest) == seg) {
+		/* local traffic */
+	} else if(rt_route_of(header->dest) != RT_NO_ROUTE) {
+		rt_store(&rt_segments[rt_route_of(header->dest)], header, payload);
+	} else {
+		for(i=0; i<rt_nsegments; i++)
+			if(i != seg)
+				rt_store(&rt_segments[i], header, payload);
+	}
+}
+
+/** read whatever a segment has for us */
+static void rt_read(struct rt_segment *seg) {
+	struct epoll_event ev;
+	uint8_t buf[RT_READ_CHUNK];
+	ssize_t n;
+
+	while((n = read(seg->fd, buf, sizeof(buf))) > 0) {
+		seg->rx_time = rt_now();
+		h485_wire_order(buf, n);
+		h485_decode(&seg->dec, buf, n);
+	}
+
+	if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+		fprintf(stderr, "%s: %s, segment disabled\n", seg->path, n ? strerror(errno) : "end of file");
+		epoll_ctl(rt_epoll, EPOLL_CTL_DEL, seg->fd, &ev);
+		close(seg->fd);
+		seg->fd = -1;
+	}
+}
+
+static void rt_dump_stats() {
+	struct rt_segment *seg;
+	unsigned int i;
+
+	for(i=0; i<rt_nsegments; i++) {
+		seg = &rt_segments[i];
+		fprintf(stderr, "segment %u (%s): %lu in, %lu cut through, %lu stored, %lu aborted, %lu dropped, %lu truncated\n",
+			i, seg->path, seg->rx_frames, seg->cut_frames, seg->stored_frames,
+			seg->aborted, seg->drops, seg->dec.truncated);
+	}
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s [-v] -s tty[@baud] ... [-r addr=segment] ...\n"
+		"\t-s  connect the segment attached to this serial port (default %d baud)\n"
+		"\t-r  fix the segment (numbered from 0 in -s order) an address lives on\n"
+		"\t-v  log every cut-through frame\n"
+		"send SIGUSR1 for statistics\n",
+		argv0, H485_DEFAULT_BAUD);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct epoll_event ev, events[16];
+	struct signalfd_siginfo si;
+	struct rt_segment *seg;
+	unsigned long a, s;
+	unsigned int i;
+	sigset_t sigs;
+	char *at, *end;
+	long long wait;
+	int opt, sfd, nev, timeout, running = 1;
+
+	memset(rt_route, RT_NO_ROUTE, sizeof(rt_route));
+
+	while((opt = getopt(argc, argv, "vs:r:")) != -1) {
+		switch(opt) {
+			case 'v':
+				rt_verbose = 1;
+				break;
+
+			case 's':
+				if(rt_nsegments == RT_MAX_SEGMENTS)
+					usage(argv[0]);
+
+				seg = &rt_segments[rt_nsegments++];
+				seg->path = optarg;
+				seg->baud = H485_DEFAULT_BAUD;
+				if((at = strchr(optarg, '@'))) {
+					*at = '\0';
+					seg->baud = strtoul(at + 1, NULL, 10);
+				}
+				break;
+
+			case 'r':
+				a = strtoul(optarg, &end, 0);
+				if(end == optarg || *end != '=' || a >= SBLP_GROUP_FIRST)
+					usage(argv[0]);
+
+				s = strtoul(end + 1, NULL, 0);
+				rt_route[a] = s;
+				rt_static[a] = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(rt_nsegments < 2)
+		usage(argv[0]);
+
+	for(i=0; i<256; i++)
+		if(rt_static[i] && rt_route[i] >= rt_nsegments)
+			usage(argv[0]);
+
+	if((rt_epoll = epoll_create1(0)) < 0)
+		die("epoll_create1");
+
+	for(i=0; i<rt_nsegments; i++) {
+		seg = &rt_segments[i];
+		seg->cut_from = seg->cut_to = RT_NONE;
+
+		if((seg->fd = h485_open_tty(seg->path, seg->baud)) < 0)
+			die(seg->path);
+
+		h485_decoder_init(&seg->dec, seg->payload, sizeof(seg->payload), rt_frame, seg);
+		h485_decoder_cut_through(&seg->dec, rt_cut, rt_stream, rt_abort);
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if(epoll_ctl(rt_epoll, EPOLL_CTL_ADD, seg->fd, &ev) < 0)
+			die("epoll_ctl");
+	}
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	if((sfd = signalfd(-1, &sigs, SFD_NONBLOCK)) < 0)
+		die("signalfd");
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = RT_TAG_SIGNAL;
+	if(epoll_ctl(rt_epoll, EPOLL_CTL_ADD, sfd, &ev) < 0)
+		die("epoll_ctl");
+
+	while(running) {
+		/* wake up when a held segment times out */
+		timeout = -1;
+		for(i=0; i<rt_nsegments; i++) {
+			seg = &rt_segments[i];
+			if(seg->fd < 0 || !seg->txlen || seg->writing)
+				continue;
+
+			wait = seg->rx_time + RT_RX_TIMEOUT - rt_now();
+			if(wait < 0)
+				wait = 0;
+			if(timeout < 0 || wait < timeout)
+				timeout = wait;
+		}
+
+		if((nev = epoll_wait(rt_epoll, events, 16, timeout)) < 0) {
+			if(errno == EINTR)
+				continue;
+			die("epoll_wait");
+		}
+
+		for(i=0; i<(unsigned int) nev; i++) {
+			if(events[i].data.u32 == RT_TAG_SIGNAL) {
+				while(read(sfd, &si, sizeof(si)) == sizeof(si)) {
+					if(si.ssi_signo == SIGUSR1)
+						rt_dump_stats();
+					else
+						running = 0;
+				}
+				continue;
+			}
+
+			seg = &rt_segments[events[i].data.u32];
+			if(seg->fd < 0)
+				continue;
+
+			if(events[i].events & EPOLLOUT)
+				rt_write(seg);
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				rt_read(seg);
+		}
+
+		/* push out whatever the reads produced, and what was held for segments whose nodes are done */
+		for(i=0; i<rt_nsegments; i++)
+			if(rt_segments[i].fd >= 0 && rt_segments[i].txlen && !rt_segments[i].writing)
+				rt_write(&rt_segments[i]);
+	}
+
+	rt_dump_stats();
+	return 0;
+}
@@ -0,0 +1,287 @@
+/** \file sim.c
+ * \brief Test of the router on pseudo terminals.
+ *
+ * Starts the router on the slave ends of SIM_SEGMENTS pty pairs and plays
+ * the nodes on the master ends: frames go in on one segment and the test
+ * checks which segments they come out on, and that they come out whole.
+ *
+ *	flood		unknown destinations, broadcasts and groups reach every other segment
+ *	learn		a known destination only gets its own segment's copy, cut through
+ *	unleased	frames from 0xFF are passed on, but 0xFF is never learned
+ *	hold		nothing goes out on a segment while a node on it is halfway through a frame
+ *	stale		unless that node has gone quiet
+ *	full		with a segment not draining, every frame that gets out is whole
+ *
+ * The exit status is non-zero when something is off.
+ *
+ * usage: sim [router]
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+
+#define SIM_SEGMENTS	3
+#define SIM_MAX_PAYLOAD	1024		/**< the router's RT_MAX_PAYLOAD */
+#define SIM_PAYLOAD	1000		/**< payload of the frames that fill a segment */
+#define SIM_FILL	100		/**< that many of them */
+#define SIM_QUIET	300		/**< ms without output before a step is over */
+#define SIM_SEEN	10		/**< ms for bytes written to a pty to reach the other end */
+#define SIM_HOLD	30		/**< ms a segment must stay silent while its node is sending, well below RT_RX_TIMEOUT */
+
+/** one segment as its nodes see it */
+static struct sim_segment {
+	int		 fd;		/**< master end */
+	char		 path[64];	/**< slave end, for the router */
+
+	struct h485_decoder dec;
+	uint8_t		 payload[SIM_MAX_PAYLOAD];
+	unsigned int	 frames;	/**< frames come out here */
+	unsigned int	 bad;		/**< of which with a payload that isn't what was sent */
+	struct sblp_header last;
+} sim_segs[SIM_SEGMENTS];
+
+static int	 sim_log;		/**< the router's stderr */
+static unsigned int sim_errors;
+
+/** the payload of frame seq: varied enough to contain syncs and escapes */
+static void sim_fill(uint8_t *payload, uint16_t length, uint8_t seq) {
+	uint16_t i;
+
+	for(i=0; i<length; i++)
+		payload[i] = seq + i * 7;
+}
+
+static void sim_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	struct sim_segment *seg = ctx;
+	uint8_t expect[SIM_MAX_PAYLOAD];
+
+	seg->frames++;
+	seg->last = *header;
+
+	sim_fill(expect, header->length, header->length ? payload[0] : 0);
+	if(!payload || memcmp(payload, expect, header->length))
+		seg->bad++;
+}
+
+static void sim_check(const char *what, int ok) {
+	if(!ok) {
+		printf("FAIL %s\n", what);
+		sim_errors++;
+	}
+}
+
+/** encode a frame in wire order, returning its length */
+static size_t sim_encode(uint8_t *buf, uint8_t src, uint8_t dest, uint16_t length, uint8_t seq) {
+	uint8_t payload[SIM_MAX_PAYLOAD];
+	struct sblp_header header = { 0x10, length, dest, src };
+	size_t len;
+
+	sim_fill(payload, length, seq);
+	len = h485_encode(&header, payload, buf);
+	h485_wire_order(buf, len);
+	return len;
+}
+
+/** put bytes on a segment, as one of its nodes */
+static void sim_write(int seg, const uint8_t *buf, size_t len) {
+	size_t off = 0;
+	ssize_t n;
+
+	while(off < len) {
+		if((n = write(sim_segs[seg].fd, buf + off, len - off)) < 0) {
+			poll(&(struct pollfd) { sim_segs[seg].fd, POLLOUT, 0 }, 1, 100);
+			continue;
+		}
+		off += n;
+	}
+}
+
+/** put a frame on a segment */
+static void sim_send(int seg, uint8_t src, uint8_t dest, uint16_t length, uint8_t seq) {
+	uint8_t buf[H485_ENCODED_SIZE(SIM_MAX_PAYLOAD)];
+
+	sim_write(seg, buf, sim_encode(buf, src, dest, length, seq));
+}
+
+/** nothing comes out on a segment for ms */
+static int sim_silent(int seg, int ms) {
+	return poll(&(struct pollfd) { sim_segs[seg].fd, POLLIN, 0 }, 1, ms) == 0;
+}
+
+/** read what the router sends until it has been quiet for SIM_QUIET ms */
+static void sim_collect() {
+	struct pollfd pfd[SIM_SEGMENTS];
+	uint8_t buf[4096];
+	unsigned int i;
+	ssize_t len;
+
+	for(i=0; i<SIM_SEGMENTS; i++) {
+		sim_segs[i].frames = sim_segs[i].bad = 0;
+		pfd[i].fd = sim_segs[i].fd;
+		pfd[i].events = POLLIN;
+	}
+
+	while(poll(pfd, SIM_SEGMENTS, SIM_QUIET) > 0) {
+		for(i=0; i<SIM_SEGMENTS; i++) {
+			if(!(pfd[i].revents & POLLIN) || (len = read(pfd[i].fd, buf, sizeof(buf))) <= 0)
+				continue;
+
+			h485_wire_order(buf, len);
+			h485_decode(&sim_segs[i].dec, buf, len);
+		}
+	}
+}
+
+/** number of frames the router logged as cut through since the last call */
+static unsigned int sim_cut() {
+	char buf[4096], *p;
+	unsigned int cut = 0;
+	ssize_t len;
+
+	while((len = read(sim_log, buf, sizeof(buf) - 1)) > 0) {
+		buf[len] = '\0';
+		for(p = buf; (p = strstr(p, "cut through")); p++)
+			cut++;
+	}
+
+	return cut;
+}
+
+/** the frame came out on exactly the segments in mask, whole */
+static void sim_expect(const char *what, unsigned int mask, uint16_t length) {
+	unsigned int i;
+
+	for(i=0; i<SIM_SEGMENTS; i++) {
+		if(mask & (1 << i))
+			sim_check(what, sim_segs[i].frames == 1 && !sim_segs[i].bad && sim_segs[i].last.length == length);
+		else
+			sim_check(what, sim_segs[i].frames == 0);
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *router = argc > 1 ? argv[1] : "./router";
+	uint8_t buf[H485_ENCODED_SIZE(SIM_MAX_PAYLOAD)];
+	struct termios tio;
+	size_t len;
+	int logpipe[2], i, quiet;
+	unsigned int total;
+	pid_t pid;
+
+	for(i=0; i<SIM_SEGMENTS; i++) {
+		struct sim_segment *seg = &sim_segs[i];
+
+		if((seg->fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(seg->fd) || unlockpt(seg->fd)) {
+			perror("posix_openpt");
+			return 1;
+		}
+		snprintf(seg->path, sizeof(seg->path), "%s", ptsname(seg->fd));
+
+		/* raw from the start, or the line discipline echoes what we send */
+		tcgetattr(seg->fd, &tio);
+		cfmakeraw(&tio);
+		tcsetattr(seg->fd, TCSANOW, &tio);
+		fcntl(seg->fd, F_SETFL, O_NONBLOCK);
+
+		h485_decoder_init(&seg->dec, seg->payload, sizeof(seg->payload), sim_frame, seg);
+	}
+
+	if(pipe(logpipe) < 0)
+		return 1;
+
+	if(!(pid = fork())) {
+		dup2(logpipe[1], 2);
+		execl(router, router, "-v", "-s", sim_segs[0].path, "-s", sim_segs[1].path, "-s", sim_segs[2].path, (char *) NULL);
+		perror(router);
+		_exit(1);
+	}
+	close(logpipe[1]);
+	fcntl(logpipe[0], F_SETFL, O_NONBLOCK);
+	sim_log = logpipe[0];
+	usleep(300000);		/* let it open the ports */
+
+	/* flood: nothing is known yet */
+	sim_send(0, 0x10, 0x20, 20, 1);
+	sim_collect();
+	sim_expect("flood unknown", 0x6, 20);
+
+	sim_send(1, 0x20, SBLP_BROADCAST, 20, 2);
+	sim_collect();
+	sim_expect("flood broadcast", 0x5, 20);
+
+	sim_send(2, 0x30, SBLP_GROUP_FIRST, 20, 3);
+	sim_collect();
+	sim_expect("flood group", 0x3, 20);
+
+	/* learn: 0x10 is on 0, 0x20 on 1 and 0x30 on 2 */
+	sim_cut();
+	sim_send(0, 0x10, 0x20, 200, 4);
+	sim_collect();
+	sim_expect("learn", 0x2, 200);
+	sim_send(2, 0x30, 0x10, 0, 5);
+	sim_collect();
+	sim_expect("learn empty", 0x1, 0);
+	sim_check("cut through", sim_cut() == 2);
+
+	/* unleased: a frame from 0xFF goes everywhere, and broadcasts still do afterwards */
+	sim_send(2, SBLP_BROADCAST, 0x10, 20, 6);
+	sim_collect();
+	sim_expect("unleased", 0x1, 20);
+	sim_send(1, 0x20, SBLP_BROADCAST, 20, 7);
+	sim_collect();
+	sim_expect("unleased broadcast", 0x5, 20);
+
+	/* hold: 0x20 is halfway through a frame to a group when a frame for it comes in; that one waits for the end */
+	len = sim_encode(buf, 0x20, SBLP_GROUP_FIRST, 100, 9);
+	sim_write(1, buf, len / 2);
+	usleep(SIM_SEEN * 1000);	/* the router must have read it, or it's a plain collision */
+	sim_send(0, 0x10, 0x20, 20, 10);
+	sim_check("hold: held", sim_silent(1, SIM_HOLD));
+	sim_write(1, buf + len / 2, len - len / 2);
+	sim_collect();
+	sim_check("hold", sim_segs[0].frames == 1 && sim_segs[0].last.length == 100 &&
+		sim_segs[1].frames == 1 && sim_segs[1].last.length == 20 &&
+		sim_segs[2].frames == 1 && sim_segs[2].last.length == 100 &&
+		!sim_segs[0].bad && !sim_segs[1].bad && !sim_segs[2].bad);
+
+	/* stale: this time it stops halfway, and the router sends over it after a while */
+	len = sim_encode(buf, 0x20, SBLP_GROUP_FIRST, 100, 11);
+	sim_write(1, buf, len / 2);
+	sim_send(0, 0x10, 0x20, 20, 12);
+	sim_collect();
+	sim_expect("stale", 0x2, 20);
+
+	/* full: segment 1 stops draining until the router's buffer for it overflows.
+	 * Frames that don't fit are lost, but none may come out cut short. */
+	for(i=0; i<SIM_FILL; i++)
+		sim_send(i & 1 ? 0 : 2, i & 1 ? 0x10 : 0x30, 0x20, SIM_PAYLOAD, i);
+	usleep(SIM_QUIET * 1000);
+	sim_send(0, 0x10, 0x20, 20, 8);
+	sim_collect();
+	total = sim_segs[1].frames;
+	quiet = sim_segs[1].dec.truncated == 0 && sim_segs[1].dec.bad_escapes == 0 && sim_segs[1].bad == 0;
+	sim_check("full: something lost", total < SIM_FILL + 1);
+	sim_check("full: nothing cut short", quiet);
+	sim_check("full: last frame", sim_segs[1].last.length == 20);
+	printf("full: %u of %u frames out, %lu truncated\n", total, SIM_FILL + 1, sim_segs[1].dec.truncated);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	if(!sim_errors)
+		printf("OK\n");
+	return sim_errors != 0;
+}
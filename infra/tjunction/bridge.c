@@ -0,0 +1,223 @@
+/** \file bridge.c
+ * \brief Store-and-forward learning bridge between two bus legs.
+ *
+ * Every frame's source address teaches the bridge which leg a node is
+ * on. A frame is forwarded to the other leg unless its destination is
+ * known to be on the leg it came from, so traffic between nodes on the
+ * same leg never loads the other one. Only unicast sources are learned:
+ * unleased nodes send from the broadcast address, and frames to groups
+ * and broadcasts always cross.
+ *
+ * Each leg has a receive state machine like the one in sblp.c and a
+ * single frame buffer. A completed frame is held in the buffer until it
+ * has been sent on the other leg; frames arriving in the meantime are
+ * only looked at for learning.
+ */
+
+#include "bridge.h"
+
+#define OTHER(leg)	((leg) ^ 1)
+
+struct bridge_stats bridge_stats[BRIDGE_LEGS];
+
+static struct {
+	enum {
+		BRIDGE_STATE_IDLE,		/**< nothing happening on this leg */
+		BRIDGE_STATE_RECV_HEADER,	/**< a frame header is being received */
+		BRIDGE_STATE_RECV_PAYLOAD,	/**< a frame payload is being received into the buffer */
+		BRIDGE_STATE_IGNORE,		/**< a frame is being skipped */
+		BRIDGE_STATE_XMIT		/**< the other leg's frame is being sent */
+	} state;
+
+	uint8_t		head[HEADER_LENGTH];	/**< header of the frame being received */
+	uint16_t	index;			/**< position within the header, payload or transmission */
+	uint16_t	length;			/**< payload length of the frame being received */
+
+	uint8_t		held;			/**< set while frame holds a frame for the other leg */
+	uint8_t		pending;		/**< set when the other leg's frame waits for this leg to go idle */
+	uint8_t		frame[HEADER_LENGTH + BRIDGE_BUFSIZE];	/**< frame to forward, header included */
+} bridge_legs[BRIDGE_LEGS];
+
+/** learned addresses and the leg they are on */
+static uint8_t bridge_known[32];
+static uint8_t bridge_on_leg1[32];
+
+#ifndef _BV
+#define _BV(b)	(1 << (b))
+#endif
+
+#define BIT_TEST(map, a)	((map)[(a) >> 3] & _BV((a) & 7))
+#define BIT_SET(map, a)		((map)[(a) >> 3] |= _BV((a) & 7))
+#define BIT_CLEAR(map, a)	((map)[(a) >> 3] &= ~_BV((a) & 7))
+
+void bridge_init() {
+	uint8_t i;
+
+	for(i=0; i<32; i++)
+		bridge_known[i] = bridge_on_leg1[i] = 0;
+
+	for(i=0; i<BRIDGE_LEGS; i++) {
+		bridge_legs[i].state = BRIDGE_STATE_IDLE;
+		bridge_legs[i].held = 0;
+		bridge_legs[i].pending = 0;
+		bridge_stats[i].forwarded = bridge_stats[i].filtered = bridge_stats[i].dropped = 0;
+	}
+}
+
+uint8_t bridge_leg_of(uint8_t addr) {
+	if(!BIT_TEST(bridge_known, addr))
+		return BRIDGE_UNKNOWN;
+
+	return BIT_TEST(bridge_on_leg1, addr) ? 1 : 0;
+}
+
+/** start sending the other leg's held frame on this leg */
+static void bridge_xmit(uint8_t leg) {
+	bridge_legs[leg].pending = 0;
+	bridge_legs[leg].state = BRIDGE_STATE_XMIT;
+	bridge_legs[leg].index = 0;
+
+	bridge_begin(leg);
+	bridge_send_sync(leg);
+}
+
+/** a leg has gone idle -- send whatever is waiting for it */
+static void bridge_idle(uint8_t leg) {
+	bridge_legs[leg].state = BRIDGE_STATE_IDLE;
+
+	if(bridge_legs[leg].pending)
+		bridge_xmit(leg);
+}
+
+/** a frame has been fully received into the buffer of a leg */
+static void bridge_frame_done(uint8_t leg) {
+	uint8_t out = OTHER(leg);
+
+	bridge_legs[leg].held = 1;
+
+	if(bridge_legs[out].state == BRIDGE_STATE_IDLE)
+		bridge_xmit(out);
+	else
+		bridge_legs[out].pending = 1;
+
+	bridge_idle(leg);
+}
+
+/** the header of a frame is in -- learn from it and decide what to do */
+static void bridge_header_done(uint8_t leg) {
+	uint8_t *head = bridge_legs[leg].head;
+	uint8_t dest = head[3], src = head[4], i;
+
+	/* learn where the sender lives */
+	if(src < SBLP_GROUP_FIRST) {
+		BIT_SET(bridge_known, src);
+		if(leg)
+			BIT_SET(bridge_on_leg1, src);
+		else
+			BIT_CLEAR(bridge_on_leg1, src);
+	}
+
+	bridge_legs[leg].length = (head[1] << 8) | head[2];
+	bridge_legs[leg].index = 0;
+
+	if(dest < SBLP_GROUP_FIRST && bridge_leg_of(dest) == leg) {
+		/* local traffic -- nothing to do */
+		bridge_stats[leg].filtered++;
+		bridge_legs[leg].state = BRIDGE_STATE_IGNORE;
+	} else if(bridge_legs[leg].held || bridge_legs[leg].length > BRIDGE_BUFSIZE) {
+		/* can't store it */
+		bridge_stats[leg].dropped++;
+		bridge_legs[leg].state = BRIDGE_STATE_IGNORE;
+	} else {
+		for(i=0; i<HEADER_LENGTH; i++)
+			bridge_legs[leg].frame[i] = head[i];
+
+		bridge_legs[leg].state = BRIDGE_STATE_RECV_PAYLOAD;
+	}
+
+	if(bridge_legs[leg].length == 0) {
+		if(bridge_legs[leg].state == BRIDGE_STATE_RECV_PAYLOAD)
+			bridge_frame_done(leg);
+		else
+			bridge_idle(leg);
+	}
+}
+
+void bridge_sync(uint8_t leg) {
+	switch(bridge_legs[leg].state) {
+		case BRIDGE_STATE_XMIT:
+			/* shouldn't happen -- we don't hear ourselves */
+			break;
+
+		case BRIDGE_STATE_RECV_PAYLOAD:
+			/* frame cut short -- forget it */
+			bridge_stats[leg].dropped++;
+			/* fallthrough */
+
+		default:
+			bridge_legs[leg].state = BRIDGE_STATE_RECV_HEADER;
+			bridge_legs[leg].index = 0;
+			break;
+	}
+}
+
+void bridge_byte(uint8_t leg, uint8_t b) {
+	switch(bridge_legs[leg].state) {
+		case BRIDGE_STATE_RECV_HEADER:
+			bridge_legs[leg].head[bridge_legs[leg].index++] = b;
+			if(bridge_legs[leg].index == HEADER_LENGTH)
+				bridge_header_done(leg);
+			break;
+
+		case BRIDGE_STATE_RECV_PAYLOAD:
+			bridge_legs[leg].frame[HEADER_LENGTH + bridge_legs[leg].index++] = b;
+			if(bridge_legs[leg].index == bridge_legs[leg].length)
+				bridge_frame_done(leg);
+			break;
+
+		case BRIDGE_STATE_IGNORE:
+			/* count down the bytes until we're done */
+			if(++bridge_legs[leg].index == bridge_legs[leg].length)
+				bridge_idle(leg);
+			break;
+
+		default:
+			/* shouldn't happen -- ignore */
+			break;
+	}
+}
+
+void bridge_error(uint8_t leg) {
+	switch(bridge_legs[leg].state) {
+		case BRIDGE_STATE_RECV_PAYLOAD:
+			/* a byte is missing -- don't pass on a broken frame */
+			bridge_stats[leg].dropped++;
+			/* fallthrough */
+
+		case BRIDGE_STATE_RECV_HEADER:
+		case BRIDGE_STATE_IGNORE:
+			/* nothing more to be had from this frame; bytes are ignored until the next sync */
+			bridge_idle(leg);
+			break;
+
+		default:
+			break;
+	}
+}
+
+void bridge_sent(uint8_t leg) {
+	uint8_t from = OTHER(leg);
+
+	if(bridge_legs[leg].state != BRIDGE_STATE_XMIT)
+		return;
+
+	if(bridge_legs[leg].index < HEADER_LENGTH + ((bridge_legs[from].frame[1] << 8) | bridge_legs[from].frame[2])) {
+		bridge_send_byte(leg, bridge_legs[from].frame[bridge_legs[leg].index++]);
+	} else {
+		/* done -- release the bus and the buffer */
+		bridge_end(leg);
+		bridge_legs[from].held = 0;
+		bridge_stats[from].forwarded++;
+		bridge_idle(leg);
+	}
+}
@@ -0,0 +1,51 @@
+/** \file bridge.h
+ * Header file for the T-junction learning bridge.
+ *
+ * The bridge is independent of the hardware: the firmware feeds it bytes
+ * from both legs and supplies the transmit functions below, and so does the
+ * host simulation.
+ */
+
+#ifndef _BRIDGE_H
+
+#include "interop.h"
+
+#define BRIDGE_LEGS	2	/**< number of bus legs */
+#define BRIDGE_BUFSIZE	32	/**< largest payload that can be forwarded */
+#define BRIDGE_UNKNOWN	0xFF	/**< leg of an address that hasn't been seen yet */
+
+/** per-leg statistics, counted on the leg the frame came in on */
+struct bridge_stats {
+	uint16_t	forwarded;	/**< frames passed on to the other leg */
+	uint16_t	filtered;	/**< frames kept local because the destination is on this leg */
+	uint16_t	dropped;	/**< frames lost because they were too large or the buffer was busy */
+};
+
+extern struct bridge_stats bridge_stats[BRIDGE_LEGS];
+
+/** initialise the bridge */
+void bridge_init();
+
+/** a sync was received on the given leg */
+void bridge_sync(uint8_t leg);
+
+/** a (unescaped) byte was received on the given leg */
+void bridge_byte(uint8_t leg, uint8_t b);
+
+/** a byte was lost to a framing error on the given leg */
+void bridge_error(uint8_t leg);
+
+/** the previous byte or sync was sent on the given leg */
+void bridge_sent(uint8_t leg);
+
+/** the leg an address was learned on, or BRIDGE_UNKNOWN */
+uint8_t bridge_leg_of(uint8_t addr);
+
+/* supplied by the hardware side */
+extern void bridge_begin(uint8_t leg);			/**< take the bus on a leg */
+extern void bridge_end(uint8_t leg);			/**< release the bus on a leg */
+extern void bridge_send_sync(uint8_t leg);		/**< send a sync on a leg */
+extern void bridge_send_byte(uint8_t leg, uint8_t b);	/**< send (and escape) a byte on a leg */
+
+#define _BRIDGE_H
+#endif
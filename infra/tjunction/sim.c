@@ -0,0 +1,229 @@
+/** \file sim.c
+ * \brief Host simulation of the T-junction bridge.
+ *
+ * Runs the bridge code against two simulated bus legs with a handful of
+ * nodes each, one byte time per step. Nodes send frames with a given share
+ * of local traffic (destination on the same leg). The simulation checks
+ * that every frame for the other leg crosses the junction unless the
+ * bridge reported dropping it, that no frame between nodes on the same leg
+ * does once the bridge has learned where they are, and compares the load
+ * on each leg with that of a single shared bus. Some of the traffic is
+ * broadcasts from unleased nodes (source 0xFF), which always cross.
+ *
+ * usage: sim [frames [local-percent [seed]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bridge.h"
+
+#define SIM_NODES	4	/**< nodes per leg */
+#define SIM_MAX_PAYLOAD	16
+#define SIM_UNLEASED	5	/**< percentage of frames that are broadcasts from an unleased node */
+
+/** a frame queued by a node */
+struct sim_frame {
+	uint8_t		dest, src, cross;
+	uint16_t	length;
+	uint8_t		payload[SIM_MAX_PAYLOAD];
+};
+
+/** a simulated leg */
+static struct {
+	struct sim_frame *queue;	/**< frames waiting to be sent by nodes on this leg */
+	unsigned int	 nqueued, next;
+
+	struct sim_frame *cur;		/**< frame a node is sending, if any */
+	unsigned int	 pos;		/**< byte of cur being sent, 0 = sync */
+
+	uint8_t		 bridge_active;	/**< set while the bridge has the bus */
+	uint8_t		 bridge_byte;	/**< set when the bridge put a byte on the wire this step */
+	uint8_t		 out[HEADER_LENGTH];	/**< header of the frame the bridge is sending */
+	unsigned int	 outpos;
+
+	unsigned long	 busy;		/**< byte times the leg was in use */
+	unsigned long	 crossed;	/**< frames the bridge sent on this leg */
+} legs[BRIDGE_LEGS];
+
+static unsigned long	 shared_busy = 0;	/**< byte times a single bus would have been busy */
+static unsigned long	 violations = 0;
+
+static uint8_t node_addr(uint8_t leg, unsigned int n) {
+	return (leg ? 0x20 : 0x10) + n;
+}
+
+/* the bridge's transmit side */
+void bridge_begin(uint8_t leg) {
+	legs[leg].bridge_active = 1;
+	legs[leg].outpos = 0;
+}
+
+void bridge_end(uint8_t leg) {
+	uint8_t src = legs[leg].out[4];
+
+	legs[leg].bridge_active = 0;
+	legs[leg].crossed++;
+
+	/* a frame on this leg from a node on this leg must never come back */
+	if((src & 0xF0) == (leg ? 0x20 : 0x10)) {
+		fprintf(stderr, "frame from %02x echoed back onto its own leg\n", src);
+		violations++;
+	}
+}
+
+void bridge_send_sync(uint8_t leg) {
+	legs[leg].bridge_byte = 1;
+}
+
+void bridge_send_byte(uint8_t leg, uint8_t b) {
+	if(legs[leg].outpos < HEADER_LENGTH)
+		legs[leg].out[legs[leg].outpos++] = b;
+
+	legs[leg].bridge_byte = 1;
+}
+
+/** byte of a node's frame at position pos, the header included */
+static uint8_t sim_frame_byte(struct sim_frame *f, unsigned int pos) {
+	switch(pos) {
+		case 1:		return 0x01;			/* type */
+		case 2:		return (f->length >> 8) & 0xFF;
+		case 3:		return f->length & 0xFF;
+		case 4:		return f->dest;
+		case 5:		return f->src;
+		default:	return f->payload[pos - HEADER_LENGTH - 1];
+	}
+}
+
+/** advance a leg by one byte time */
+static void sim_step(uint8_t leg) {
+	struct sim_frame *f;
+
+	if(legs[leg].bridge_byte) {
+		/* the bridge's byte is out */
+		legs[leg].busy++;
+		legs[leg].bridge_byte = 0;
+		bridge_sent(leg);
+		return;
+	}
+
+	if(legs[leg].bridge_active)
+		return;
+
+	if(!legs[leg].cur) {
+		if(legs[leg].next == legs[leg].nqueued)
+			return;
+
+		/* bus is free -- the next node gets to send */
+		legs[leg].cur = &legs[leg].queue[legs[leg].next++];
+		legs[leg].pos = 0;
+		shared_busy += 1 + HEADER_LENGTH + legs[leg].cur->length;
+	}
+
+	f = legs[leg].cur;
+	legs[leg].busy++;
+
+	if(legs[leg].pos == 0)
+		bridge_sync(leg);
+	else
+		bridge_byte(leg, sim_frame_byte(f, legs[leg].pos));
+
+	if(++legs[leg].pos > (unsigned int) (HEADER_LENGTH + f->length))
+		legs[leg].cur = NULL;
+}
+
+int main(int argc, char **argv) {
+	unsigned long nframes = 2000, i, expected_cross = 0, steps = 0;
+	unsigned int local = 80, n, j;
+	struct sim_frame *f;
+	uint8_t leg;
+
+	if(argc > 1) nframes = strtoul(argv[1], NULL, 0);
+	if(argc > 2) local = strtoul(argv[2], NULL, 0);
+	srand(argc > 3 ? strtoul(argv[3], NULL, 0) : 1);
+
+	for(leg=0; leg<BRIDGE_LEGS; leg++)
+		legs[leg].queue = calloc(nframes + SIM_NODES, sizeof(struct sim_frame));
+
+	/* every node announces itself once, to an address nobody has */
+	for(leg=0; leg<BRIDGE_LEGS; leg++) {
+		for(n=0; n<SIM_NODES; n++) {
+			f = &legs[leg].queue[legs[leg].nqueued++];
+			f->src = node_addr(leg, n);
+			f->dest = 0xFE;
+			f->length = 0;
+			f->cross = 1;
+			expected_cross++;
+		}
+	}
+
+	/* then random traffic */
+	for(i=0; i<nframes; i++) {
+		leg = rand() % BRIDGE_LEGS;
+		f = &legs[leg].queue[legs[leg].nqueued++];
+
+		if(rand() % 100 < SIM_UNLEASED) {
+			f->src = f->dest = SBLP_BROADCAST;
+			f->cross = 1;
+		} else {
+			f->src = node_addr(leg, rand() % SIM_NODES);
+			f->cross = (unsigned int) (rand() % 100) >= local;
+			do {
+				f->dest = node_addr(f->cross ? leg ^ 1 : leg, rand() % SIM_NODES);
+			} while(f->dest == f->src);
+		}
+
+		f->length = rand() % (SIM_MAX_PAYLOAD + 1);
+		for(j=0; j<f->length; j++)
+			f->payload[j] = rand();
+
+		expected_cross += f->cross;
+	}
+
+	bridge_init();
+
+	/* run until every queue is empty and the bridge is done */
+	for(;;) {
+		for(leg=0; leg<BRIDGE_LEGS; leg++)
+			sim_step(leg);
+		steps++;
+
+		for(leg=0; leg<BRIDGE_LEGS; leg++)
+			if(legs[leg].cur || legs[leg].next < legs[leg].nqueued ||
+			   legs[leg].bridge_active || legs[leg].bridge_byte)
+				break;
+		if(leg == BRIDGE_LEGS)
+			break;
+	}
+
+	/* check the bookkeeping */
+	for(leg=0; leg<BRIDGE_LEGS; leg++)
+		for(n=0; n<SIM_NODES; n++)
+			if(bridge_leg_of(node_addr(leg, n)) != leg) {
+				fprintf(stderr, "node %02x not learned on leg %u\n", node_addr(leg, n), leg);
+				violations++;
+			}
+
+	if(legs[0].crossed + legs[1].crossed + bridge_stats[0].dropped + bridge_stats[1].dropped != expected_cross) {
+		fprintf(stderr, "%lu frames should have crossed, %lu did and %u were dropped\n",
+			expected_cross, legs[0].crossed + legs[1].crossed,
+			bridge_stats[0].dropped + bridge_stats[1].dropped);
+		violations++;
+	}
+
+	for(leg=0; leg<BRIDGE_LEGS; leg++)
+		printf("leg %u: %u forwarded, %u filtered, %u dropped, busy %lu byte times\n",
+			leg, bridge_stats[leg].forwarded, bridge_stats[leg].filtered,
+			bridge_stats[leg].dropped, legs[leg].busy);
+
+	printf("%lu frames, %u%% local: shared bus busy %lu byte times, split legs done in %lu (%.2fx)\n",
+		nframes, local, shared_busy, steps, (double) shared_busy / steps);
+
+	if(violations) {
+		printf("FAILED: %lu violations\n", violations);
+		return 1;
+	}
+
+	printf("OK\n");
+	return 0;
+}
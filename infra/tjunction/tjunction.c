@@ -0,0 +1,109 @@
+/** \file tjunction.c
+ * \brief Firmware for an isolating T-junction between two bus legs.
+ *
+ * Targets an attiny4313 with two MAX485-style transceivers: leg 0 is
+ * driven by the USI through tiny485, leg 1 by the hardware USART through
+ * usart485. Each is built as its own instance (see INTEROP_INSTANCE in
+ * interop.h), leg0.o and leg1.o, so they call leg0_byte_received(),
+ * leg1_byte_received() and so on here instead of a single sblp. Escaping,
+ * bit order and breaks are theirs to deal with, like on any other node.
+ *
+ * All the work happens in interrupt context; the CPU idles in between.
+ * Both hw layers call the layer above with interrupts enabled again, but
+ * the bridge's state is shared between the legs, so the callbacks mask
+ * them: the other leg can't get in while the bridge is busy with a byte.
+ * Interrupts stay off until the hw layer's ISR returns.
+ */
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "interop.h"
+#include "bridge.h"
+
+INTEROP_DECLARE_HW(leg0);
+INTEROP_DECLARE_HW(leg1);
+
+/* leg 0 -- tiny485 callbacks */
+void leg0_byte_received(uint8_t b) {
+	cli();
+	bridge_byte(0, b);
+}
+
+void leg0_sync_received() {
+	cli();
+	bridge_sync(0);
+}
+
+void leg0_framing_error() {
+	cli();
+	bridge_error(0);
+}
+
+void leg0_byte_sent() {
+	cli();
+	bridge_sent(0);
+}
+
+/* leg 1 -- usart485 callbacks */
+void leg1_byte_received(uint8_t b) {
+	cli();
+	bridge_byte(1, b);
+}
+
+void leg1_sync_received() {
+	cli();
+	bridge_sync(1);
+}
+
+void leg1_framing_error() {
+	cli();
+	bridge_error(1);
+}
+
+void leg1_byte_sent() {
+	cli();
+	bridge_sent(1);
+}
+
+/* transmit functions for the bridge */
+void bridge_begin(uint8_t leg) {
+	if(leg)
+		leg1_begin_transmission();
+	else
+		leg0_begin_transmission();
+}
+
+void bridge_end(uint8_t leg) {
+	if(leg)
+		leg1_end_transmission();
+	else
+		leg0_end_transmission();
+}
+
+void bridge_send_sync(uint8_t leg) {
+	if(leg)
+		leg1_send_sync();
+	else
+		leg0_send_sync();
+}
+
+void bridge_send_byte(uint8_t leg, uint8_t b) {
+	if(leg)
+		leg1_send_byte(b);
+	else
+		leg0_send_byte(b);
+}
+
+int main(void) {
+	bridge_init();
+
+	/* each turns on interrupts; a whole frame has to come in before the other leg is used */
+	leg1_hw_init();
+	leg0_hw_init();
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	while(1)
+		sleep_mode();
+}
@@ -0,0 +1,106 @@
+/** \file discover.c
+ * \brief Implements the node's side of bus discovery.
+ *
+ * Every node has a unique 32-bit id. The host asks everyone whether they
+ * have an id in [lo, hi] with a DISCOVER_TYPE_QUERY; the nodes that do
+ * answer with a DISCOVER_TYPE_REPLY straight away. No answer means the
+ * range is empty, a clean answer names a node and anything else means
+ * several nodes answered at once -- the host then splits the range and
+ * asks about both halves. SBLP has no checksum, so the reply carries the
+ * id twice, the second time inverted, which colliding answers are very
+ * unlikely to get right by accident.
+ *
+ * A driver can win a collision outright and make it look like a clean
+ * answer, so the host mutes every node it has found with
+ * DISCOVER_TYPE_MUTE and asks about the same range again. Muted nodes stay
+ * quiet until the next DISCOVER_TYPE_RESET, which starts a new scan.
+ */
+
+#include "../interop.h"
+
+/** internal data for the protocol */
+static struct {
+	uint32_t	 id;			/**< our unique id */
+	uint8_t		 address;		/**< our address, used as source */
+	uint8_t		 muted;			/**< the host has found us in this scan */
+	volatile uint8_t busy;			/**< a reply is being sent */
+	uint8_t		 xmit[8];		/**< payload of that reply */
+} discover_data;
+
+/** read a 32-bit value, MSB first */
+static uint32_t discover_get(uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+void discover_init(uint32_t id, uint8_t address) {
+	discover_data.id = id;
+	discover_data.address = address;
+	discover_data.muted = 0;
+	discover_data.busy = 0;
+}
+
+/** tell the host our id */
+static void discover_reply(uint8_t dest) {
+	struct sblp_header header;
+	uint8_t i, lock;
+
+	if(discover_data.busy)
+		return;
+
+	discover_data.xmit[0] = discover_data.id >> 24;
+	discover_data.xmit[1] = discover_data.id >> 16;
+	discover_data.xmit[2] = discover_data.id >> 8;
+	discover_data.xmit[3] = discover_data.id;
+	for(i=0; i<4; i++)
+		discover_data.xmit[4 + i] = ~discover_data.xmit[i];
+
+	header.type	= DISCOVER_TYPE_REPLY;
+	header.length	= 8;
+	header.dest	= dest;
+	header.src	= discover_data.address;
+
+	/* answers only count if they come right away; if the link is busy, the host sees an empty range */
+	lock = hw_lock();
+	discover_data.busy = 1;
+	if(!send_frame(&header, discover_data.xmit))
+		discover_data.busy = 0;
+	hw_unlock(lock);
+}
+
+uint8_t discover_frame_received(struct sblp_header *header, uint8_t *payload) {
+	switch(header->type) {
+		case DISCOVER_TYPE_QUERY:
+			if(header->length != 8 || discover_data.muted)
+				break;
+
+			if(discover_get(payload) <= discover_data.id && discover_data.id <= discover_get(payload + 4))
+				discover_reply(header->src);
+			break;
+
+		case DISCOVER_TYPE_MUTE:
+			if(header->length == 4 && discover_get(payload) == discover_data.id)
+				discover_data.muted = 1;
+			break;
+
+		case DISCOVER_TYPE_RESET:
+			discover_data.muted = 0;
+			break;
+
+		case DISCOVER_TYPE_REPLY:
+			/* another node's */
+			break;
+
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+uint8_t discover_frame_sent() {
+	if(!discover_data.busy)
+		return 0;
+
+	discover_data.busy = 0;
+	return 1;
+}
@@ -0,0 +1,192 @@
+/** \file frag.c
+ * \brief Implements fragmentation and reassembly of messages larger than an SBLP frame.
+ *
+ * A message is sent as a run of FRAG_TYPE_FRAGMENT frames, each holding
+ * a message id, the offset of its data in the message and the total
+ * length, followed by up to FRAG_MAX_DATA bytes of the message. The next
+ * fragment goes out as soon as the previous one is sent, so a message
+ * occupies the bus back-to-back.
+ *
+ * The receiving side either reassembles the message into a buffer the
+ * application provides or hands each fragment on as it arrives, which
+ * keeps a node that streams (say) firmware into flash at one frame of RAM.
+ * Either way, fragments are only passed on in order: a missing fragment
+ * drops the rest of the message.
+ */
+
+#include "../interop.h"
+
+/** internal data for the protocol */
+static struct {
+	uint8_t		 address;		/**< our address, used as source */
+
+	/* sending */
+	uint8_t		*data;			/**< message being sent, NULL when idle */
+	uint16_t	 length;
+	uint16_t	 offset;		/**< offset of the next fragment */
+	uint8_t		 dest;
+	uint8_t		 id;			/**< id of the current message */
+	volatile uint8_t inflight;		/**< a fragment has been handed to sblp */
+	uint8_t		 xmit[SBLP_MAX_PAYLOAD];	/**< payload of that fragment */
+
+	/* receiving */
+	uint8_t		*buffer;		/**< reassembly buffer, NULL to stream */
+	uint16_t	 size;
+	uint16_t	 expect;		/**< offset of the next fragment, 0 when no message is in progress */
+	uint16_t	 total;			/**< length of the message in progress, from its first fragment */
+	uint8_t		 src;			/**< source of the message in progress */
+	uint8_t		 recv_id;
+} frag_data;
+
+void frag_init(uint8_t address) {
+	frag_data.address = address;
+	frag_data.data = 0;
+	frag_data.inflight = 0;
+	frag_data.id = 0;
+
+	frag_data.buffer = 0;
+	frag_data.size = 0;
+	frag_data.expect = 0;
+}
+
+void frag_receive(uint8_t *buffer, uint16_t size) {
+	frag_data.buffer = buffer;
+	frag_data.size = size;
+	frag_data.expect = 0;
+}
+
+/** hand the next fragment to sblp, returning 0 if the link is busy */
+static uint8_t frag_next() {
+	struct sblp_header header;
+	uint16_t n, i;
+	uint8_t lock, sent;
+
+	n = frag_data.length - frag_data.offset;
+	if(n > FRAG_MAX_DATA)
+		n = FRAG_MAX_DATA;
+
+	frag_data.xmit[0] = frag_data.id;
+	frag_data.xmit[1] = frag_data.offset >> 8;
+	frag_data.xmit[2] = frag_data.offset & 0xFF;
+	frag_data.xmit[3] = frag_data.length >> 8;
+	frag_data.xmit[4] = frag_data.length & 0xFF;
+	for(i=0; i<n; i++)
+		frag_data.xmit[FRAG_HEADER_LENGTH + i] = frag_data.data[frag_data.offset + i];
+
+	header.type	= FRAG_TYPE_FRAGMENT;
+	header.length	= FRAG_HEADER_LENGTH + n;
+	header.dest	= frag_data.dest;
+	header.src	= frag_data.address;
+
+	/* masked, so the frame_sent() of another layer's frame can't be taken for this one's */
+	lock = hw_lock();
+	frag_data.inflight = 1;
+	if(!(sent = send_frame(&header, frag_data.xmit)))
+		frag_data.inflight = 0;
+	hw_unlock(lock);
+
+	if(!sent)
+		return 0;
+
+	frag_data.offset += n;
+	return 1;
+}
+
+uint8_t frag_send(uint8_t dest, uint8_t *data, uint16_t length) {
+	if(frag_data.data)
+		return 0;
+
+	frag_data.data = data;
+	frag_data.length = length;
+	frag_data.offset = 0;
+	frag_data.dest = dest;
+	frag_data.id++;
+
+	/* if the link is busy now, frag_poll() gets it going */
+	frag_next();
+	return 1;
+}
+
+uint8_t frag_busy() {
+	return frag_data.data != 0;
+}
+
+void frag_poll() {
+	if(frag_data.data && !frag_data.inflight)
+		frag_next();
+}
+
+/* functions called by the application's link-layer callbacks */
+uint8_t frag_frame_received(struct sblp_header *header, uint8_t *payload) {
+	uint16_t offset, total, n, i;
+
+	if(header->type != FRAG_TYPE_FRAGMENT)
+		return 0;
+
+	if(header->length < FRAG_HEADER_LENGTH)
+		return 1;
+
+	offset = (payload[1] << 8) | payload[2];
+	total  = (payload[3] << 8) | payload[4];
+	n = header->length - FRAG_HEADER_LENGTH;
+
+	if(offset == 0) {
+		/* a new message -- whatever we had is lost */
+		frag_data.src = header->src;
+		frag_data.recv_id = payload[0];
+		frag_data.total = total;
+		frag_data.expect = 0;
+
+		if(frag_data.buffer && total > frag_data.size)
+			return 1;	/* doesn't fit */
+	} else if(offset != frag_data.expect || header->src != frag_data.src || payload[0] != frag_data.recv_id ||
+		  total != frag_data.total) {
+		/* out of order, not the message we're on, or damaged: there's no checksum to catch it */
+		if(header->src == frag_data.src)
+			frag_data.expect = 0;
+		return 1;
+	}
+
+	if((uint32_t) offset + n > total) {
+		frag_data.expect = 0;
+		return 1;
+	}
+
+	if(frag_data.buffer && (uint32_t) offset + n > frag_data.size) {
+		/* total was checked against the buffer, but make sure: this is what keeps it safe */
+		frag_data.expect = 0;
+		return 1;
+	}
+
+	frag_data.expect = offset + n;
+
+	if(!frag_data.buffer) {
+		message_received(header->src, offset, payload + FRAG_HEADER_LENGTH, n, total);
+	} else {
+		for(i=0; i<n; i++)
+			frag_data.buffer[offset + i] = payload[FRAG_HEADER_LENGTH + i];
+
+		if(frag_data.expect == total)
+			message_received(header->src, 0, frag_data.buffer, total, total);
+	}
+
+	/* done -- wait for the next message */
+	if(frag_data.expect == total)
+		frag_data.expect = 0;
+
+	return 1;
+}
+
+uint8_t frag_frame_sent() {
+	if(!frag_data.inflight)
+		return 0;
+
+	frag_data.inflight = 0;
+
+	if(frag_data.offset == frag_data.length)
+		frag_data.data = 0;	/* message is out */
+	else
+		frag_next();		/* keep the bus */
+
+	return 1;
+}
@@ -0,0 +1,812 @@
+/** \file host485.c
+ * \brief Host-side implementation of the SpaceBus byte-level framing.
+ *
+ * Decodes and encodes the byte stream produced by tiny485 so that
+ * machines attached to the bus through a serial port (gateways,
+ * routers, debugging tools) can talk SBLP. The decoder mirrors the
+ * receive path of tiny485.c and the header state machine of sblp.c, and
+ * is fed arbitrary chunks of bytes as they arrive.
+ *
+ * Outside of frame headers most bytes need no processing at all, so the
+ * decoder looks for the next sync or escape byte with SSE2 or AVX2 when
+ * the CPU has them and copies or skips everything before it in one go.
+ * Special bytes and headers still go through the bytewise path, which
+ * keeps the result identical to tiny485.
+ *
+ * It also runs the host's side of discovery (lib/discover) over a serial
+ * port, for tools that want to know what is on the bus.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define H485_X86
+#endif
+
+#include "host485.h"
+
+/** extra syncs in front of every frame encoded */
+static unsigned int h485_preamble = 0;
+
+/** bit reversal table for wire/host order conversion */
+static uint8_t h485_reverse[256];
+static int h485_reverse_ready = 0;
+
+void h485_decoder_init(struct h485_decoder *d, uint8_t *buf, size_t bufsize, h485_frame_cb frame, void *ctx) {
+	d->state	= H485_STATE_HUNT;
+	d->escape	= 0;
+	d->streaming	= 0;
+	d->index	= 0;
+	d->payload	= buf;
+	d->bufsize	= bufsize;
+	d->frame	= frame;
+	d->ctx		= ctx;
+	d->cut		= NULL;
+	d->stream	= NULL;
+	d->abort	= NULL;
+
+	d->pos = d->start = 0;
+	d->syncs = d->frames = d->truncated = d->bad_escapes = d->preambles = d->overruns = 0;
+}
+
+void h485_decoder_cut_through(struct h485_decoder *d, h485_cut_cb cut, h485_stream_cb stream, h485_abort_cb abort) {
+	d->cut		= cut;
+	d->stream	= stream;
+	d->abort	= abort;
+}
+
+/** the current frame is complete */
+static void h485_frame_done(struct h485_decoder *d, uint8_t *payload) {
+	d->state = H485_STATE_HUNT;
+	d->streaming = 0;
+	d->frames++;
+	d->frame(d->ctx, &d->header, payload);
+}
+
+/** handle a single unescaped byte -- this is byte_received() from sblp.c */
+static void h485_byte(struct h485_decoder *d, uint8_t b) {
+	if(d->streaming)
+		d->stream(d->ctx, b);
+
+	switch(d->state) {
+		case H485_STATE_HEADER:
+			switch(d->index) {
+				case 1:		/* type */
+					d->header.type = b;
+					d->index++;
+					break;
+
+				case 2:		/* length MSB */
+					d->header.length = b<<8;
+					d->index++;
+					break;
+
+				case 3:		/* length LSB */
+					d->header.length |= b;
+					d->index++;
+					break;
+
+				case 4:		/* destination address */
+					d->header.dest = b;
+					d->index++;
+
+					/* enough to decide where the frame goes */
+					if(d->cut && d->cut(d->ctx, &d->header))
+						d->streaming = 1;
+					break;
+
+				case 5:		/* source address */
+					d->header.src = b;
+					d->index = 0;
+
+					/* end of header -- move to payload */
+					if(d->header.length > d->bufsize) {
+						d->overruns++;
+						d->state = H485_STATE_IGNORE;
+					} else if(d->header.length == 0) {
+						h485_frame_done(d, d->payload);
+					} else {
+						d->state = H485_STATE_PAYLOAD;
+					}
+					break;
+			}
+			break;
+
+		case H485_STATE_PAYLOAD:
+			d->payload[d->index++] = b;
+			if(d->index == d->header.length)
+				h485_frame_done(d, d->payload);
+			break;
+
+		case H485_STATE_IGNORE:
+			/* count down the bytes until we're done */
+			if(++d->index == d->header.length) {
+				if(d->streaming)
+					h485_frame_done(d, NULL);	/* passed through without being stored */
+				else
+					d->state = H485_STATE_HUNT;
+			}
+			break;
+
+		default:
+			/* data outside a frame -- ignore */
+			break;
+	}
+}
+
+/* scanning for special bytes */
+static size_t h485_scan_scalar(const uint8_t *buf, size_t len) {
+	size_t i;
+
+	for(i=0; i<len; i++)
+		if(buf[i] == H485_SYNC_BYTE || buf[i] == H485_ESCAPE_BYTE)
+			break;
+
+	return i;
+}
+
+#ifdef H485_X86
+__attribute__((target("sse2")))
+static size_t h485_scan_sse2(const uint8_t *buf, size_t len) {
+	const __m128i sync = _mm_set1_epi8((char) H485_SYNC_BYTE);
+	const __m128i escape = _mm_set1_epi8((char) H485_ESCAPE_BYTE);
+	__m128i v;
+	size_t i;
+	int mask;
+
+	for(i=0; i+16 <= len; i+=16) {
+		v = _mm_loadu_si128((const __m128i *) (buf + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, sync), _mm_cmpeq_epi8(v, escape)));
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + h485_scan_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t h485_scan_avx2(const uint8_t *buf, size_t len) {
+	const __m256i sync = _mm256_set1_epi8((char) H485_SYNC_BYTE);
+	const __m256i escape = _mm256_set1_epi8((char) H485_ESCAPE_BYTE);
+	__m256i v;
+	__m128i w;
+	size_t i;
+	unsigned int mask;
+
+	for(i=0; i+32 <= len; i+=32) {
+		v = _mm256_loadu_si256((const __m256i *) (buf + i));
+		mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, sync), _mm256_cmpeq_epi8(v, escape)));
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	/* tail -- done here rather than in h485_scan_sse2 to avoid AVX/SSE transition stalls */
+	if(i+16 <= len) {
+		w = _mm_loadu_si128((const __m128i *) (buf + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(w, _mm256_castsi256_si128(sync)),
+						      _mm_cmpeq_epi8(w, _mm256_castsi256_si128(escape))));
+		if(mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+
+	return i + h485_scan_scalar(buf + i, len - i);
+}
+#endif
+
+/** scanner in use, NULL for the bytewise reference path */
+static size_t (*h485_scanner)(const uint8_t *, size_t) = NULL;
+static enum h485_scan h485_scan_mode = H485_SCAN_BYTEWISE;
+static int h485_scan_ready = 0;
+
+enum h485_scan h485_best_scan() {
+#ifdef H485_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return H485_SCAN_AVX2;
+	if(__builtin_cpu_supports("sse2"))
+		return H485_SCAN_SSE2;
+#endif
+	return H485_SCAN_SCALAR;
+}
+
+int h485_set_scan(enum h485_scan mode) {
+	if(mode > h485_best_scan())
+		return 0;
+
+	switch(mode) {
+		case H485_SCAN_BYTEWISE:	h485_scanner = NULL;			break;
+		case H485_SCAN_SCALAR:		h485_scanner = h485_scan_scalar;	break;
+#ifdef H485_X86
+		case H485_SCAN_SSE2:		h485_scanner = h485_scan_sse2;		break;
+		case H485_SCAN_AVX2:		h485_scanner = h485_scan_avx2;		break;
+#endif
+		default:			return 0;
+	}
+
+	h485_scan_mode = mode;
+	h485_scan_ready = 1;
+	return 1;
+}
+
+enum h485_scan h485_get_scan() {
+	if(!h485_scan_ready)
+		h485_set_scan(h485_best_scan());
+
+	return h485_scan_mode;
+}
+
+size_t h485_scan(const uint8_t *buf, size_t len) {
+	if(!h485_scan_ready)
+		h485_set_scan(h485_best_scan());
+
+	return h485_scanner ? h485_scanner(buf, len) : h485_scan_scalar(buf, len);
+}
+
+/** handle a run of ordinary bytes at once, if the state allows it.
+ * \return the number of bytes consumed
+ */
+static size_t h485_bulk(struct h485_decoder *d, const uint8_t *data, size_t len) {
+	size_t n;
+
+	switch(d->state) {
+		case H485_STATE_HUNT:
+			/* nothing to do until the next sync */
+			n = h485_scanner(data, len);
+			d->pos += n;
+			return n;
+
+		case H485_STATE_PAYLOAD:
+			if(len > (size_t) (d->header.length - d->index))
+				len = d->header.length - d->index;
+
+			n = h485_scanner(data, len);
+			memcpy(d->payload + d->index, data, n);
+			d->index += n;
+			d->pos += n;
+
+			if(n && d->index == d->header.length)
+				h485_frame_done(d, d->payload);
+			return n;
+
+		case H485_STATE_IGNORE:
+			if(len > (size_t) (d->header.length - d->index))
+				len = d->header.length - d->index;
+
+			n = h485_scanner(data, len);
+			d->index += n;
+			d->pos += n;
+
+			if(n && d->index == d->header.length)
+				d->state = H485_STATE_HUNT;
+			return n;
+
+		default:
+			/* headers are handled a byte at a time */
+			return 0;
+	}
+}
+
+void h485_decode(struct h485_decoder *d, const uint8_t *data, size_t len) {
+	size_t i = 0, n;
+	uint8_t b;
+
+	if(!h485_scan_ready)
+		h485_set_scan(h485_best_scan());
+
+	while(i < len) {
+		/* skip or copy ordinary bytes in bulk where the state allows */
+		if(h485_scanner && !d->escape && !d->streaming) {
+			n = h485_bulk(d, data + i, len - i);
+
+			i += n;
+			if(n)
+				continue;
+		}
+
+		b = data[i];
+
+		switch(b) {
+			case H485_SYNC_BYTE:
+				/* a sync always starts a new frame, whatever we were doing */
+				if(d->state == H485_STATE_HEADER && d->index == 1)
+					d->preambles++;
+				else if(d->state != H485_STATE_HUNT)
+					d->truncated++;
+
+				if(d->streaming) {
+					d->streaming = 0;
+					d->abort(d->ctx);
+				}
+
+				d->syncs++;
+				d->start = d->pos;
+				d->escape = 0;
+				d->state = H485_STATE_HEADER;
+				d->index = 1;
+				break;
+
+			case H485_ESCAPE_BYTE:
+				d->escape = 1;
+				break;
+
+			default:
+				if(d->escape) {
+					d->escape = 0;
+					if(b == H485_ESCAPED_SYNC) {
+						b = H485_SYNC_BYTE;
+					} else if(b == H485_ESCAPED_ESCAPE) {
+						b = H485_ESCAPE_BYTE;
+					} else {
+						/* no sender escapes anything else -- we've missed something, so drop the
+						 * frame and wait for the next sync, like tiny485 and sblp do
+						 */
+						d->bad_escapes++;
+						if(d->streaming) {
+							d->streaming = 0;
+							d->abort(d->ctx);
+						}
+						d->state = H485_STATE_HUNT;
+						break;
+					}
+				}
+
+				h485_byte(d, b);
+				break;
+		}
+
+		i++;
+		d->pos++;
+	}
+}
+
+int h485_idle(const struct h485_decoder *d) {
+	return d->state == H485_STATE_HUNT;
+}
+
+/** append a single escaped byte to out */
+static inline uint8_t *h485_put(uint8_t *out, uint8_t b) {
+	switch(b) {
+		case H485_SYNC_BYTE:
+			*out++ = H485_ESCAPE_BYTE;
+			*out++ = H485_ESCAPED_SYNC;
+			break;
+
+		case H485_ESCAPE_BYTE:
+			*out++ = H485_ESCAPE_BYTE;
+			*out++ = H485_ESCAPED_ESCAPE;
+			break;
+
+		default:
+			*out++ = b;
+			break;
+	}
+
+	return out;
+}
+
+void h485_set_preamble(unsigned int n) {
+	h485_preamble = n < H485_MAX_PREAMBLE ? n : H485_MAX_PREAMBLE;
+}
+
+size_t h485_encode(const struct sblp_header *header, const uint8_t *payload, uint8_t *out) {
+	uint8_t *p = out;
+	uint16_t i;
+
+	for(i=0; i<h485_preamble; i++)
+		*p++ = H485_SYNC_BYTE;
+
+	*p++ = H485_SYNC_BYTE;
+	p = h485_put(p, header->type);
+	p = h485_put(p, (header->length >> 8) & 0xFF);
+	p = h485_put(p, header->length & 0xFF);
+	p = h485_put(p, header->dest);
+	p = h485_put(p, header->src);
+
+	for(i=0; i<header->length; i++)
+		p = h485_put(p, payload[i]);
+
+	return p - out;
+}
+
+void h485_pack_header(const struct sblp_header *header, uint8_t *out) {
+	out[0] = header->type;
+	out[1] = (header->length >> 8) & 0xFF;
+	out[2] = header->length & 0xFF;
+	out[3] = header->dest;
+	out[4] = header->src;
+}
+
+void h485_unpack_header(struct sblp_header *header, const uint8_t *in) {
+	header->type	= in[0];
+	header->length	= (in[1] << 8) | in[2];
+	header->dest	= in[3];
+	header->src	= in[4];
+}
+
+/** read a counter of the given number of bytes, MSB first */
+static uint32_t h485_get(const uint8_t **p, int bytes) {
+	uint32_t v = 0;
+
+	while(bytes--)
+		v = (v << 8) | *(*p)++;
+
+	return v;
+}
+
+int h485_unpack_stats(struct h485_node_stats *stats, const uint8_t *payload, uint16_t length) {
+	const uint8_t *p = payload;
+
+	if(length != SBLP_STATS_LENGTH)
+		return -1;
+
+	/* same order as sblp_fill_stats() */
+	stats->hw.bytes_in		= h485_get(&p, 4);
+	stats->hw.bytes_out		= h485_get(&p, 4);
+	stats->hw.syncs			= h485_get(&p, 2);
+	stats->hw.escapes_in		= h485_get(&p, 2);
+	stats->hw.escapes_out		= h485_get(&p, 2);
+	stats->hw.framing_errors	= h485_get(&p, 2);
+	stats->hw.overflows		= h485_get(&p, 2);
+
+	stats->sblp.frames_in		= h485_get(&p, 2);
+	stats->sblp.frames_out		= h485_get(&p, 2);
+	stats->sblp.dropped		= h485_get(&p, 2);
+	stats->sblp.overruns		= h485_get(&p, 2);
+
+	return 0;
+}
+
+int h485_unpack_latency(struct h485_latency *latency, const uint8_t *payload, uint16_t length) {
+	const uint8_t *p = payload;
+	int i;
+
+	if(length != SBLP_LATENCY_LENGTH)
+		return -1;
+
+	/* same order as sblp_fill_latency() */
+	latency->dest	= h485_get(&p, 1);
+	latency->pings	= h485_get(&p, 2);
+	latency->lost	= h485_get(&p, 2);
+	for(i=0; i<SBLP_LATENCY_BUCKETS; i++)
+		latency->buckets[i] = h485_get(&p, 2);
+
+	return 0;
+}
+
+long h485_latency_percentile(const struct h485_latency *latency, double share) {
+	unsigned long total = 0, sum = 0;
+	int i;
+
+	for(i=0; i<SBLP_LATENCY_BUCKETS; i++)
+		total += latency->buckets[i];
+	if(!total)
+		return -1;
+
+	for(i=0; i<SBLP_LATENCY_BUCKETS - 1; i++) {
+		sum += latency->buckets[i];
+		if(sum >= share * total)
+			return (1L << i) - 1;
+	}
+
+	return -1;
+}
+
+void h485_wire_order(uint8_t *buf, size_t len) {
+	size_t i;
+	unsigned int b, j;
+
+	if(!h485_reverse_ready) {
+		for(b=0; b<256; b++) {
+			h485_reverse[b] = 0;
+			for(j=0; j<=7; j++)
+				if(b & (1 << j)) h485_reverse[b] |= (1 << (7-j));
+		}
+		h485_reverse_ready = 1;
+	}
+
+	for(i=0; i<len; i++)
+		buf[i] = h485_reverse[buf[i]];
+}
+
+/** map a numeric baud rate onto a termios speed constant */
+static speed_t h485_speed(unsigned int baud) {
+	switch(baud) {
+		case 1200:	return B1200;
+		case 2400:	return B2400;
+		case 4800:	return B4800;
+		case 9600:	return B9600;
+		case 19200:	return B19200;
+		case 38400:	return B38400;
+		case 57600:	return B57600;
+		case 115200:	return B115200;
+		default:	return B0;
+	}
+}
+
+int h485_open_tty(const char *path, unsigned int baud) {
+	struct termios tio;
+	speed_t speed;
+	int fd;
+
+	if((speed = h485_speed(baud)) == B0)
+		return -1;
+
+	if((fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+		return -1;
+
+	if(tcgetattr(fd, &tio) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* 8N1, no line discipline -- the bus is a raw byte stream */
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+	tio.c_cc[VMIN]  = 1;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
+	if(tcsetattr(fd, TCSANOW, &tio) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int h485_send_break(int fd, unsigned int baud) {
+	/* what's already queued goes out first, or the break would cut it short */
+	if(tcdrain(fd) < 0 || ioctl(fd, TIOCSBRK) < 0)
+		return -1;
+
+	usleep(H485_BREAK_BITS * 1000000UL / baud);
+
+	if(ioctl(fd, TIOCCBRK) < 0)
+		return -1;
+
+	/* and a character of idle line, so the first start bit isn't mistaken for more break */
+	usleep(10 * 1000000UL / baud);
+	return 0;
+}
+
+/* discovery */
+#define H485_DISCOVER_WAIT	50	/**< ms to wait for the first byte of an answer, on top of 3 byte times */
+#define H485_DISCOVER_GAP	20	/**< ms of silence that end an answer, on top of 3 byte times */
+#define H485_DISCOVER_TRIES	3	/**< times a single id is asked about before giving up on it */
+#define H485_DISCOVER_DEPTH	40	/**< ranges waiting to be asked about; a 32-bit id needs 33 */
+
+/** outcome of a query */
+enum h485_answer {
+	H485_EMPTY,		/**< no answer */
+	H485_FOUND,		/**< a single clean reply */
+	H485_COLLISION		/**< anything else */
+};
+
+/** what came back for a query */
+struct h485_answers {
+	unsigned int	replies;	/**< discovery replies seen */
+	unsigned int	garbled;	/**< of which the two copies of the id didn't match */
+	uint32_t	id;		/**< id in the last one */
+	uint8_t		address;	/**< and its source */
+	size_t		clean;		/**< bytes taken up by well-formed frames */
+};
+
+/** number of bytes a frame takes up on the wire */
+static size_t h485_encoded_length(const struct sblp_header *header, const uint8_t *payload) {
+	uint8_t head[HEADER_LENGTH];
+	size_t len = 1;
+	uint16_t i;
+
+	h485_pack_header(header, head);
+	for(i=0; i<HEADER_LENGTH; i++)
+		len += (head[i] == H485_SYNC_BYTE || head[i] == H485_ESCAPE_BYTE) ? 2 : 1;
+	for(i=0; i<header->length; i++)
+		len += (payload[i] == H485_SYNC_BYTE || payload[i] == H485_ESCAPE_BYTE) ? 2 : 1;
+
+	return len;
+}
+
+static void h485_answer_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	struct h485_answers *a = ctx;
+	int i;
+
+	/* our own query echoed back, or other traffic, is fine as long as it is intact */
+	a->clean += h485_encoded_length(header, payload);
+
+	if(header->type == DISCOVER_TYPE_REPLY) {
+		a->replies++;
+
+		for(i=0; i<4; i++)
+			if(header->length != 8 || (payload[i] ^ payload[4 + i]) != 0xFF)
+				break;
+		if(i < 4) {
+			a->garbled++;
+			return;
+		}
+
+		a->id = ((uint32_t) payload[0] << 24) | ((uint32_t) payload[1] << 16) | ((uint32_t) payload[2] << 8) | payload[3];
+		a->address = header->src;
+	}
+}
+
+/** broadcast a discovery frame and wait until it has left the UART */
+static int h485_discover_send(int fd, uint8_t src, uint8_t type, uint8_t *payload, uint16_t length) {
+	uint8_t buf[H485_ENCODED_SIZE(8)];
+	struct sblp_header header;
+	struct pollfd pfd;
+	size_t len, off = 0;
+	ssize_t n;
+
+	header.type	= type;
+	header.length	= length;
+	header.dest	= SBLP_BROADCAST;
+	header.src	= src;
+
+	len = h485_encode(&header, payload, buf);
+	h485_wire_order(buf, len);
+
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+
+	while(off < len) {
+		if((n = write(fd, buf + off, len - off)) < 0) {
+			if(errno != EAGAIN && errno != EINTR)
+				return -1;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		off += n;
+	}
+
+	return tcdrain(fd);
+}
+
+/** put a 32-bit value, MSB first */
+static void h485_put32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/** ask whether anyone has an id in [lo, hi]
+ * \return an h485_answer, or -1 on error
+ */
+static int h485_query(int fd, unsigned int baud, uint8_t src, uint32_t lo, uint32_t hi, uint32_t *id, uint8_t *address) {
+	struct h485_decoder d;
+	struct h485_answers a;
+	struct pollfd pfd;
+	uint8_t query[8], payload[256], buf[256];
+	int byte_ms = 3 * 10000 / baud + 1, timeout;
+	ssize_t n;
+
+	memset(&a, 0, sizeof(a));
+	h485_decoder_init(&d, payload, sizeof(payload), h485_answer_frame, &a);
+
+	/* whatever was on the line before isn't an answer */
+	while(read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	h485_put32(query, lo);
+	h485_put32(query + 4, hi);
+	if(h485_discover_send(fd, src, DISCOVER_TYPE_QUERY, query, 8) < 0)
+		return -1;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	/* read until the line has been quiet for a while */
+	timeout = H485_DISCOVER_WAIT + byte_ms;
+	while((n = poll(&pfd, 1, timeout)) != 0) {
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if((n = read(fd, buf, sizeof(buf))) < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(n == 0)
+			return -1;
+
+		h485_wire_order(buf, n);
+		h485_decode(&d, buf, n);
+		timeout = H485_DISCOVER_GAP + byte_ms;
+	}
+
+	/* bytes that didn't make up a frame are answers talking over each other */
+	if(d.pos != a.clean + d.preambles || a.replies > 1 || a.garbled || (a.replies && (a.id < lo || a.id > hi)))
+		return H485_COLLISION;
+	if(!a.replies)
+		return H485_EMPTY;
+
+	*id = a.id;
+	*address = a.address;
+	return H485_FOUND;
+}
+
+int h485_discover(int fd, unsigned int baud, uint8_t src, h485_found_cb found, void *ctx) {
+	struct {
+		uint32_t lo, hi;
+	} stack[H485_DISCOVER_DEPTH];
+	uint32_t lo, hi, mid, id, last = 0;
+	uint8_t address, mute[4];
+	int sp = 0, queries = 0, tries = 0, have_last = 0, r;
+
+	if(h485_discover_send(fd, src, DISCOVER_TYPE_RESET, NULL, 0) < 0)
+		return -1;
+
+	stack[sp].lo = 0;
+	stack[sp].hi = 0xFFFFFFFF;
+	sp++;
+
+	while(sp) {
+		lo = stack[sp-1].lo;
+		hi = stack[sp-1].hi;
+
+		if((r = h485_query(fd, baud, src, lo, hi, &id, &address)) < 0)
+			return -1;
+		queries++;
+
+		switch(r) {
+			case H485_EMPTY:
+				sp--;
+				tries = 0;
+				break;
+
+			case H485_FOUND:
+				/* the same node again means it missed the mute */
+				if(!have_last || id != last) {
+					found(ctx, id, address);
+					last = id;
+					have_last = 1;
+					tries = 0;
+				} else if(++tries == H485_DISCOVER_TRIES) {
+					sp--;
+					tries = 0;
+					break;
+				}
+
+				/* mute it and ask again: its answer may have drowned out another one */
+				h485_put32(mute, id);
+				if(h485_discover_send(fd, src, DISCOVER_TYPE_MUTE, mute, 4) < 0)
+					return -1;
+				break;
+
+			case H485_COLLISION:
+				if(lo == hi) {
+					/* two nodes with the same id, or a noisy line */
+					if(++tries == H485_DISCOVER_TRIES) {
+						sp--;
+						tries = 0;
+					}
+					break;
+				}
+
+				mid = lo + (hi - lo) / 2;
+				stack[sp-1].lo = mid + 1;
+				stack[sp].lo = lo;
+				stack[sp].hi = mid;
+				sp++;
+				tries = 0;
+				break;
+		}
+	}
+
+	return queries;
+}
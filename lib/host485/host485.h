@@ -0,0 +1,204 @@
+/** \file host485.h
+ * Header file for the host-side byte-level framing layer.
+ *
+ * This is the counterpart of tiny485 for machines with an operating
+ * system: it turns a stream of raw bus bytes into SBLP frames and back.
+ */
+
+#ifndef _HOST485_H
+
+#include <stddef.h>
+
+#include "../interop.h"
+
+/* data bytes with special meanings -- must match tiny485.c */
+#define H485_SYNC_BYTE		((uint8_t) 0xFF)		/**< The synchronisation byte */
+#define H485_ESCAPE_BYTE	((uint8_t) 0x55)		/**< Escape byte for syncs in messages */
+
+#define H485_ESCAPED_SYNC	((uint8_t) 0x00)		/**< A synchronisation byte when escaped */
+#define H485_ESCAPED_ESCAPE	((uint8_t) 0x01)		/**< An escape byte when escaped */
+
+#define H485_DEFAULT_BAUD	1200	/**< T485_BIT_TIMER at 1 MHz with a /8 prescaler */
+#define H485_MAX_PAYLOAD	65535	/**< largest payload sblp_header.length can describe */
+#define H485_MAX_PREAMBLE	4	/**< most syncs h485_set_preamble() puts before a frame */
+#define H485_BREAK_BITS		20	/**< length of a break; anything over the 10 bits of a character will do */
+
+/** worst-case size of a frame with a payload of len bytes once it is on the wire */
+#define H485_ENCODED_SIZE(len)	(1 + H485_MAX_PREAMBLE + 2 * (HEADER_LENGTH + (size_t) (len)))
+
+/** called for every complete frame the decoder sees */
+typedef void (*h485_frame_cb)(void *ctx, struct sblp_header *header, uint8_t *payload);
+
+/** called as soon as the destination address of a frame is known.
+ * The header is complete up to and including dest. Return nonzero to have
+ * the rest of the frame passed to the stream callback as it arrives.
+ */
+typedef int (*h485_cut_cb)(void *ctx, struct sblp_header *header);
+
+/** called for every byte of a frame claimed by the cut callback */
+typedef void (*h485_stream_cb)(void *ctx, uint8_t b);
+
+/** called when a frame claimed by the cut callback is cut short by a sync */
+typedef void (*h485_abort_cb)(void *ctx);
+
+/** streaming decoder state. Uses a fixed, caller-provided payload buffer. */
+struct h485_decoder {
+	enum {
+		H485_STATE_HUNT,	/**< waiting for the first sync */
+		H485_STATE_HEADER,	/**< receiving a frame header */
+		H485_STATE_PAYLOAD,	/**< receiving a frame payload */
+		H485_STATE_IGNORE	/**< skipping a payload that doesn't fit the buffer */
+	} state;
+
+	uint8_t		 escape;	/**< set when the previous byte was an escape */
+	uint8_t		 streaming;	/**< set while the current frame is being streamed */
+	uint16_t	 index;		/**< position within header or payload */
+	struct sblp_header header;
+
+	uint8_t		*payload;	/**< payload buffer */
+	size_t		 bufsize;	/**< size of the payload buffer */
+
+	h485_frame_cb	 frame;		/**< frame callback */
+	void		*ctx;		/**< passed to the frame callback */
+
+	/* optional cut-through hooks */
+	h485_cut_cb	 cut;
+	h485_stream_cb	 stream;
+	h485_abort_cb	 abort;
+
+	unsigned long long pos;		/**< number of bytes decoded so far */
+	unsigned long long start;	/**< position of the sync that started the current frame */
+
+	/* statistics */
+	unsigned long	 syncs;		/**< synchronisation bytes seen */
+	unsigned long	 frames;	/**< complete frames delivered */
+	unsigned long	 truncated;	/**< frames cut short by a sync */
+	unsigned long	 bad_escapes;	/**< escapes followed by something no sender escapes: the frame is dropped */
+	unsigned long	 preambles;	/**< syncs repeated before a frame to wake up sleeping nodes */
+	unsigned long	 overruns;	/**< frames too large for the payload buffer */
+};
+
+/** initialise a decoder */
+void h485_decoder_init(struct h485_decoder *d, uint8_t *buf, size_t bufsize, h485_frame_cb frame, void *ctx);
+
+/** enable cut-through on a decoder.
+ * Frames that are streamed are still delivered to the frame callback at the
+ * end, with a NULL payload if they did not fit the payload buffer.
+ */
+void h485_decoder_cut_through(struct h485_decoder *d, h485_cut_cb cut, h485_stream_cb stream, h485_abort_cb abort);
+
+/** ways of finding special bytes, in order of preference */
+enum h485_scan {
+	H485_SCAN_BYTEWISE,	/**< reference: every byte goes through the state machine */
+	H485_SCAN_SCALAR,	/**< bulk copies, plain C scan */
+	H485_SCAN_SSE2,		/**< bulk copies, 16 bytes per compare */
+	H485_SCAN_AVX2		/**< bulk copies, 32 bytes per compare */
+};
+
+/** the fastest scan method this CPU supports. Used unless h485_set_scan() says otherwise. */
+enum h485_scan h485_best_scan();
+
+/** select the scan method for all decoders
+ * \return 0 if the CPU doesn't support it
+ */
+int h485_set_scan(enum h485_scan mode);
+
+/** the scan method in use */
+enum h485_scan h485_get_scan();
+
+/** find the first sync or escape byte in buf
+ * \return its offset, or len if there is none
+ */
+size_t h485_scan(const uint8_t *buf, size_t len);
+
+/** feed raw bus bytes (in host bit order) to a decoder */
+void h485_decode(struct h485_decoder *d, const uint8_t *data, size_t len);
+
+/** is the decoder between frames?
+ * The bus is half-duplex: a host only starts sending when it is, like a
+ * node only sends from SBLP_STATE_IDLE.
+ */
+int h485_idle(const struct h485_decoder *d);
+
+/** put n extra syncs (at most H485_MAX_PREAMBLE) in front of every frame encoded from now on.
+ * Nodes that power down between frames (T485_PREAMBLE in tiny485) need
+ * them to wake up in time.
+ */
+void h485_set_preamble(unsigned int n);
+
+/** encode a frame for the wire. out must hold H485_ENCODED_SIZE(header->length) bytes.
+ * \return the number of bytes written
+ */
+size_t h485_encode(const struct sblp_header *header, const uint8_t *payload, uint8_t *out);
+
+/** write the unescaped header to out (HEADER_LENGTH bytes) */
+void h485_pack_header(const struct sblp_header *header, uint8_t *out);
+
+/** read an unescaped header from in (HEADER_LENGTH bytes) */
+void h485_unpack_header(struct sblp_header *header, const uint8_t *in);
+
+/** a node's counters, as sent in an SBLP_TYPE_STATS reply */
+struct h485_node_stats {
+	struct hw_stats		hw;
+	struct sblp_stats	sblp;
+};
+
+/** read the counters from an SBLP_TYPE_STATS payload
+ * \return 0, or -1 if the length is wrong
+ */
+int h485_unpack_stats(struct h485_node_stats *stats, const uint8_t *payload, uint16_t length);
+
+/** a node's ping round trips, as sent in an SBLP_TYPE_LATENCY reply */
+struct h485_latency {
+	uint8_t		 dest;				/**< the node it pinged */
+	uint16_t	 pings;				/**< pings sent */
+	uint16_t	 lost;				/**< of which no echo came back */
+	uint16_t	 buckets[SBLP_LATENCY_BUCKETS];	/**< bucket n: round trips of 2^(n-1) up to 2^n - 1 ticks */
+};
+
+/** read the histogram from an SBLP_TYPE_LATENCY payload
+ * \return 0, or -1 if the length is wrong
+ */
+int h485_unpack_latency(struct h485_latency *latency, const uint8_t *payload, uint16_t length);
+
+/** the upper bound, in ticks, of the round trip below which the given share (0-1) of the answered pings lies.
+ * \return -1 if there are none, or if it's in the open-ended last bucket
+ */
+long h485_latency_percentile(const struct h485_latency *latency, double share);
+
+/** convert between wire and host bit order, in place.
+ * The USI shifts bytes out MSB first while a PC UART expects LSB first,
+ * so everything passing through a serial port must be bit-reversed.
+ */
+void h485_wire_order(uint8_t *buf, size_t len);
+
+/** open a serial port in raw, non-blocking mode
+ * \return a file descriptor, or -1 on error
+ */
+int h485_open_tty(const char *path, unsigned int baud);
+
+/** hold the line low for H485_BREAK_BITS bit times, which puts every node back in step with the bus.
+ * Blocks until everything written before has gone out and the break is over.
+ * \return 0, or -1 on error
+ */
+int h485_send_break(int fd, unsigned int baud);
+
+/** called for every node discovery finds, with its unique id and its address (0xFF if it has none) */
+typedef void (*h485_found_cb)(void *ctx, uint32_t id, uint8_t address);
+
+/** find every node on the bus behind fd (see lib/discover), sending from src.
+ * Blocks until the scan is done and reads everything on the line while it runs.
+ * \return the number of queries it took, or -1 on error
+ */
+int h485_discover(int fd, unsigned int baud, uint8_t src, h485_found_cb found, void *ctx);
+
+/* hw layer (host485_phy.c) */
+#ifdef INTEROP_INSTANCE
+#define h485_attach	INTEROP_NAME(INTEROP_INSTANCE, h485_attach)
+#endif
+
+/** run the hw layer of interop.h on fd, for sblp on a host. Call before hw_init(). */
+void h485_attach(int fd);
+
+#define _HOST485_H
+#endif
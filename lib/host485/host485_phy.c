@@ -0,0 +1,164 @@
+/** \file host485_phy.c
+ * \brief The hw layer of interop.h for hosts, on a file descriptor.
+ *
+ * With this, sblp itself runs on a machine with an operating system,
+ * on a serial port opened with h485_open_tty() or on one end of a
+ * socketpair in a simulation. Built with INTEROP_INSTANCE, there is one
+ * per bus: <instance>_h485_attach() and the rest of the instance's names.
+ *
+ * The layer above is only ever called from hw_poll(), like tiny485 with
+ * T485_DEFER: send_byte() writes the byte and leaves byte_sent() to the
+ * next hw_poll(), so a frame isn't sent by one deep recursion. Each
+ * hw_poll() hands up at most one event and never blocks.
+ *
+ * Adapters that echo what they send aren't supported; there is no
+ * telling the echo from another node's bytes.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "host485.h"
+
+static struct {
+	int		 fd;
+	uint8_t		 escape;	/**< the last byte received was an escape */
+	uint8_t		 sent;		/**< a byte is out, byte_sent() is due */
+
+	struct hw_stats	 stats;
+} h485_phy = { .fd = -1 };
+
+/** write bytes in host bit order, retrying while the descriptor is full */
+static void h485_phy_write(uint8_t *buf, size_t len) {
+	ssize_t n;
+
+	h485_wire_order(buf, len);
+	while(len) {
+		n = write(h485_phy.fd, buf, len);
+		if(n < 0) {
+			if(errno != EAGAIN && errno != EINTR)
+				return;
+			poll(&(struct pollfd) { h485_phy.fd, POLLOUT, 0 }, 1, -1);
+			continue;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	h485_phy.sent = 1;
+}
+
+void h485_attach(int fd) {
+	h485_phy.fd = fd;
+}
+
+void hw_init() {
+	h485_phy.escape = 0;
+	h485_phy.sent = 0;
+}
+
+void begin_transmission() {
+}
+
+void end_transmission() {
+}
+
+void send_byte(uint8_t b) {
+	uint8_t buf[2] = { b };
+	size_t len = 1;
+
+	switch(b) {
+		case H485_SYNC_BYTE:
+			buf[0] = H485_ESCAPE_BYTE;
+			buf[1] = H485_ESCAPED_SYNC;
+			len = 2;
+			break;
+
+		case H485_ESCAPE_BYTE:
+			buf[1] = H485_ESCAPED_ESCAPE;
+			len = 2;
+			break;
+
+		default:
+			break;
+	}
+
+	h485_phy.stats.bytes_out += len;
+	h485_phy.stats.escapes_out += len - 1;
+	h485_phy_write(buf, len);
+}
+
+void send_sync() {
+	uint8_t b = H485_SYNC_BYTE;
+
+	h485_phy.stats.bytes_out++;
+	h485_phy_write(&b, 1);
+}
+
+uint8_t hw_poll() {
+	uint8_t b;
+
+	if(h485_phy.sent) {
+		h485_phy.sent = 0;
+		byte_sent();
+		return 1;
+	}
+
+	if(h485_phy.fd < 0 || poll(&(struct pollfd) { h485_phy.fd, POLLIN, 0 }, 1, 0) <= 0)
+		return 0;
+	if(read(h485_phy.fd, &b, 1) != 1)
+		return 0;
+
+	h485_wire_order(&b, 1);
+	h485_phy.stats.bytes_in++;
+
+	switch(b) {
+		case H485_SYNC_BYTE:
+			h485_phy.escape = 0;
+			h485_phy.stats.syncs++;
+			sync_received();
+			break;
+
+		case H485_ESCAPE_BYTE:
+			h485_phy.escape = 1;
+			break;
+
+		default:
+			if(!h485_phy.escape) {
+				byte_received(b);
+				break;
+			}
+
+			h485_phy.escape = 0;
+			if(b == H485_ESCAPED_SYNC) {
+				h485_phy.stats.escapes_in++;
+				byte_received(H485_SYNC_BYTE);
+			} else if(b == H485_ESCAPED_ESCAPE) {
+				h485_phy.stats.escapes_in++;
+				byte_received(H485_ESCAPE_BYTE);
+			} else {
+				/* no sender escapes anything else -- we've missed something */
+				h485_phy.stats.framing_errors++;
+				framing_error();
+			}
+			break;
+	}
+
+	return 1;
+}
+
+/* the layer above is only called from hw_poll(), so there's nothing to hold off */
+uint8_t hw_lock() {
+	return 0;
+}
+
+void hw_unlock(uint8_t state) {
+	(void) state;
+}
+
+void hw_get_stats(struct hw_stats *stats) {
+	*stats = h485_phy.stats;
+}
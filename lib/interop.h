@@ -6,31 +6,211 @@
 
 #include "inttypes.h"
 
+/* calls between the hw layer and the link layer.
+ * When both are built into one translation unit (see lib/node), INTEROP_UNITY
+ * makes them static inline, so the compiler resolves them there and inlines what it can
+ * into the interrupts instead of calling out with every register saved.
+ */
+#ifdef INTEROP_UNITY
+#define INTEROP_LINK	static inline
+#else
+#define INTEROP_LINK	extern
+#endif
+
+/* instances
+ * A node on more than one bus builds a hw layer, and the sblp on it, once
+ * per bus, each with -DINTEROP_INSTANCE=<name>. Everything below that
+ * belongs to a bus then gets the name in front: usart485.c built with
+ * INTEROP_INSTANCE=leg1 provides leg1_send_byte() and calls
+ * leg1_byte_received(), sblp.c on top of it provides leg1_send_frame() and
+ * calls leg1_frame_received(). The calls within an instance are still
+ * plain calls resolved when building, and INTEROP_UNITY works as before.
+ * Code built without INTEROP_INSTANCE declares the instances it uses with
+ * INTEROP_DECLARE_HW() and INTEROP_DECLARE_SBLP().
+ *
+ * Only the link is per bus: the protocols above sblp and sblp_clock()
+ * exist once, and use whichever instance they are built with.
+ */
+#define INTEROP_PASTE(i, name)	i ## _ ## name
+#define INTEROP_NAME(i, name)	INTEROP_PASTE(i, name)	/**< name within instance i */
+
+#ifdef INTEROP_INSTANCE
+#define hw_init			INTEROP_NAME(INTEROP_INSTANCE, hw_init)
+#define byte_received		INTEROP_NAME(INTEROP_INSTANCE, byte_received)
+#define byte_sent		INTEROP_NAME(INTEROP_INSTANCE, byte_sent)
+#define sync_received		INTEROP_NAME(INTEROP_INSTANCE, sync_received)
+#define framing_error		INTEROP_NAME(INTEROP_INSTANCE, framing_error)
+#define begin_transmission	INTEROP_NAME(INTEROP_INSTANCE, begin_transmission)
+#define end_transmission	INTEROP_NAME(INTEROP_INSTANCE, end_transmission)
+#define send_byte		INTEROP_NAME(INTEROP_INSTANCE, send_byte)
+#define send_sync		INTEROP_NAME(INTEROP_INSTANCE, send_sync)
+#define hw_lock			INTEROP_NAME(INTEROP_INSTANCE, hw_lock)
+#define hw_unlock		INTEROP_NAME(INTEROP_INSTANCE, hw_unlock)
+#define hw_poll			INTEROP_NAME(INTEROP_INSTANCE, hw_poll)
+#define hw_get_stats		INTEROP_NAME(INTEROP_INSTANCE, hw_get_stats)
+#define hw_trace_freeze		INTEROP_NAME(INTEROP_INSTANCE, hw_trace_freeze)
+#define hw_trace_resume		INTEROP_NAME(INTEROP_INSTANCE, hw_trace_resume)
+
+#define sblp_init		INTEROP_NAME(INTEROP_INSTANCE, sblp_init)
+#define frame_received		INTEROP_NAME(INTEROP_INSTANCE, frame_received)
+#define frame_sent		INTEROP_NAME(INTEROP_INSTANCE, frame_sent)
+#define send_frame		INTEROP_NAME(INTEROP_INSTANCE, send_frame)
+#define sblp_set_address	INTEROP_NAME(INTEROP_INSTANCE, sblp_set_address)
+#define sblp_join_group		INTEROP_NAME(INTEROP_INSTANCE, sblp_join_group)
+#define sblp_leave_group	INTEROP_NAME(INTEROP_INSTANCE, sblp_leave_group)
+#define sblp_set_ready		INTEROP_NAME(INTEROP_INSTANCE, sblp_set_ready)
+#define sblp_tick		INTEROP_NAME(INTEROP_INSTANCE, sblp_tick)
+#define sblp_idle		INTEROP_NAME(INTEROP_INSTANCE, sblp_idle)
+#define sblp_get_stats		INTEROP_NAME(INTEROP_INSTANCE, sblp_get_stats)
+#define sblp_ping		INTEROP_NAME(INTEROP_INSTANCE, sblp_ping)
+#endif
+
+/** declare the hw layer calls of instance i, both ways */
+#define INTEROP_DECLARE_HW(i) \
+	extern void i ## _hw_init(); \
+	extern void i ## _byte_received(uint8_t b); \
+	extern void i ## _byte_sent(); \
+	extern void i ## _sync_received(); \
+	extern void i ## _framing_error(); \
+	extern void i ## _begin_transmission(); \
+	extern void i ## _end_transmission(); \
+	extern void i ## _send_byte(uint8_t b); \
+	extern void i ## _send_sync(); \
+	extern uint8_t i ## _hw_lock(); \
+	extern void i ## _hw_unlock(uint8_t state); \
+	extern uint8_t i ## _hw_poll(); \
+	extern void i ## _hw_get_stats(struct hw_stats *stats)
+
+/** declare the sblp calls of instance i, both ways */
+#define INTEROP_DECLARE_SBLP(i) \
+	extern void i ## _sblp_init(); \
+	extern void i ## _frame_received(struct sblp_header *header, uint8_t *payload); \
+	extern void i ## _frame_sent(); \
+	extern uint8_t i ## _send_frame(struct sblp_header *header, uint8_t *payload); \
+	extern void i ## _sblp_set_address(uint8_t address); \
+	extern void i ## _sblp_join_group(uint8_t group); \
+	extern void i ## _sblp_leave_group(uint8_t group); \
+	extern void i ## _sblp_set_ready(uint8_t ready); \
+	extern void i ## _sblp_tick(); \
+	extern uint8_t i ## _sblp_idle(); \
+	extern const struct sblp_stats *i ## _sblp_get_stats()
+
 /* hw layer */
 extern void hw_init();				/**< initialise hardware */
 
-extern void byte_received(uint8_t b);		/**< called when the HW layer receives a byte */
-extern void byte_sent();			/**< called when the HW layer has sent a byte */
-extern void sync_received();			/**< called when the HW layer sees the synchronisation sequence */
+INTEROP_LINK void byte_received(uint8_t b);	/**< called when the HW layer receives a byte */
+INTEROP_LINK void byte_sent();			/**< called when the HW layer has sent a byte */
+INTEROP_LINK void sync_received();		/**< called when the HW layer sees the synchronisation sequence */
+INTEROP_LINK void framing_error();		/**< called when the HW layer drops a byte that can't be right; the frame it was in is lost */
 
-extern void begin_transmission();		/**< called when the link layer wishes to start a (potentially multi-byte) transmission. */
-extern void end_transmission();			/**< called when the link layer wishes to end a (potentially multi-byte) transmission. */
-extern void send_byte(uint8_t b);		/**< called when the link layer wishes to send a single byte (as part of a transmission). */
-extern void send_sync();			/**< called when the link layer wishes to send a synchronisation sequence (as part of a transmission). */
+INTEROP_LINK void begin_transmission();		/**< called when the link layer wishes to start a (potentially multi-byte) transmission. */
+INTEROP_LINK void end_transmission();		/**< called when the link layer wishes to end a (potentially multi-byte) transmission. */
+INTEROP_LINK void send_byte(uint8_t b);		/**< called when the link layer wishes to send a single byte (as part of a transmission). */
+INTEROP_LINK void send_sync();			/**< called when the link layer wishes to send a synchronisation sequence (as part of a transmission). */
+
+/** keep the hw layer from calling the layer above until hw_unlock().
+ * For the link layer's updates, from the main loop, to state the hw layer's calls change as well.
+ * Returns what hw_unlock() restores, so locks nest; keep them short, a byte is coming in meanwhile.
+ */
+INTEROP_LINK uint8_t hw_lock();
+INTEROP_LINK void hw_unlock(uint8_t state);	/**< undo the hw_lock() that returned state */
+
+/** hand one event the hw layer has queued to the layer above, for hw layers that don't call it from their interrupts.
+ * Call from the main loop until it returns 0; it always does for hw layers that need no polling.
+ */
+extern uint8_t hw_poll();
+
+/** counters kept by the hw layer. They wrap around; readers work with differences. */
+struct hw_stats {
+	uint32_t	bytes_in;		/**< bytes received, syncs and escapes included */
+	uint32_t	bytes_out;		/**< bytes sent, syncs and escapes included */
+	uint16_t	syncs;			/**< syncs received */
+	uint16_t	escapes_in;		/**< escaped bytes received */
+	uint16_t	escapes_out;		/**< bytes escaped when sending */
+	uint16_t	framing_errors;		/**< bytes received that can't be right: a low stop bit or a bad escape */
+	uint16_t	overflows;		/**< events lost because the layer above didn't poll in time */
+};
+
+/** copy the hw layer's counters. The interrupts update them, so the copy is taken with interrupts off. */
+extern void hw_get_stats(struct hw_stats *stats);
+
+/** stop recording the hw layer's event trace and return it, in its own format (see T485_TRACE) */
+extern uint8_t *hw_trace_freeze(uint16_t *length);
+extern void hw_trace_resume();			/**< carry on recording once the trace has been sent */
 
 
 /* sblp data structures */
 /** a frame header */
 struct sblp_header {
 	uint8_t		type;
-	uint16_t	length;
+	uint16_t	length;		/**< payload length, not counting the header */
 	uint8_t		dest;
 	uint8_t		src;
 } ;
 
 #define HEADER_LENGTH 5		/**< length of the SBLP header */
+#ifndef SBLP_MAX_PAYLOAD
+#define SBLP_MAX_PAYLOAD 50	/**< largest payload sblp will receive; longer frames are dropped */
+#endif
+
+/* addresses
+ * 0x00-0xDF are unicast addresses, 0xE0-0xFE are multicast groups that
+ * nodes join with sblp_join_group() and 0xFF reaches every node.
+ */
+#define SBLP_GROUP_FIRST	0xE0	/**< first multicast group address */
+#define SBLP_GROUP_LAST		0xFE	/**< last multicast group address */
+#define SBLP_BROADCAST		0xFF	/**< destination address every node listens to */
+
+#define SBLP_IS_GROUP(a)	((a) >= SBLP_GROUP_FIRST && (a) <= SBLP_GROUP_LAST)
+
+/* frame types
+ * 0x00-0x7F are free for applications, 0x80-0xBF belong to the protocols
+ * above sblp and 0xC0-0xFF to sblp itself.
+ */
+#define SBP_TYPE_PUBLISH	0x80	/**< SBP publication: topic, data */
+#define FRAG_TYPE_FRAGMENT	0x81	/**< fragment: message id, offset, total length, data */
+#define BOOT_TYPE_START		0x82	/**< bootloader: image length, image CRC */
+#define BOOT_TYPE_PAGE		0x83	/**< bootloader: flash address, one page of data */
+#define BOOT_TYPE_DONE		0x84	/**< bootloader: image complete, verify it */
+#define BOOT_TYPE_STATUS	0x85	/**< bootloader reply: status, CRC of the flash */
+#define BOOT_TYPE_QUERY		0x86	/**< bootloader: which pages are missing? */
+#define BOOT_TYPE_MISSING	0x87	/**< bootloader reply: bitmap of missing pages */
+#define DISCOVER_TYPE_QUERY	0x88	/**< discovery: lowest id, highest id (4 bytes each) */
+#define DISCOVER_TYPE_REPLY	0x89	/**< discovery reply: our id, then the same id inverted */
+#define DISCOVER_TYPE_MUTE	0x8A	/**< discovery: id of a node found, stop answering */
+#define DISCOVER_TYPE_RESET	0x8B	/**< discovery: new scan, everyone answers again, no payload */
+#define LEASE_TYPE_REQUEST	0x8C	/**< lease: our id, address wanted (0xFF for any) */
+#define LEASE_TYPE_GRANT	0x8D	/**< lease reply: id of the node, address it gets */
+#define LEASE_TYPE_TAKEN	0x8E	/**< lease reply: id of the node, address it can't have */
+#define SBLP_TYPE_PAUSE		0xC0	/**< the source can't take frames right now, no payload */
+#define SBLP_TYPE_RESUME	0xC1	/**< the source takes frames again, no payload */
+#define SBLP_TYPE_STATS_QUERY	0xC2	/**< send us your counters, no payload */
+#define SBLP_TYPE_STATS		0xC3	/**< reply: struct hw_stats, then struct sblp_stats, each field MSB first */
+
+#define SBLP_TYPE_TRACE_QUERY	0xC4	/**< send us your hw event trace, no payload */
+#define SBLP_TYPE_TRACE		0xC5	/**< reply: the trace from hw_trace_freeze() */
+#define SBLP_TYPE_PING		0xC6	/**< sequence number, timestamp (2), sent back as it is */
+#define SBLP_TYPE_ECHO		0xC7	/**< reply: the ping's payload */
+#define SBLP_TYPE_PING_REQUEST	0xC8	/**< ping this node (1 byte) once, for the latency histogram */
+#define SBLP_TYPE_LATENCY_QUERY	0xC9	/**< send us your latency histogram, no payload */
+#define SBLP_TYPE_LATENCY	0xCA	/**< reply: node pinged, pings (2), lost (2), SBLP_LATENCY_BUCKETS counts (2 each) */
+
+#define SBLP_TYPE_INTERNAL	SBLP_TYPE_PAUSE	/**< frames from this type on are never passed up */
+
+#define SBLP_STATS_LENGTH	26	/**< payload length of SBLP_TYPE_STATS */
+#define SBLP_PING_LENGTH	3	/**< payload length of SBLP_TYPE_PING and SBLP_TYPE_ECHO */
+#define SBLP_LATENCY_BUCKETS	16	/**< round trips of 0, 1, 2-3, 4-7 ... ticks, the last bucket open-ended */
+#define SBLP_LATENCY_LENGTH	(5 + 2 * SBLP_LATENCY_BUCKETS)	/**< payload length of SBLP_TYPE_LATENCY */
 
 /* sblp layer */
+/** counters kept by sblp. They wrap around like struct hw_stats. */
+struct sblp_stats {
+	uint16_t	frames_in;		/**< frames received for us */
+	uint16_t	frames_out;		/**< frames sent, our own control frames included */
+	uint16_t	dropped;		/**< syncs and bytes that came when sblp wasn't expecting them */
+	uint16_t	overruns;		/**< frames for us too large for the receive buffer */
+};
+
 /** initialise the link-layer protocol */
 extern void sblp_init();
 
@@ -40,8 +220,157 @@ extern void frame_received(struct sblp_header *header, uint8_t *payload);
 /** the previous frame has been sent */
 extern void frame_sent();
 
-/** send the given sequence as a frame */
+/** send the given sequence as a frame.
+ * Once an address is set, it is used as the source whatever header->src says.
+ * Returns 0 if the link is busy or the destination has paused.
+ */
 extern uint8_t send_frame(struct sblp_header *header, uint8_t *payload);
 
+/** only accept frames for this address and broadcasts from now on, leaving all groups.
+ * Until this is called, every frame is accepted. An address from SBLP_GROUP_FIRST on,
+ * like LEASE_NONE, drops the address: every frame is accepted again.
+ */
+extern void sblp_set_address(uint8_t address);
+
+/** start accepting frames sent to a multicast group */
+extern void sblp_join_group(uint8_t group);
+
+/** stop accepting frames sent to a multicast group */
+extern void sblp_leave_group(uint8_t group);
+
+/** tell the other nodes whether we can take frames. Needs an address set.
+ * While not ready, nodes hold frames for our address; frames for others keep flowing.
+ */
+extern void sblp_set_ready(uint8_t ready);
+
+/** repeat our pause while not ready, and forget pauses others stopped repeating -- call from the main loop every 100 ms.
+ * Without it, a pause lasts until the matching resume arrives.
+ */
+extern void sblp_tick();
+
+/** nonzero when no frame is being sent or received, so the PHY may power down until the next one */
+extern uint8_t sblp_idle();
+
+/** sblp's counters. Nodes also send them, with the hw layer's, in answer to SBLP_TYPE_STATS_QUERY,
+ * unless built with SBLP_NO_STATS.
+ */
+extern const struct sblp_stats *sblp_get_stats();
+
+/** ping a node, putting the round trip into the latency histogram. Needs SBLP_PING.
+ * Pinging a different node than before starts a new histogram.
+ * Returns 0 if the last ping hasn't gone out yet.
+ */
+extern uint8_t sblp_ping(uint8_t dest);
+
+/** a free-running clock for timing pings, in ticks of the application's choosing. Provided by the application when built with SBLP_PING. */
+extern uint16_t sblp_clock();
+
+
+/* protocols above sblp
+ * Each protocol gets to look at received and sent frames through its own
+ * *_frame_received() and *_frame_sent() functions, which return nonzero
+ * when the frame was theirs. The application's frame_received() and
+ * frame_sent() pass frames on to the protocols it uses.
+ *
+ * frame_sent() carries nothing to tell frames apart: a protocol knows a
+ * frame is its own by a flag it sets before send_frame(). It does so
+ * under hw_lock(), so that another protocol's frame finishing in between
+ * doesn't find the flag set and is taken for its.
+ */
+
+/* sbp layer */
+/** initialise the SpaceBus Protocol, publishing from the given address */
+extern void sbp_init(uint8_t address);
+
+/** start receiving publications on a topic */
+extern void sbp_subscribe(uint8_t topic);
+
+/** stop receiving publications on a topic */
+extern void sbp_unsubscribe(uint8_t topic);
+
+/** publish data on a topic right away. Returns 0 if the link is busy. */
+extern uint8_t sbp_publish(uint8_t topic, uint8_t *data, uint8_t length);
+
+/** set the state behind a topic; it is published when it changes */
+extern void sbp_set(uint8_t topic, uint8_t value);
+
+/** send pending state changes -- call from the main loop */
+extern void sbp_poll();
+
+/** offer a received frame to SBP */
+extern uint8_t sbp_frame_received(struct sblp_header *header, uint8_t *payload);
+
+/** offer a sent frame to SBP */
+extern uint8_t sbp_frame_sent();
+
+/** a publication on a subscribed topic has been received */
+extern void topic_received(uint8_t topic, uint8_t src, uint8_t *data, uint8_t length);
+
+/* fragmentation layer */
+#define FRAG_HEADER_LENGTH	5	/**< message id, offset (2), total length (2) */
+#define FRAG_MAX_DATA		(SBLP_MAX_PAYLOAD - FRAG_HEADER_LENGTH)	/**< message bytes per fragment */
+
+/** initialise the fragmentation layer, sending from the given address */
+extern void frag_init(uint8_t address);
+
+/** reassemble incoming messages into buffer, or pass on each fragment as it comes if buffer is NULL */
+extern void frag_receive(uint8_t *buffer, uint16_t size);
+
+/** send a message of any length in fragments. data must stay untouched until frag_busy() returns 0.
+ * Returns 0 if a message is still being sent.
+ */
+extern uint8_t frag_send(uint8_t dest, uint8_t *data, uint16_t length);
+
+/** nonzero while a message is being sent */
+extern uint8_t frag_busy();
+
+/** retry a fragment the link was too busy to take -- call from the main loop */
+extern void frag_poll();
+
+/** offer a received frame to the fragmentation layer */
+extern uint8_t frag_frame_received(struct sblp_header *header, uint8_t *payload);
+
+/** offer a sent frame to the fragmentation layer */
+extern uint8_t frag_frame_sent();
+
+/** part of a message has been received: length bytes at offset, out of total.
+ * When reassembling, this is called once with the whole message at offset 0.
+ * Fragments are passed on in order; the message is complete when offset + length == total.
+ */
+extern void message_received(uint8_t src, uint16_t offset, uint8_t *data, uint16_t length, uint16_t total);
+
+/* discovery */
+/** answer discovery queries with the given unique id, sending from the given address */
+extern void discover_init(uint32_t id, uint8_t address);
+
+/** offer a received frame to discovery */
+extern uint8_t discover_frame_received(struct sblp_header *header, uint8_t *payload);
+
+/** offer a sent frame to discovery */
+extern uint8_t discover_frame_sent();
+
+/* address leases */
+#define LEASE_NONE	0xFF	/**< lease_address() before an address has been granted */
+
+/** start leasing an address for the node with the given unique id.
+ * An address kept in EEPROM from before is used right away.
+ */
+extern void lease_init(uint32_t id);
+
+/** our address, LEASE_NONE if we have none yet */
+extern uint8_t lease_address();
+
+/** send requests and apply address changes -- call from the main loop every 100 ms */
+extern void lease_tick();
+
+/** offer a received frame to the lease protocol */
+extern uint8_t lease_frame_received(struct sblp_header *header, uint8_t *payload);
+
+/** offer a sent frame to the lease protocol */
+extern uint8_t lease_frame_sent();
+
+/** our address has changed, called from lease_tick(). sblp uses it already; groups must be joined again. */
+extern void address_changed(uint8_t address);
+
 #define _INTEROP_H
 #endif
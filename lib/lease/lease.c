@@ -0,0 +1,158 @@
+/** \file lease.c
+ * \brief Implements the node's side of address leases.
+ *
+ * A node without an address broadcasts a LEASE_TYPE_REQUEST with its
+ * unique id (the one discovery uses) until the gateway answers with a
+ * LEASE_TYPE_GRANT. The address is kept in EEPROM, in the byte the
+ * bootloader reads it from.
+ *
+ * After a reset, a node with an address in EEPROM uses it straight away
+ * and sends a single request asking for the same address. If another
+ * node holds it, that node answers with LEASE_TYPE_TAKEN; if the gateway
+ * has given it to someone else, it grants a different one. Either way the
+ * node moves, and with no objection it just carries on.
+ *
+ * Frames come in from the receive interrupt, but writing EEPROM takes
+ * milliseconds, so address changes are only applied from lease_tick().
+ */
+
+#include <avr/eeprom.h>
+
+#include "../interop.h"
+
+#define LEASE_EE_ADDRESS	((uint8_t *) 0)	/**< where the address is kept, shared with the bootloader */
+#define LEASE_RETRY		10		/**< ticks between requests while we have no address */
+
+/** internal data for the protocol */
+static struct {
+	uint32_t	 id;			/**< our unique id */
+	uint8_t		 address;		/**< our address, LEASE_NONE if none */
+	volatile uint8_t next;			/**< address to move to */
+	volatile uint8_t change;		/**< set from the interrupt when next is valid */
+	uint8_t		 request;		/**< a request is waiting to be sent */
+	uint8_t		 ticks;			/**< until the next request */
+
+	volatile uint8_t busy;			/**< a frame is being sent */
+	uint8_t		 xmit[5];		/**< payload of that frame */
+} lease_data;
+
+/** read a 32-bit value, MSB first */
+static uint32_t lease_get(uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/** send a lease frame about the given id and address; returns 0 if the link is busy */
+static uint8_t lease_send(uint8_t type, uint32_t id, uint8_t address) {
+	struct sblp_header header;
+	uint8_t lock, sent;
+
+	if(lease_data.busy)
+		return 0;
+
+	lease_data.xmit[0] = id >> 24;
+	lease_data.xmit[1] = id >> 16;
+	lease_data.xmit[2] = id >> 8;
+	lease_data.xmit[3] = id;
+	lease_data.xmit[4] = address;
+
+	header.type	= type;
+	header.length	= 5;
+	header.dest	= SBLP_BROADCAST;
+	header.src	= lease_data.address;
+
+	/* see "protocols above sblp" in interop.h */
+	lock = hw_lock();
+	lease_data.busy = 1;
+	if(!(sent = send_frame(&header, lease_data.xmit)))
+		lease_data.busy = 0;
+	hw_unlock(lock);
+
+	return sent;
+}
+
+void lease_init(uint32_t id) {
+	lease_data.id = id;
+	lease_data.address = eeprom_read_byte(LEASE_EE_ADDRESS);
+	lease_data.change = 0;
+	lease_data.request = 1;
+	lease_data.ticks = 0;
+	lease_data.busy = 0;
+
+	if(lease_data.address < SBLP_GROUP_FIRST)
+		sblp_set_address(lease_data.address);
+	else
+		lease_data.address = LEASE_NONE;
+}
+
+uint8_t lease_address() {
+	return lease_data.address;
+}
+
+void lease_tick() {
+	if(lease_data.change) {
+		/* cleared first: a later change is picked up on the next tick */
+		lease_data.change = 0;
+		lease_data.address = lease_data.next;
+
+		/* LEASE_NONE drops the address in sblp: it takes every frame again, as before we had one */
+		sblp_set_address(lease_data.address);
+		eeprom_update_byte(LEASE_EE_ADDRESS, lease_data.address);
+		address_changed(lease_data.address);
+
+		if(lease_data.address == LEASE_NONE)
+			lease_data.ticks = 0;
+	}
+
+	if(lease_data.ticks)
+		lease_data.ticks--;
+
+	if(lease_data.address == LEASE_NONE && !lease_data.ticks)
+		lease_data.request = 1;
+
+	if(lease_data.request && lease_send(LEASE_TYPE_REQUEST, lease_data.id, lease_data.address)) {
+		lease_data.request = 0;
+		lease_data.ticks = LEASE_RETRY;
+	}
+}
+
+uint8_t lease_frame_received(struct sblp_header *header, uint8_t *payload) {
+	uint32_t id;
+
+	switch(header->type) {
+		case LEASE_TYPE_REQUEST:
+		case LEASE_TYPE_GRANT:
+		case LEASE_TYPE_TAKEN:
+			if(header->length != 5)
+				break;
+
+			id = lease_get(payload);
+
+			if(header->type == LEASE_TYPE_REQUEST) {
+				/* someone wants our address -- it's taken */
+				if(id != lease_data.id && payload[4] == lease_data.address && lease_data.address != LEASE_NONE)
+					lease_send(LEASE_TYPE_TAKEN, id, payload[4]);
+			} else if(id == lease_data.id) {
+				if(header->type == LEASE_TYPE_GRANT && payload[4] != lease_data.address && payload[4] < SBLP_GROUP_FIRST) {
+					lease_data.next = payload[4];
+					lease_data.change = 1;
+				} else if(header->type == LEASE_TYPE_TAKEN && payload[4] == lease_data.address) {
+					lease_data.next = LEASE_NONE;
+					lease_data.change = 1;
+				}
+			}
+			break;
+
+		default:
+			return 0;
+	}
+
+	return 1;
+}
+
+uint8_t lease_frame_sent() {
+	if(!lease_data.busy)
+		return 0;
+
+	lease_data.busy = 0;
+	return 1;
+}
@@ -0,0 +1,27 @@
+/** \file node.c
+ * \brief A node's hw layer and sblp, built as one translation unit.
+ *
+ * Link this instead of tiny485.o and sblp.o. The calls between the two
+ * layers (see INTEROP_UNITY in interop.h) are then static, so the
+ * compiler resolves them here: the interrupts call straight into sblp,
+ * and whatever it inlines doesn't cost a call with every call-clobbered
+ * register saved. The application's side of interop.h is unchanged.
+ *
+ * The hw layer is picked at compile time:
+ *	(default)		tiny485, for the USI-based ATTinys
+ *	-DNODE_USART485		usart485, for AVRs with a USART
+ *
+ * Both take the same options as they do on their own (T485_DEFER,
+ * U485_BAUD and so on), and so does sblp. Built with INTEROP_INSTANCE,
+ * node.o is one bus' worth of link, under that name.
+ */
+
+#define INTEROP_UNITY
+
+#if defined(NODE_USART485)
+#include "../usart485/usart485.c"
+#else
+#include "../tiny485/tiny485.c"
+#endif
+
+#include "../sblp/sblp.c"
@@ -0,0 +1,155 @@
+/** \file sim.c
+ * \brief Host simulation of two sblp instances in one program.
+ *
+ * sblp.c and host485_phy.c are built twice, as instances a and b (see
+ * INTEROP_INSTANCE in interop.h), and the two are connected through a
+ * socketpair, the way a node on two buses would have one of each per
+ * bus. Frames, escapes, pauses, the counters and dropping an address are
+ * checked in both directions; the exit status is non-zero when something
+ * is off.
+ *
+ * usage: sim
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "interop.h"
+
+#define SIM_A		0x01		/**< address of instance a */
+#define SIM_B		0x02		/**< address of instance b */
+#define SIM_POLLS	10000		/**< polls a frame may take */
+
+INTEROP_DECLARE_HW(a);
+INTEROP_DECLARE_SBLP(a);
+INTEROP_DECLARE_HW(b);
+INTEROP_DECLARE_SBLP(b);
+extern void a_h485_attach(int fd);
+extern void b_h485_attach(int fd);
+
+/** what an instance has received and sent */
+static struct sim_node {
+	struct sblp_header	 header;
+	uint8_t			 payload[SBLP_MAX_PAYLOAD];
+	unsigned int		 received;
+	unsigned int		 sent;
+} sim_a, sim_b;
+
+static unsigned int sim_errors;
+
+static void sim_store(struct sim_node *node, struct sblp_header *header, uint8_t *payload) {
+	node->header = *header;
+	memcpy(node->payload, payload, header->length);
+	node->received++;
+}
+
+void a_frame_received(struct sblp_header *header, uint8_t *payload) {
+	sim_store(&sim_a, header, payload);
+}
+
+void a_frame_sent() {
+	sim_a.sent++;
+}
+
+void b_frame_received(struct sblp_header *header, uint8_t *payload) {
+	sim_store(&sim_b, header, payload);
+}
+
+void b_frame_sent() {
+	sim_b.sent++;
+}
+
+/** poll both instances until neither has anything left to do */
+static void sim_run() {
+	unsigned int i;
+
+	for(i=0; i<SIM_POLLS; i++)
+		if(!a_hw_poll() && !b_hw_poll() && a_sblp_idle() && b_sblp_idle())
+			return;
+}
+
+static void sim_check(const char *what, int ok) {
+	if(!ok) {
+		printf("FAIL %s\n", what);
+		sim_errors++;
+	}
+}
+
+/** send a frame of length bytes from one instance and check it arrives whole at the other */
+static void sim_frame(const char *what, uint8_t (*send)(struct sblp_header *, uint8_t *),
+		struct sim_node *to, uint8_t src, uint8_t dest, uint8_t *payload, uint16_t length) {
+	struct sblp_header header = { 0x10, length, dest, src };
+	unsigned int received = to->received;
+
+	sim_check(what, send(&header, payload));
+	sim_run();
+	sim_check(what, to->received == received + 1 && to->header.src == src && to->header.dest == dest &&
+		to->header.length == length && !memcmp(to->payload, payload, length));
+}
+
+int main() {
+	int sv[2];
+	uint8_t plain[] = "hello";
+	uint8_t special[] = { 0xFF, 0x55, 0x00, 0x01, 0x55, 0xFF, 0x42 };
+	struct sblp_header header = { 0x10, 0, SIM_B, SIM_A };
+	struct hw_stats hw;
+	uint16_t frames;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	a_h485_attach(sv[0]);
+	b_h485_attach(sv[1]);
+	a_hw_init();
+	b_hw_init();
+	a_sblp_init();
+	b_sblp_init();
+	a_sblp_set_address(SIM_A);
+	b_sblp_set_address(SIM_B);
+
+	sim_frame("a to b", a_send_frame, &sim_b, SIM_A, SIM_B, plain, sizeof(plain));
+	sim_frame("b to a", b_send_frame, &sim_a, SIM_B, SIM_A, plain, sizeof(plain));
+	sim_frame("escapes", a_send_frame, &sim_b, SIM_A, SIM_B, special, sizeof(special));
+	sim_check("frame_sent", sim_a.sent == 2 && sim_b.sent == 1);
+
+	/* b pauses: a holds frames for b until it's ready again */
+	b_sblp_set_ready(0);
+	sim_run();
+	sim_check("pause", !a_send_frame(&header, plain));
+	b_sblp_set_ready(1);
+	sim_run();
+	sim_frame("resume", a_send_frame, &sim_b, SIM_A, SIM_B, plain, sizeof(plain));
+
+	/* each instance counts its own bus */
+	a_hw_get_stats(&hw);
+	sim_check("escapes out", hw.escapes_out == 4);
+	b_hw_get_stats(&hw);
+	sim_check("escapes in", hw.escapes_in == 4);
+	sim_check("sblp stats", a_sblp_get_stats()->frames_out == b_sblp_get_stats()->frames_in);
+
+	/* a drops its address (as lease does after a TAKEN): it takes every frame again, answers no broadcast query,
+	 * and a pause it sends from 0xFF stops nobody's broadcasts */
+	a_sblp_set_address(SBLP_BROADCAST);
+	sim_frame("unaddressed", b_send_frame, &sim_a, SIM_B, 0x33, plain, sizeof(plain));
+	header.type = SBLP_TYPE_STATS_QUERY;
+	header.dest = SBLP_BROADCAST;
+	header.src = SIM_B;
+	frames = a_sblp_get_stats()->frames_out;
+	sim_check("broadcast query", b_send_frame(&header, NULL));
+	sim_run();
+	sim_check("broadcast query", a_sblp_get_stats()->frames_out == frames);
+	header.type = SBLP_TYPE_PAUSE;
+	header.src = SBLP_BROADCAST;
+	sim_check("pause from 0xFF", a_send_frame(&header, NULL));
+	sim_run();
+	sim_frame("pause from 0xFF", b_send_frame, &sim_a, SIM_B, SBLP_BROADCAST, plain, sizeof(plain));
+
+	if(!sim_errors)
+		printf("OK\n");
+	return sim_errors != 0;
+}
@@ -4,18 +4,72 @@
  * This is, once again, implemented as a state machine. The protocol
  * starts by using the HW layer to fish for its first valid sync
  * sequence, then receives the message indicated by it and starts idling.
+ * When the HW layer reports a framing error in a frame, the frame is
+ * dropped and it goes back to fishing: nothing after it can be trusted
+ * until the next sync, and sending into someone else's frame would only
+ * make things worse.
+ *
+ * Every node answers SBLP_TYPE_STATS_QUERY for its own address with the
+ * counters of both layers, sent like a pause/resume once the link is
+ * free. Queries to groups or everyone go unanswered, as the replies would
+ * collide. Build with SBLP_NO_STATS where flash is short.
+ *
+ * Built with SBLP_TRACE, SBLP_TYPE_TRACE_QUERY is answered the same way
+ * with the hw layer's event trace, which stops recording until it's out.
+ *
+ * Pauses and resumes are broadcasts nobody acknowledges, so either can
+ * be lost. A node that isn't ready repeats its pause every
+ * SBLP_PAUSE_REFRESH sblp_tick()s, and senders forget a pause once a
+ * whole SBLP_PAUSE_EXPIRE ticks pass without a repeat: a lost resume
+ * holds frames up for a few seconds rather than for good.
+ *
+ * Nodes echo SBLP_TYPE_PING straight back as SBLP_TYPE_ECHO. Built with
+ * SBLP_PING, a node can also send pings itself, when the application
+ * calls sblp_ping() or a host asks with SBLP_TYPE_PING_REQUEST, and keeps
+ * a histogram of the round trips to the last node it pinged, timed with
+ * the application's sblp_clock(). Only one ping is out at a time; one
+ * still unanswered when the next goes out counts as lost.
  * 
  * \todo many things, needs more implementation
  */
 
-#include <avr/io.h>
 #include "../interop.h"
 
-#define SBLP_BUFSIZE	50
+#define SBLP_BUFSIZE	SBLP_MAX_PAYLOAD
+
+/* flags */
+#define SBLP_FLAG_ADDRESS	((uint8_t) 0x01)	/**< an address has been set */
+#define SBLP_FLAG_NOT_READY	((uint8_t) 0x02)	/**< we've asked the others to hold their frames */
+#define SBLP_FLAG_PENDING	((uint8_t) 0x04)	/**< a pause/resume frame is waiting for the link */
+#define SBLP_FLAG_CONTROL	((uint8_t) 0x08)	/**< the frame being sent is one of our own control frames */
+
+/* other control frames waiting for the link */
+#define SBLP_QUEUE_ECHO		((uint8_t) 0x01)
+#define SBLP_QUEUE_STATS	((uint8_t) 0x02)
+#define SBLP_QUEUE_TRACE	((uint8_t) 0x04)
+#define SBLP_QUEUE_LATENCY	((uint8_t) 0x08)
+#define SBLP_QUEUE_PING		((uint8_t) 0x10)
+
+/* pause timing, in sblp_tick()s of 100 ms */
+#ifndef SBLP_PAUSE_REFRESH
+#define SBLP_PAUSE_REFRESH	10	/**< how often a node that isn't ready repeats its pause */
+#endif
+#define SBLP_PAUSE_EXPIRE	(3 * SBLP_PAUSE_REFRESH)	/**< how long senders keep a pause that isn't repeated: two repeats may go missing */
+
+#if defined(SBLP_PING) && defined(SBLP_NO_STATS)
+#error "SBLP_PING needs the replies SBLP_NO_STATS leaves out"
+#endif
+
+#ifdef SBLP_PING
+#define SBLP_REPLY_SIZE		SBLP_LATENCY_LENGTH
+#else
+#define SBLP_REPLY_SIZE		SBLP_STATS_LENGTH
+#endif
+
 /** internal data for the protocol stack */
-struct {
+static struct {
 	enum {
-		SBLP_STATE_INIT,		/**< the device is initialising and waiting to receive its first valid packet */
+		SBLP_STATE_INIT,		/**< waiting for a sync before doing anything else, like after a framing error */
 		SBLP_STATE_IDLE,		/**< the device is idling - data can be sent at this stage */
 		SBLP_STATE_XMIT_HEADER,		/**< a frame header is being transmitted */
 		SBLP_STATE_XMIT_PAYLOAD,	/**< a frame payload is being transmitted */
@@ -25,14 +79,427 @@ struct {
 	} state;
 
 	struct sblp_header header;
+
+	uint8_t		 accept[32];		/**< destination filter: one bit per address */
+	uint8_t		 paused[32];		/**< destinations that can't take frames: one bit per address */
+	uint8_t		 repeated[32];		/**< of which paused again since the last expiry */
+	uint8_t		 refresh;		/**< ticks since we last repeated our pause */
+	uint8_t		 expire;		/**< ticks since pauses were last expired */
+	uint8_t		 address;
+	uint8_t		 flags;
+	uint8_t		 queued;		/**< SBLP_QUEUE_* */
 	
 	uint8_t		 recv_payload[SBLP_BUFSIZE];
 	uint8_t		*xmit_payload;
 	uint16_t	 index;
+
+	struct sblp_stats stats;
+#ifndef SBLP_NO_STATS
+	uint8_t		 stats_dest;		/**< who asked for our counters */
+	uint8_t		 echo_dest;		/**< who pinged us */
+	uint8_t		 echo[SBLP_PING_LENGTH];	/**< with this */
+	uint8_t		 reply[SBLP_REPLY_SIZE];	/**< payload of a stats or latency reply */
+#endif
+#ifdef SBLP_TRACE
+	uint8_t		 trace_dest;		/**< who asked for our trace */
+#endif
+#ifdef SBLP_PING
+	uint8_t		 ping_dest;		/**< the node we ping, SBLP_BROADCAST if none yet */
+	uint8_t		 ping_out;		/**< a ping is waiting for its echo */
+	uint8_t		 ping[SBLP_PING_LENGTH];	/**< that ping */
+	uint8_t		 latency_dest;		/**< who asked for the histogram */
+	uint16_t	 pings;			/**< pings sent to ping_dest */
+	uint16_t	 lost;			/**< of which no echo came */
+	uint16_t	 latency[SBLP_LATENCY_BUCKETS];	/**< round trips, see SBLP_TYPE_LATENCY */
+#endif
 } sblp_data;
 
 void sblp_init() {
+	uint8_t i;
+
 	sblp_data.state = SBLP_STATE_IDLE;
+	sblp_data.flags = 0;
+	sblp_data.queued = 0;
+	sblp_data.refresh = 0;
+	sblp_data.expire = 0;
+#ifdef SBLP_PING
+	sblp_data.ping_dest = SBLP_BROADCAST;
+#endif
+
+	/* no address yet -- accept everything */
+	for(i=0; i<32; i++) {
+		sblp_data.accept[i] = 0xFF;
+		sblp_data.paused[i] = 0;
+		sblp_data.repeated[i] = 0;
+	}
+}
+
+void sblp_set_address(uint8_t address) {
+	uint8_t i, lock;
+
+	if(address >= SBLP_GROUP_FIRST) {
+		/* no address after all -- take every frame again, like after sblp_init(). Only an address can pause. */
+		lock = hw_lock();
+		sblp_data.flags &= ~(SBLP_FLAG_ADDRESS | SBLP_FLAG_NOT_READY);
+		hw_unlock(lock);
+		for(i=0; i<32; i++)
+			sblp_data.accept[i] = 0xFF;
+		return;
+	}
+
+	for(i=0; i<32; i++)
+		sblp_data.accept[i] = 0;
+
+	/* the hw layer's calls change flags as well */
+	lock = hw_lock();
+	sblp_data.address = address;
+	sblp_data.flags |= SBLP_FLAG_ADDRESS;
+	hw_unlock(lock);
+
+	sblp_data.accept[address >> 3] |= (1 << (address & 7));
+	sblp_data.accept[SBLP_BROADCAST >> 3] |= (1 << (SBLP_BROADCAST & 7));
+}
+
+void sblp_join_group(uint8_t group) {
+	if(SBLP_IS_GROUP(group))
+		sblp_data.accept[group >> 3] |= (1 << (group & 7));
+}
+
+void sblp_leave_group(uint8_t group) {
+	if(SBLP_IS_GROUP(group))
+		sblp_data.accept[group >> 3] &= ~(1 << (group & 7));
+}
+
+/** start sending a frame -- the link must be idle */
+static void sblp_xmit(struct sblp_header *header, uint8_t *payload) {
+	sblp_data.header.type	= header->type;
+	sblp_data.header.length = header->length;
+	sblp_data.header.src	= (sblp_data.flags & SBLP_FLAG_ADDRESS) ? sblp_data.address : header->src;
+	sblp_data.header.dest	= header->dest;
+
+	sblp_data.xmit_payload = payload;
+	sblp_data.index = 1;
+
+	begin_transmission();
+	sblp_data.state = SBLP_STATE_XMIT_HEADER;
+
+	send_sync();
+}
+
+#ifndef SBLP_NO_STATS
+/** append a counter to the stats reply, MSB first */
+static uint8_t *sblp_put(uint8_t *p, uint32_t value, uint8_t bytes) {
+	while(bytes--)
+		*p++ = value >> (8 * bytes);
+
+	return p;
+}
+
+/** take a snapshot of the counters for the stats reply */
+static void sblp_fill_stats() {
+	struct hw_stats hw;
+	uint8_t *p = sblp_data.reply;
+
+	hw_get_stats(&hw);	/* all at once: the hw layer's interrupts may be counting while we copy */
+
+	p = sblp_put(p, hw.bytes_in, 4);
+	p = sblp_put(p, hw.bytes_out, 4);
+	p = sblp_put(p, hw.syncs, 2);
+	p = sblp_put(p, hw.escapes_in, 2);
+	p = sblp_put(p, hw.escapes_out, 2);
+	p = sblp_put(p, hw.framing_errors, 2);
+	p = sblp_put(p, hw.overflows, 2);
+
+	p = sblp_put(p, sblp_data.stats.frames_in, 2);
+	p = sblp_put(p, sblp_data.stats.frames_out, 2);
+	p = sblp_put(p, sblp_data.stats.dropped, 2);
+	sblp_put(p, sblp_data.stats.overruns, 2);
+}
+#endif
+
+#ifdef SBLP_PING
+/** take a snapshot of the histogram for the latency reply */
+static void sblp_fill_latency() {
+	uint8_t *p = sblp_data.reply, i;
+
+	*p++ = sblp_data.ping_dest;
+	p = sblp_put(p, sblp_data.pings, 2);
+	p = sblp_put(p, sblp_data.lost, 2);
+
+	for(i=0; i<SBLP_LATENCY_BUCKETS; i++)
+		p = sblp_put(p, sblp_data.latency[i], 2);
+}
+
+/** count a round trip in its bucket: 0 for none, n for 2^(n-1) up to 2^n - 1 ticks, the last one open-ended */
+static void sblp_count_latency(uint16_t ticks) {
+	uint8_t bucket = 0;
+
+	while(ticks && bucket < SBLP_LATENCY_BUCKETS - 1) {
+		ticks >>= 1;
+		bucket++;
+	}
+
+	sblp_data.latency[bucket]++;
+}
+
+/** stamp a new ping for ping_dest */
+static void sblp_fill_ping() {
+	uint16_t now = sblp_clock();
+
+	if(sblp_data.ping_out)
+		sblp_data.lost++;
+
+	sblp_data.ping[0]++;		/* sequence number */
+	sblp_data.ping[1] = now >> 8;
+	sblp_data.ping[2] = now & 0xFF;
+
+	sblp_data.ping_out = 1;
+	sblp_data.pings++;
+}
+#endif
+
+/** send a waiting control frame if the link is free. Echoes go first, to keep round trips honest. */
+static void sblp_flush() {
+	struct sblp_header header;
+	uint8_t *payload = 0;
+
+	if(sblp_data.state != SBLP_STATE_IDLE)
+		return;
+
+	if(sblp_data.flags & SBLP_FLAG_PENDING) {
+		header.type	= (sblp_data.flags & SBLP_FLAG_NOT_READY) ? SBLP_TYPE_PAUSE : SBLP_TYPE_RESUME;
+		header.length	= 0;
+		header.dest	= SBLP_BROADCAST;
+
+		sblp_data.flags &= ~SBLP_FLAG_PENDING;
+#ifndef SBLP_NO_STATS
+	} else if(sblp_data.queued & SBLP_QUEUE_ECHO) {
+		payload = sblp_data.echo;
+
+		header.type	= SBLP_TYPE_ECHO;
+		header.length	= SBLP_PING_LENGTH;
+		header.dest	= sblp_data.echo_dest;
+
+		sblp_data.queued &= ~SBLP_QUEUE_ECHO;
+	} else if(sblp_data.queued & SBLP_QUEUE_STATS) {
+		sblp_fill_stats();
+		payload = sblp_data.reply;
+
+		header.type	= SBLP_TYPE_STATS;
+		header.length	= SBLP_STATS_LENGTH;
+		header.dest	= sblp_data.stats_dest;
+
+		sblp_data.queued &= ~SBLP_QUEUE_STATS;
+#endif
+#ifdef SBLP_TRACE
+	} else if(sblp_data.queued & SBLP_QUEUE_TRACE) {
+		payload = hw_trace_freeze(&header.length);
+
+		header.type	= SBLP_TYPE_TRACE;
+		header.dest	= sblp_data.trace_dest;
+
+		sblp_data.queued &= ~SBLP_QUEUE_TRACE;
+#endif
+#ifdef SBLP_PING
+	} else if(sblp_data.queued & SBLP_QUEUE_LATENCY) {
+		sblp_fill_latency();
+		payload = sblp_data.reply;
+
+		header.type	= SBLP_TYPE_LATENCY;
+		header.length	= SBLP_LATENCY_LENGTH;
+		header.dest	= sblp_data.latency_dest;
+
+		sblp_data.queued &= ~SBLP_QUEUE_LATENCY;
+	} else if(sblp_data.queued & SBLP_QUEUE_PING) {
+		sblp_fill_ping();
+		payload = sblp_data.ping;
+
+		header.type	= SBLP_TYPE_PING;
+		header.length	= SBLP_PING_LENGTH;
+		header.dest	= sblp_data.ping_dest;
+
+		sblp_data.queued &= ~SBLP_QUEUE_PING;
+#endif
+	} else {
+		return;
+	}
+
+	header.src	= sblp_data.address;
+
+	sblp_data.flags |= SBLP_FLAG_CONTROL;
+	sblp_xmit(&header, payload);
+}
+
+/* The functions below run from the main loop, but change flags, queued and
+ * paused[] the hw layer's calls change as well, and may start sending
+ * just as a frame starts coming in: they do it under hw_lock().
+ */
+void sblp_set_ready(uint8_t ready) {
+	uint8_t lock = hw_lock();
+
+	if(sblp_data.flags & SBLP_FLAG_ADDRESS) {
+		if(ready)
+			sblp_data.flags &= ~SBLP_FLAG_NOT_READY;
+		else
+			sblp_data.flags |= SBLP_FLAG_NOT_READY;
+
+		sblp_data.refresh = 0;
+		sblp_data.flags |= SBLP_FLAG_PENDING;
+		sblp_flush();
+	}
+
+	hw_unlock(lock);
+}
+
+void sblp_tick() {
+	uint8_t i, lock;
+
+	/* say it again, for whoever missed it */
+	lock = hw_lock();
+	if((sblp_data.flags & SBLP_FLAG_NOT_READY) && ++sblp_data.refresh >= SBLP_PAUSE_REFRESH) {
+		sblp_data.refresh = 0;
+		sblp_data.flags |= SBLP_FLAG_PENDING;
+		sblp_flush();
+	}
+	hw_unlock(lock);
+
+	/* forget the pauses nobody repeated: their resume got lost, or the node is gone.
+	 * One byte at a time, so a start bit isn't kept waiting for all of them. */
+	if(++sblp_data.expire >= SBLP_PAUSE_EXPIRE) {
+		sblp_data.expire = 0;
+		for(i=0; i<32; i++) {
+			lock = hw_lock();
+			sblp_data.paused[i] &= sblp_data.repeated[i];
+			sblp_data.repeated[i] = 0;
+			hw_unlock(lock);
+		}
+	}
+}
+
+uint8_t sblp_idle() {
+	/* a control frame that still has to go out keeps us awake as well */
+	return (sblp_data.state == SBLP_STATE_IDLE || sblp_data.state == SBLP_STATE_INIT) &&
+	       !(sblp_data.flags & SBLP_FLAG_PENDING) && !sblp_data.queued;
+}
+
+const struct sblp_stats *sblp_get_stats() {
+	return &sblp_data.stats;
+}
+
+#ifdef SBLP_PING
+uint8_t sblp_ping(uint8_t dest) {
+	uint8_t i, lock;
+
+	if(dest >= SBLP_GROUP_FIRST)
+		return 0;
+
+	lock = hw_lock();
+	if(sblp_data.queued & SBLP_QUEUE_PING) {
+		hw_unlock(lock);
+		return 0;
+	}
+
+	/* the histogram is about one node */
+	if(dest != sblp_data.ping_dest) {
+		sblp_data.ping_dest = dest;
+		sblp_data.ping_out = 0;
+		sblp_data.pings = sblp_data.lost = 0;
+		for(i=0; i<SBLP_LATENCY_BUCKETS; i++)
+			sblp_data.latency[i] = 0;
+	}
+
+	sblp_data.queued |= SBLP_QUEUE_PING;
+	sblp_flush();
+	hw_unlock(lock);
+	return 1;
+}
+#endif
+
+#if !defined(SBLP_NO_STATS) || defined(SBLP_TRACE)
+/** whether the frame just received was sent to us alone.
+ * Questions asked of everyone go unanswered: the replies would collide.
+ */
+static uint8_t sblp_mine() {
+	return (sblp_data.flags & SBLP_FLAG_ADDRESS) && sblp_data.header.dest == sblp_data.address;
+}
+#endif
+
+/** deal with a frame for sblp itself; returns 0 if it's for the layer above */
+static uint8_t sblp_internal() {
+	struct sblp_header *header = &sblp_data.header;
+	uint8_t src = header->src;
+
+	switch(header->type) {
+		case SBLP_TYPE_PAUSE:
+			/* only a node can pause; one from a group or everyone would stop every broadcast */
+			if(src >= SBLP_GROUP_FIRST)
+				break;
+
+			sblp_data.paused[src >> 3] |= (1 << (src & 7));
+			sblp_data.repeated[src >> 3] |= (1 << (src & 7));
+			break;
+
+		case SBLP_TYPE_RESUME:
+			sblp_data.paused[src >> 3] &= ~(1 << (src & 7));
+			sblp_data.repeated[src >> 3] &= ~(1 << (src & 7));
+			break;
+
+#ifndef SBLP_NO_STATS
+		case SBLP_TYPE_STATS_QUERY:
+			if(sblp_mine()) {
+				sblp_data.stats_dest = src;
+				sblp_data.queued |= SBLP_QUEUE_STATS;
+			}
+			break;
+
+		case SBLP_TYPE_PING:
+			if(sblp_mine() && header->length == SBLP_PING_LENGTH) {
+				sblp_data.echo[0] = sblp_data.recv_payload[0];
+				sblp_data.echo[1] = sblp_data.recv_payload[1];
+				sblp_data.echo[2] = sblp_data.recv_payload[2];
+				sblp_data.echo_dest = src;
+				sblp_data.queued |= SBLP_QUEUE_ECHO;
+			}
+			break;
+#endif
+
+#ifdef SBLP_TRACE
+		case SBLP_TYPE_TRACE_QUERY:
+			if(sblp_mine()) {
+				sblp_data.trace_dest = src;
+				sblp_data.queued |= SBLP_QUEUE_TRACE;
+			}
+			break;
+#endif
+
+#ifdef SBLP_PING
+		case SBLP_TYPE_ECHO:
+			if(sblp_data.ping_out && src == sblp_data.ping_dest && header->length == SBLP_PING_LENGTH &&
+			   sblp_data.recv_payload[0] == sblp_data.ping[0]) {
+				sblp_data.ping_out = 0;
+				sblp_count_latency(sblp_clock() - ((sblp_data.recv_payload[1] << 8) | sblp_data.recv_payload[2]));
+			}
+			break;
+
+		case SBLP_TYPE_PING_REQUEST:
+			if(sblp_mine() && header->length == 1)
+				sblp_ping(sblp_data.recv_payload[0]);
+			break;
+
+		case SBLP_TYPE_LATENCY_QUERY:
+			if(sblp_mine()) {
+				sblp_data.latency_dest = src;
+				sblp_data.queued |= SBLP_QUEUE_LATENCY;
+			}
+			break;
+#endif
+
+		default:
+			/* the rest of sblp's range is nobody else's business either */
+			return header->type >= SBLP_TYPE_INTERNAL;
+	}
+
+	return 1;
 }
 
 /* functions called by layer below */
@@ -41,15 +508,51 @@ void sync_received() {
 		case SBLP_STATE_INIT:
 			/* sync received -- we are in business! */
 			sblp_data.state = SBLP_STATE_RECV_HEADER;
+			sblp_data.index = 1;	/* the sync is the first header byte */
 			break;
 		
 		case SBLP_STATE_IDLE:
 			/* sync indicates start of a new message */
 			sblp_data.state = SBLP_STATE_RECV_HEADER;
+			sblp_data.index = 1;
+			break;
+
+		case SBLP_STATE_RECV_HEADER:
+		case SBLP_STATE_RECV_PAYLOAD:
+		case SBLP_STATE_IGNORE:
+			/* syncs are escaped inside frames, so the frame was cut short (by a break, say) and a new one
+			 * starts. Preamble syncs come before any of the header and lose nothing.
+			 */
+			if(sblp_data.state != SBLP_STATE_RECV_HEADER || sblp_data.index > 1)
+				sblp_data.stats.dropped++;
+
+			sblp_data.state = SBLP_STATE_RECV_HEADER;
+			sblp_data.index = 1;
 			break;
-			
+
 		default:
 			/* shouldn't happen -- ignore */
+			sblp_data.stats.dropped++;
+			break;
+	}
+}
+
+void framing_error() {
+	switch(sblp_data.state) {
+		case SBLP_STATE_RECV_HEADER:
+		case SBLP_STATE_RECV_PAYLOAD:
+			/* a byte of the frame is missing or wrong, so the rest of it means nothing */
+			if(sblp_data.state != SBLP_STATE_RECV_HEADER || sblp_data.index > 1)
+				sblp_data.stats.dropped++;
+			/* fallthrough */
+
+		case SBLP_STATE_IGNORE:
+			/* the byte count can't be trusted either -- hunt for the next sync before sending */
+			sblp_data.state = SBLP_STATE_INIT;
+			break;
+
+		default:
+			/* between frames we're waiting for a sync anyway, and we don't hear ourselves */
 			break;
 	}
 }
@@ -60,6 +563,7 @@ void byte_received(uint8_t b) {
 			switch(sblp_data.index) {
 				case 0:		/* sync */
 					/* shouldn't occur here -- ignore */
+					sblp_data.stats.dropped++;
 					sblp_data.index++;
 					break;
 					
@@ -81,35 +585,63 @@ void byte_received(uint8_t b) {
 				case 4:		/* destination address */
 					sblp_data.header.dest = b;
 					sblp_data.index++;
+
+					/* not for us -- skip the source address and payload */
+					if(!(sblp_data.accept[b >> 3] & (1 << (b & 7)))) {
+						sblp_data.index = sblp_data.header.length + 1;
+						sblp_data.state = SBLP_STATE_IGNORE;
+					}
 					break;
 
 				case 5:		/* source address */
 					sblp_data.header.src = b;
 
 					/* end of header -- move to payload */
-					sblp_data.state = SBLP_STATE_RECV_PAYLOAD;
 					sblp_data.index = 0;
+					if(sblp_data.header.length == 0) {
+						sblp_data.state = SBLP_STATE_IDLE;
+						sblp_data.stats.frames_in++;
+
+						/* flow control and diagnostics are handled here, the rest goes up */
+						if(!sblp_internal())
+							frame_received(&sblp_data.header, sblp_data.recv_payload);
+
+						sblp_flush();
+					} else if(sblp_data.header.length > SBLP_BUFSIZE) {
+						/* doesn't fit -- skip it */
+						sblp_data.stats.overruns++;
+						sblp_data.index = sblp_data.header.length;
+						sblp_data.state = SBLP_STATE_IGNORE;
+					} else {
+						sblp_data.state = SBLP_STATE_RECV_PAYLOAD;
+					}
 					break;
 			}
 			break;
 
 		case SBLP_STATE_RECV_PAYLOAD:
 			sblp_data.recv_payload[sblp_data.index++] = b;
-			if(sblp_data.index > sblp_data.header.length) {
+			if(sblp_data.index == sblp_data.header.length) {
 				sblp_data.state = SBLP_STATE_IDLE;
+				sblp_data.stats.frames_in++;
 
-				frame_received(&sblp_data.header, sblp_data.recv_payload);
+				if(!sblp_internal())
+					frame_received(&sblp_data.header, sblp_data.recv_payload);
+				sblp_flush();
 			}
 			break;
 
 		case SBLP_STATE_IGNORE:
 			/* count down the bytes until we're done */
-			if(++sblp_data.index > sblp_data.header.length)
+			if(--sblp_data.index == 0) {
 				sblp_data.state = SBLP_STATE_IDLE;
+				sblp_flush();
+			}
 			break;
 
 		default:
 			/* shouldn't happen -- ignore */
+			sblp_data.stats.dropped++;
 			break;
 	}
 }
@@ -154,17 +686,32 @@ void byte_sent() {
 			break;			
 
 		case SBLP_STATE_XMIT_PAYLOAD:
-			send_byte(sblp_data.xmit_payload[sblp_data.index++]);
-			if(sblp_data.index > sblp_data.header.length) {
-				frame_sent();
+			if(sblp_data.index < sblp_data.header.length) {
+				send_byte(sblp_data.xmit_payload[sblp_data.index++]);
+			} else {
+				/* last byte is out -- release the bus */
+				end_transmission();
 				sblp_data.state = SBLP_STATE_IDLE;
-			}
+				sblp_data.stats.frames_out++;
+
+				/* our own control frames are nobody else's business */
+				if(sblp_data.flags & SBLP_FLAG_CONTROL) {
+					sblp_data.flags &= ~SBLP_FLAG_CONTROL;
+#ifdef SBLP_TRACE
+					if(sblp_data.header.type == SBLP_TYPE_TRACE)
+						hw_trace_resume();
+#endif
+				} else {
+					frame_sent();
+				}
 
-			end_transmission();
+				sblp_flush();
+			}
 			break;
 
 		default:
 			/* shouldn't happen -- ignore */
+			sblp_data.stats.dropped++;
 			break;
 	}
 }
@@ -172,23 +719,18 @@ void byte_sent() {
 
 /* functions called by layer above */
 uint8_t send_frame(struct sblp_header *header, uint8_t *payload) {
-	if(sblp_data.state == SBLP_STATE_IDLE) {
-		/* fill in header and send frame */
-		sblp_data.header.type	= header->type;
-		sblp_data.header.length = header->length;
-		sblp_data.header.src	= header->src;
-		sblp_data.header.dest	= header->dest;
-
-		sblp_data.xmit_payload = payload;
-		sblp_data.index = 1;
-
-		begin_transmission();
-		sblp_data.state = SBLP_STATE_XMIT_HEADER;
+	/* a sync may come in between looking at the state and sending */
+	uint8_t sent = 0, lock = hw_lock();
 
-		send_sync();
-		return 1;
+	if(sblp_data.paused[header->dest >> 3] & (1 << (header->dest & 7))) {
+		/* destination asked us to hold off -- others may go ahead */
+	} else if(sblp_data.state == SBLP_STATE_IDLE) {
+		sblp_xmit(header, payload);
+		sent = 1;
 	} else {
 		/* can't send frame when receiving, syncing etc. */
-		return 0;
 	}
+
+	hw_unlock(lock);
+	return sent;
 }
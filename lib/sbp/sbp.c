@@ -0,0 +1,146 @@
+/** \file sbp.c
+ * \brief Implements the SpaceBus Protocol: publish/subscribe on top of SBLP.
+ *
+ * Nodes publish to numeric topics (0-255). A publication is a single
+ * broadcast frame holding the topic and its data; every node that
+ * subscribed to the topic hands it to the application, the others drop it
+ * after looking it up in a 32-byte bitmap.
+ *
+ * Rather than having a controller poll every sensor, nodes keep the state
+ * behind their topics here with sbp_set() and only put it on the bus when
+ * it changes.
+ */
+
+#include "../interop.h"
+
+#define SBP_MAX_STATES	8	/**< number of topics whose state can be kept */
+#define SBP_MAX_DATA	8	/**< largest publication, not counting the topic */
+
+/* flags for the state table */
+#define SBP_FLAG_USED	((uint8_t) 0x01)	/**< entry holds a topic */
+#define SBP_FLAG_DIRTY	((uint8_t) 0x02)	/**< state changed and hasn't been published yet */
+
+/** internal data for the protocol */
+static struct {
+	uint8_t		address;		/**< our address, used as source */
+	uint8_t		subscribed[32];		/**< one bit per topic */
+
+	struct {
+		uint8_t	topic;
+		uint8_t	value;
+		uint8_t	flags;
+	} states[SBP_MAX_STATES];
+
+	volatile uint8_t busy;			/**< a publication is being sent */
+	uint8_t		xmit[1 + SBP_MAX_DATA];	/**< payload of that publication */
+} sbp_data;
+
+void sbp_init(uint8_t address) {
+	uint8_t i;
+
+	sbp_data.address = address;
+	sbp_data.busy = 0;
+
+	for(i=0; i<32; i++)
+		sbp_data.subscribed[i] = 0;
+
+	for(i=0; i<SBP_MAX_STATES; i++)
+		sbp_data.states[i].flags = 0;
+}
+
+void sbp_subscribe(uint8_t topic) {
+	sbp_data.subscribed[topic >> 3] |= (1 << (topic & 7));
+}
+
+void sbp_unsubscribe(uint8_t topic) {
+	sbp_data.subscribed[topic >> 3] &= ~(1 << (topic & 7));
+}
+
+uint8_t sbp_publish(uint8_t topic, uint8_t *data, uint8_t length) {
+	struct sblp_header header;
+	uint8_t i, lock, sent;
+
+	if(sbp_data.busy || length > SBP_MAX_DATA)
+		return 0;
+
+	sbp_data.xmit[0] = topic;
+	for(i=0; i<length; i++)
+		sbp_data.xmit[i+1] = data[i];
+
+	header.type	= SBP_TYPE_PUBLISH;
+	header.length	= length + 1;
+	header.dest	= SBLP_BROADCAST;
+	header.src	= sbp_data.address;
+
+	/* busy claims the next frame_sent(); the one of a frame another layer
+	 * still has going out mustn't come in before we know whether it's ours
+	 */
+	lock = hw_lock();
+	sbp_data.busy = 1;
+	if(!(sent = send_frame(&header, sbp_data.xmit)))
+		sbp_data.busy = 0;	/* link busy -- try again later */
+	hw_unlock(lock);
+
+	return sent;
+}
+
+void sbp_set(uint8_t topic, uint8_t value) {
+	uint8_t i, slot = SBP_MAX_STATES;
+
+	for(i=0; i<SBP_MAX_STATES; i++) {
+		if(!(sbp_data.states[i].flags & SBP_FLAG_USED)) {
+			if(slot == SBP_MAX_STATES)
+				slot = i;
+			continue;
+		}
+
+		if(sbp_data.states[i].topic == topic) {
+			if(sbp_data.states[i].value != value) {
+				sbp_data.states[i].value = value;
+				sbp_data.states[i].flags |= SBP_FLAG_DIRTY;
+			}
+			return;
+		}
+	}
+
+	/* first time we see this topic -- always publish it once */
+	if(slot < SBP_MAX_STATES) {
+		sbp_data.states[slot].topic = topic;
+		sbp_data.states[slot].value = value;
+		sbp_data.states[slot].flags = SBP_FLAG_USED | SBP_FLAG_DIRTY;
+	}
+}
+
+void sbp_poll() {
+	uint8_t i;
+
+	if(sbp_data.busy)
+		return;
+
+	for(i=0; i<SBP_MAX_STATES; i++) {
+		if(sbp_data.states[i].flags & SBP_FLAG_DIRTY) {
+			if(sbp_publish(sbp_data.states[i].topic, &sbp_data.states[i].value, 1))
+				sbp_data.states[i].flags &= ~SBP_FLAG_DIRTY;
+			return;		/* one at a time */
+		}
+	}
+}
+
+/* functions called by the application's link-layer callbacks */
+uint8_t sbp_frame_received(struct sblp_header *header, uint8_t *payload) {
+	if(header->type != SBP_TYPE_PUBLISH)
+		return 0;
+
+	if(header->length >= 1 && (sbp_data.subscribed[payload[0] >> 3] & (1 << (payload[0] & 7))))
+		topic_received(payload[0], header->src, payload + 1, header->length - 1);
+
+	return 1;
+}
+
+uint8_t sbp_frame_sent() {
+	if(!sbp_data.busy)
+		return 0;
+
+	sbp_data.busy = 0;
+	return 1;
+}
@@ -7,33 +7,72 @@
  * Responsibilities of this layer:
  *	\li Interfacing to the bus via a MAX485-style transceiver
  *	\li Byte-level framing with start & stop bits (as per Atmel application note AVR307)
- *	\li Synchronising to the bus on start-up
+ *	\li Resynchronising on a break
  *	\li Escaping the synchronisation and escape bytes
+ *	\li Sleeping between frames, in power-down if the bus allows it
  *
- * \todo there must be a nicer way to do bus synchronisation...
+ * In power-down the clock stops, so the edge that wakes the MCU belongs to
+ * a byte that can't be received properly. Nodes on a bus with sleepers
+ * are built with T485_PREAMBLE set, which puts that many extra syncs in
+ * front of every frame. A node that wakes up drops everything up to the
+ * next sync and carries on from there, so the frame itself isn't lost.
+ *
+ * Normally the layer above is called from the USI interrupt, with
+ * interrupts enabled again so the next start bit isn't missed, and sblp
+ * and the application run nested in it for as long as they take. Built
+ * with T485_DEFER, the interrupts only put events into a small queue and
+ * the main loop hands them on with hw_poll(), so the time spent in them
+ * stays fixed.
+ *
+ * The state and flags the interrupts dispatch on are kept in GPIOR0 and
+ * GPIOR1, so a handler that doesn't call anything only saves the couple of
+ * registers it uses. With T485_DEFER that's all of them.
+ *
+ * The USI only shifts in the start and data bits, so the bit timer is
+ * left running for one more bit to look at the stop bit before a byte is
+ * handed on. A low stop bit means we're out of step with the sender or
+ * the line is noisy: the byte is dropped and framing_error() tells the
+ * layer above that the frame it was in is lost.
+ *
+ * A break, the line held low for longer than any character, counts as a
+ * sync. It reads as a zero byte whose stop bit is low, and the next
+ * rising edge ends it. Whatever a node was doing, it is back in step with
+ * the bus within a character, so a sender that wants every node listening
+ * (the gateway on startup, say) starts with one.
+ *
+ * On noisy lines, T485_MAJORITY receives without the USI: the bit timer
+ * samples every bit three times around its middle, T485_VOTE_GAP apart,
+ * and two out of three decide. A start bit that doesn't hold up to the
+ * vote was a spike and is ignored. That's three timer interrupts per bit
+ * instead of one per byte, which is fine at the bus' usual speed but
+ * leaves less for the application. Sending still uses the USI.
+ *
+ * For chasing timing problems, T485_TRACE records each interrupt in a
+ * ring buffer (see tiny485.h). That costs a dozen cycles per interrupt
+ * and three bytes of RAM per entry, so it's off unless asked for.
  */
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/sleep.h>
 
 #include "../interop.h"
 #include "tiny485_pin.h"
 #include "tiny485.h"
 
-/* debug */
-#undef REQUIRE_SYNC	/* normally defined, only undefine for testing purposes */
-
 /* timing info */
 #define T485_BIT_TIMER 104	/**< length of one bit in timer cycles */
+#define T485_VOTE_GAP	13	/**< timer cycles between the samples of a bit with T485_MAJORITY */
+
+#ifndef T485_PREAMBLE
+#define T485_PREAMBLE	0	/**< extra syncs sent before each frame to wake up sleeping nodes */
+#endif
+#define T485_WAKE_MAX	24	/**< bytes counted after a wake-up, so the latency in bits fits a byte */
 
 /* USI seeds */
 #define T485_RECV_SEED	((uint8_t) 0x07)			/**< receive seed:  shift in 16-7=9 bits (start + data) */
 #define T485_XMIT_SEED	((uint8_t) 0x0B)			/**< transmit seed: shift out 16-11=5 bits (half a byte + start/stop) */
 
-/* bit constants */
-#define T485_INIT1	((uint8_t) 0x7F /* 0b01111111 */)	/**< first part of init sequence */
-#define T485_INIT2	((uint8_t) 0xC0 /* 0b11000000 */)	/**< second part of init sequence */
-
 /* data bytes with special meanings */
 #define T485_SYNC_BYTE		((uint8_t) 0xFF)		/**< The synchronisation byte */
 #define T485_ESCAPE_BYTE	((uint8_t) 0x55)		/**< Escape byte for syncs in messages */
@@ -41,26 +80,136 @@
 #define T485_ESCAPED_SYNC	((uint8_t) 0x00)		/**< A synchronisation byte when escaped */
 #define T485_ESCAPED_ESCAPE	((uint8_t) 0x01)		/**< An escape byte when escaped */
 
-/* flags for field below */
-#define T485_FLAG_ESCAPE	((uint8_t) 0x01)
+/* vector names
+ * A bootloader that shares the interrupt vectors with the application
+ * builds this with T485_SHARED_VECTORS and jumps to the handlers
+ * (__vector_boot_PCINT0_vect and so on) from its own vector table.
+ */
+#ifdef T485_SHARED_VECTORS
+#define T485_VECTOR(v)	__vector_boot_##v
+#else
+#define T485_VECTOR(v)	v
+#endif
 
-static struct {
-	enum {
-		T485_STATE_INIT1,	/**< look for first half of init sequence */
-		T485_STATE_INIT2,	/**< look for second half of init sequence */
+/* state and flags
+ * Every interrupt starts by looking at these, so they live in general
+ * purpose I/O registers instead of RAM: a single in/out to read or write,
+ * and sbi/cbi/sbic for the flags, without tying up a pointer register.
+ * The application mustn't use GPIOR0 and GPIOR1; GPIOR2 belongs to the
+ * bootloader.
+ */
+#define T485_STATE	GPIOR0	/**< one of the states below */
+#define T485_FLAGS	GPIOR1	/**< internal flags. Mostly used for keeping track of escape states. */
+
+/* handler cost
+ * gcc gives every handler one prologue, saving the registers any of its
+ * paths use. Built with T485_DEFER, the handlers make no calls, so that's
+ * only what they use themselves; without it, the calls to the layer
+ * above make every handler save all call-clobbered registers, even on
+ * the paths that don't call (build with lib/node to inline them). So the
+ * paths that run for every byte keep to the registers above, I/O
+ * registers and single bytes of RAM: the 32-bit byte counters are only
+ * brought up to date every 256 bytes.
+ */
+#define T485_COUNT(low, total)	do { if(!++t485_data.low) t485_data.stats.total += 256; } while(0)
 
-		T485_STATE_IDLE,	/**< idle: ready to start transmitting or receiving */
-		T485_STATE_RECV,	/**< receive: currently receiving a byte */
+enum {
+	T485_STATE_IDLE,	/**< idle: ready to start transmitting or receiving */
+	T485_STATE_RECV,	/**< receive: currently receiving a byte */
+	T485_STATE_STOP,	/**< receive: a byte is in, waiting for its stop bit */
+	T485_STATE_BREAK,	/**< receive: in a break, waiting for the line to go high */
 
-		T485_STATE_XMIT1,	/**< transmit: currently transmitting first half of a byte */
-		T485_STATE_XMIT2	/**< transmit: currently transmitting second half of a byte */
-	} state;
+	T485_STATE_XMIT1,	/**< transmit: currently transmitting first half of a byte */
+	T485_STATE_XMIT2	/**< transmit: currently transmitting second half of a byte */
+};
 
-	uint8_t flags;			/**< internal flags. Mostly used for keeping track of escape states. */
+#define T485_FLAG_ESCAPE	((uint8_t) 0x01)
+#define T485_FLAG_WAKE		((uint8_t) 0x02)	/**< woken up from power-down, waiting for a sync */
+
+static struct {
 	uint8_t buf;			/**< buffer for second half of byte */
-	uint8_t escapebuf;		/**< buffer for actual character after escape */
+	uint8_t recv;			/**< byte received, until its stop bit is in */
+#ifdef T485_MAJORITY
+	uint8_t bits;			/**< bits of the byte decided so far, start bit included */
+	uint8_t samples;		/**< samples taken of the current bit */
+	uint8_t votes;			/**< of which were high */
+	uint8_t stop;			/**< the stop bit, once it's decided */
+#endif
+
+	uint8_t preamble;		/**< syncs still to be sent before the one that starts the frame */
+	uint8_t bytes_in;		/**< bytes received that stats.bytes_in doesn't count yet */
+	uint8_t bytes_out;		/**< bytes sent that stats.bytes_out doesn't count yet */
+	uint8_t wake_bytes;		/**< bytes received since waking up */
+	uint8_t wake_latency;		/**< bit times from the last wake-up until a sync was seen */
+
+	struct hw_stats stats;
 } t485_data;
 
+#ifdef T485_DEFER
+#ifndef T485_QUEUE
+#define T485_QUEUE	16	/**< events the queue holds, a power of two */
+#endif
+
+/* events for the layer above */
+#define T485_EVENT_SYNC		0
+#define T485_EVENT_BYTE		1
+#define T485_EVENT_SENT		2
+#define T485_EVENT_ERROR	3
+
+/** events waiting for hw_poll(). The interrupts only move head, hw_poll() only moves tail. */
+static volatile struct {
+	uint8_t	head;			/**< next free slot */
+	uint8_t	tail;			/**< oldest event */
+	uint8_t	event[T485_QUEUE];
+	uint8_t	data[T485_QUEUE];	/**< the byte, for T485_EVENT_BYTE */
+} t485_queue;
+
+/** queue an event; if the queue is full, it is lost and counted */
+static inline void t485_defer(uint8_t event, uint8_t b) {
+	uint8_t head = t485_queue.head, next = (head + 1) & (T485_QUEUE - 1);
+
+	if(next == t485_queue.tail) {
+		t485_data.stats.overflows++;
+		return;
+	}
+
+	t485_queue.event[head] = event;
+	t485_queue.data[head] = b;
+	t485_queue.head = next;
+}
+
+#define T485_SYNC_RECEIVED()	t485_defer(T485_EVENT_SYNC, 0)
+#define T485_BYTE_RECEIVED(b)	t485_defer(T485_EVENT_BYTE, b)
+#define T485_BYTE_SENT()	t485_defer(T485_EVENT_SENT, 0)
+#define T485_FRAMING_ERROR()	t485_defer(T485_EVENT_ERROR, 0)
+#else
+/* the layer above runs right here, with the next byte allowed to interrupt it */
+#define T485_SYNC_RECEIVED()	do { sei(); sync_received(); } while(0)
+#define T485_BYTE_RECEIVED(b)	do { sei(); byte_received(b); } while(0)
+#define T485_BYTE_SENT()	do { sei(); byte_sent(); } while(0)
+#define T485_FRAMING_ERROR()	do { sei(); framing_error(); } while(0)
+#endif
+
+#ifdef T485_TRACE
+/** the event trace: the offset of the oldest entry, then the entries */
+static uint8_t t485_trace[1 + T485_TRACE * T485_TRACE_ENTRY];
+static uint8_t t485_trace_frozen;	/**< being sent, don't touch */
+
+/** record an event; TCNT0 is read first, so use this before anything else in a handler */
+#define T485_TRACE_EVENT(event, data) do {					\
+	uint8_t *e = t485_trace + 1 + t485_trace[0];				\
+	if(!t485_trace_frozen) {						\
+		e[2] = TCNT0;							\
+		e[0] = ((event) << 4) | T485_STATE;				\
+		e[1] = (data);							\
+		if((t485_trace[0] += T485_TRACE_ENTRY) == T485_TRACE * T485_TRACE_ENTRY)	\
+			t485_trace[0] = 0;					\
+	}									\
+} while(0)
+#else
+#define T485_TRACE_EVENT(event, data)
+#endif
+
 /** reverse bits in a byte. necessary for host/wire bit order switching.  */
 inline uint8_t bit_reverse(uint8_t b) {
 	uint8_t i, buf = 0x0;
@@ -98,17 +247,21 @@ void end_transmission() {
  * this so the data appears on the bus as well.
  */
 void send_byte(uint8_t b) {
+	T485_TRACE_EVENT(T485_TRACE_XMIT, b);
+
 	switch(b) {
 		case T485_SYNC_BYTE:
-			t485_data.flags |= T485_FLAG_ESCAPE;
+			T485_FLAGS |= T485_FLAG_ESCAPE;
 			t485_data.buf = T485_ESCAPED_SYNC;
+			t485_data.stats.escapes_out++;
 
 			USIDR = FIRST_XMIT_BYTE(T485_ESCAPE_BYTE);
 			break;
 
 		case T485_ESCAPE_BYTE:
-			t485_data.flags |= T485_FLAG_ESCAPE;
+			T485_FLAGS |= T485_FLAG_ESCAPE;
 			t485_data.buf = T485_ESCAPED_ESCAPE;
+			t485_data.stats.escapes_out++;
 
 			USIDR = FIRST_XMIT_BYTE(T485_ESCAPE_BYTE);
 			break;
@@ -122,30 +275,38 @@ void send_byte(uint8_t b) {
 	}
 
 	USICOUNTER(T485_XMIT_SEED);
-	t485_data.state = T485_STATE_XMIT1;
+	T485_STATE = T485_STATE_XMIT1;
 
 	USI_ON();
 	TIM0_ON();
 }
 
-void send_sync() {
+/** start shifting out a sync */
+static inline void t485_xmit_sync() {
 	USIDR = FIRST_XMIT_BYTE(T485_SYNC_BYTE);
 	t485_data.buf = T485_SYNC_BYTE;
 	
 	USICOUNTER(T485_XMIT_SEED);
-	t485_data.state = T485_STATE_XMIT1;
+	T485_STATE = T485_STATE_XMIT1;
 
 	USI_ON();
 	TIM0_ON();
 }
 
+void send_sync() {
+	T485_TRACE_EVENT(T485_TRACE_XMIT, T485_SYNC_BYTE);
+
+	t485_data.preamble = T485_PREAMBLE;
+	t485_xmit_sync();
+}
+
 void hw_init() {
-	/* set state */
-#ifdef REQUIRE_SYNC
-	t485_data.state = T485_STATE_INIT1;	/* start hunting for init sequence */
-#else
-	t485_data.state = T485_STATE_IDLE;	/* start hunting for init sequence */
-#endif
+	/* set state -- if we start in the middle of a byte, the next break puts us right */
+	T485_STATE = T485_STATE_IDLE;
+
+	T485_FLAGS = 0;
+	t485_data.preamble = 0;
+	t485_data.wake_latency = 0;
 
 	/* initialise the pins we use */
 	USI_DDR |=  _BV(DO);	/* DO  = output */
@@ -171,24 +332,49 @@ void hw_init() {
 
 /* interrupt vectors */
 /** Pin change ISR. Synchronise the receive timer to the node transmitting. */
-ISR(PCINT0_vect) {
-	switch(t485_data.state) {
-		case T485_STATE_INIT1:	/* fallthrough */
-		case T485_STATE_INIT2:
-			/* synchronise the bit timer on transitions */
-			TCNT0 = T485_BIT_TIMER / 2;
-			break;
+ISR(T485_VECTOR(PCINT0_vect)) {
+	T485_TRACE_EVENT(T485_TRACE_PCINT, USI_PIN);
 
+	switch(T485_STATE) {
 		case T485_STATE_IDLE:
-			if((USI_PORT & _BV(DI)) == 0) {
+			if((USI_PIN & _BV(DI)) == 0) {
+#ifdef T485_MAJORITY
+				/* start bit detected! the first sample is a gap before the middle of it */
+				OCR0A = T485_BIT_TIMER - 2 * T485_VOTE_GAP;
+				TCNT0 = T485_BIT_TIMER / 2 - T485_VOTE_GAP;
+				T485_STATE = T485_STATE_RECV;
+				t485_data.bits = t485_data.samples = t485_data.votes = 0;
+
+				PCINT0_OFF();
+				TIM0INT_CLEAR();
+				TIM0INT_ON();
+				TIM0_ON();
+#else
 				/* start bit detected! sync the timer - sample 1/2 bit length later */
 				TCNT0 = T485_BIT_TIMER / 2;
-				t485_data.state = T485_STATE_RECV;
+				T485_STATE = T485_STATE_RECV;
 				USICOUNTER(T485_RECV_SEED);	/* wait for 16-7 = 9 bits (start bit + a byte) */
 
 				PCINT0_OFF();
 				TIM0_ON();
 				USI_ON();
+#endif
+			}
+			break;
+
+		case T485_STATE_BREAK:
+			if(USI_PIN & _BV(DI)) {
+				/* the break is over: the next falling edge is a start bit, so we're in step again */
+				T485_STATE = T485_STATE_IDLE;
+				T485_FLAGS &= ~T485_FLAG_ESCAPE;
+
+				if(T485_FLAGS & T485_FLAG_WAKE) {
+					T485_FLAGS &= ~T485_FLAG_WAKE;
+					t485_data.wake_latency = 10 * (t485_data.wake_bytes + 1);
+				}
+
+				t485_data.stats.syncs++;
+				T485_SYNC_RECEIVED();
 			}
 			break;
 
@@ -198,24 +384,159 @@ ISR(PCINT0_vect) {
 	}
 }
 
-/** Bit timer interrupt - this interrupt is only enabled when sync-hunting. */
-ISR(TIM0_COMPA_vect) {
-	switch(t485_data.state) {
-		case T485_STATE_INIT1:
-			/* detect first half of sequence */
-			if(USIDR == T485_INIT1) {
-				t485_data.state = T485_STATE_INIT2;	/* hunt for second half */
-				USIDR = 0;				/* clear USI data register so we don't get false hits for the second half */
+#ifdef T485_MAJORITY
+/** take a sample of the bit being received. Returns nonzero once the stop bit is decided. */
+static inline uint8_t t485_sample() {
+	uint8_t bit;
+
+	if(USI_PIN & _BV(DI))
+		t485_data.votes++;
+
+	if(++t485_data.samples < 3) {
+		/* the next sample of this bit */
+		OCR0A = T485_VOTE_GAP - 1;
+		return 0;
+	}
+
+	/* the first sample of the next bit */
+	OCR0A = T485_BIT_TIMER - 2 * T485_VOTE_GAP;
+
+	bit = t485_data.votes >= 2;
+	t485_data.samples = t485_data.votes = 0;
+
+	switch(t485_data.bits++) {
+		case 0:
+			if(bit) {
+				/* the start bit didn't last: a spike, not a byte */
+				TIM0INT_OFF();
+				TIM0_OFF();
+				OCR0A = T485_BIT_TIMER;
+				T485_STATE = T485_STATE_IDLE;
+
+				PCINT0_CLEAR();
+				PCINT0_ON();
 			}
-			break;
+			return 0;
+
+		case 9:
+			/* the stop bit; the bit timer goes back to clocking the USI */
+			OCR0A = T485_BIT_TIMER;
+			t485_data.stop = bit;
+			T485_COUNT(bytes_in, bytes_in);
+			T485_STATE = T485_STATE_STOP;
+			return 1;
+
+		default:
+			/* data, MSB first like the USI */
+			t485_data.recv = (t485_data.recv << 1) | bit;
+			return 0;
+	}
+}
+#endif
+
+/** Bit timer interrupt - this interrupt is only enabled to look at the stop bit of a received byte,
+ * or to sample every bit with T485_MAJORITY.
+ */
+ISR(T485_VECTOR(TIM0_COMPA_vect)) {
+	uint8_t b, stop;
+
+	T485_TRACE_EVENT(T485_TRACE_TIM0, USI_PIN);
+
+#ifdef T485_MAJORITY
+	if(T485_STATE == T485_STATE_RECV && !t485_sample())
+		return;
+	stop = t485_data.stop;
+#else
+	stop = USI_PIN & _BV(DI);
+#endif
+	b = t485_data.recv;
+
+	switch(T485_STATE) {
+		case T485_STATE_STOP:
+			TIM0INT_OFF();
+			TIM0_OFF();
 
-		case T485_STATE_INIT2:
-			if(USIDR == T485_INIT2) {
-				/* sync fully detected! we are now synchronised to the bus */
-				t485_data.state = T485_STATE_IDLE;
+			/* listen for the next start bit. The edges seen while receiving this byte don't count. */
+			PCINT0_CLEAR();
+			PCINT0_ON();
 
-				/* notify the layer above */
-				sync_received();
+			if(!stop) {
+				if(b == 0x00) {
+					/* low all the way through the stop bit: that's a break */
+					T485_STATE = T485_STATE_BREAK;
+					break;
+				}
+
+				/* out of step with the sender, or noise. The byte is garbage, so the frame is lost. */
+				T485_STATE = T485_STATE_IDLE;
+				T485_FLAGS &= ~T485_FLAG_ESCAPE;
+
+				if(T485_FLAGS & T485_FLAG_WAKE) {
+					/* the byte that woke us, most likely */
+					if(t485_data.wake_bytes < T485_WAKE_MAX)
+						t485_data.wake_bytes++;
+					break;
+				}
+
+				t485_data.stats.framing_errors++;
+				T485_FRAMING_ERROR();
+				break;
+			}
+
+			T485_STATE = T485_STATE_IDLE;
+
+			if(T485_FLAGS & T485_FLAG_WAKE) {
+				/* just woken up: this may be the byte that woke us, so wait for a sync */
+				if(b != T485_SYNC_BYTE) {
+					if(t485_data.wake_bytes < T485_WAKE_MAX)
+						t485_data.wake_bytes++;
+					break;
+				}
+
+				T485_FLAGS &= ~T485_FLAG_WAKE;
+				t485_data.wake_latency = 10 * (t485_data.wake_bytes + 1);
+			}
+
+			/* handle received byte */
+			switch(b) {
+				case T485_SYNC_BYTE:
+					/* it's a sync, so pass it on as one */
+					T485_FLAGS &= ~T485_FLAG_ESCAPE;
+					t485_data.stats.syncs++;
+					T485_SYNC_RECEIVED();
+					break;
+
+				case T485_ESCAPE_BYTE:
+					/* escape byte - set escape flag */
+					T485_FLAGS |= T485_FLAG_ESCAPE;
+					break;
+
+				default:
+					if(T485_FLAGS & T485_FLAG_ESCAPE) {
+						/* we're in escape mode, determine which byte to send up */
+						T485_FLAGS &= ~T485_FLAG_ESCAPE;
+						switch(b) {
+							case T485_ESCAPED_SYNC:
+								t485_data.stats.escapes_in++;
+								T485_BYTE_RECEIVED(T485_SYNC_BYTE);
+								break;
+
+							case T485_ESCAPED_ESCAPE:
+								t485_data.stats.escapes_in++;
+								T485_BYTE_RECEIVED(T485_ESCAPE_BYTE);
+								break;
+
+							default:
+								/* no sender escapes anything else -- we've missed something */
+								t485_data.stats.framing_errors++;
+								T485_FRAMING_ERROR();
+								break;
+						}
+					} else {
+						/* no escape, regular data - notify higher layer */
+						T485_BYTE_RECEIVED(b);
+					}
+					break;
 			}
 			break;
 
@@ -231,91 +552,147 @@ ISR(TIM0_COMPA_vect) {
  * hacky UART, we may need to send another byte. If not, notify the
  * layer above via the appropriate struct hw_interface members.
  */
-ISR(USI_OVF_vect) {
+ISR(T485_VECTOR(USI_OVF_vect)) {
+	T485_TRACE_EVENT(T485_TRACE_USI, USIBR);
+
 	USISR |= _BV(USIOIF);	/* clear overflow flag */
 
-	switch(t485_data.state) {
+	switch(T485_STATE) {
 		case T485_STATE_XMIT1:
-			if(t485_data.flags & T485_FLAG_ESCAPE)
+			if(T485_FLAGS & T485_FLAG_ESCAPE)
 				USIDR  = SECOND_XMIT_BYTE(T485_ESCAPE_BYTE);	/* send another byte of escape */
 			else
 				USIDR  = SECOND_XMIT_BYTE(t485_data.buf);		/* send another byte of data */
 
 			USICOUNTER(T485_XMIT_SEED);
-			t485_data.state = T485_STATE_XMIT2;
+			T485_STATE = T485_STATE_XMIT2;
 			break;
 
 		case T485_STATE_XMIT2:
-				if(t485_data.flags & T485_FLAG_ESCAPE) {
+				T485_COUNT(bytes_out, bytes_out);
+
+				if(T485_FLAGS & T485_FLAG_ESCAPE) {
 					/* if we were escaping something, send another byte */
 					USIDR  = FIRST_XMIT_BYTE(t485_data.buf);
 					USICOUNTER(T485_XMIT_SEED);
-					t485_data.state = T485_STATE_XMIT1;
-					t485_data.flags &= ~T485_FLAG_ESCAPE;	/* clear escape */
+					T485_STATE = T485_STATE_XMIT1;
+					T485_FLAGS &= ~T485_FLAG_ESCAPE;	/* clear escape */
+				} else if(t485_data.preamble) {
+					/* a preamble sync is out -- the layer above only knows about the last one */
+					t485_data.preamble--;
+					t485_xmit_sync();
 				} else {
 					/* otherwise, go back to idle */
 					USI_OFF();
 					TIM0_OFF();
-					t485_data.state = T485_STATE_IDLE;
+					T485_STATE = T485_STATE_IDLE;
 
 					/* and notify the layer above */
-					sei();
-					byte_sent();
+					T485_BYTE_SENT();
 				}
 				break;
 
 		case T485_STATE_RECV:
-			/* if we're receiving, we need to handle the received byte */
+			/* the data bits are in, and we're in the middle of the last one.
+			 * Keep the bit timer running to look at the stop bit before handing the byte on.
+			 */
 			USI_OFF();
-			TIM0_OFF();
-			t485_data.state = T485_STATE_IDLE;
+			t485_data.recv = USIBR;
+			T485_COUNT(bytes_in, bytes_in);
 
-			/* load USI buffer into buf */
-			t485_data.buf = USIBR;
-			PCINT0_OFF();
+			TIM0INT_CLEAR();
+			TIM0INT_ON();
+			T485_STATE = T485_STATE_STOP;
+			break;
 
-			/* handle received byte */
-			switch(USIBR) {
-				case T485_SYNC_BYTE:
-					/* it's a sync, so pass it on as one */
-					sei();
-					sync_received();
-					break;
+		default:
+			/* do nothing */
+			break;
+	}
+}
 
-				case T485_ESCAPE_BYTE:
-					/* escape byte - set escape flag */
-					t485_data.flags |= T485_FLAG_ESCAPE;
-					break;
+uint8_t hw_poll() {
+#ifdef T485_DEFER
+	uint8_t tail = t485_queue.tail, event, b;
 
-				default:
-					if(t485_data.flags & T485_FLAG_ESCAPE) {
-						/* we're in escape mode, determine which byte to send up */
-						switch(USIBR) {
-							case T485_ESCAPED_SYNC:
-								sei();
-								byte_received(T485_SYNC_BYTE);
-								break;
+	if(tail == t485_queue.head)
+		return 0;
 
-							case T485_ESCAPED_ESCAPE:
-								sei();
-								byte_received(T485_ESCAPE_BYTE);
-								break;
+	event = t485_queue.event[tail];
+	b = t485_queue.data[tail];
+	t485_queue.tail = (tail + 1) & (T485_QUEUE - 1);
 
-							default:
-								/* regular data: this shouldn't happen here, but notify higher layer anyway */
-								byte_received(USIBR);
-								break;
-						}
-					} else {
-						/* no escape, regular data - notify higher layer */
-						byte_received(USIBR);
-					}
-					break;
-			}
-			break;
+	switch(event) {
+		case T485_EVENT_SYNC:	sync_received(); break;
+		case T485_EVENT_BYTE:	byte_received(b); break;
+		case T485_EVENT_SENT:	byte_sent(); break;
+		case T485_EVENT_ERROR:	framing_error(); break;
+	}
 
-		default:
-			/* do nothing */
-			break;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void t485_sleep(uint8_t power_down) {
+	/* called with interrupts off, so nothing can start between the check and sleeping */
+#ifdef T485_DEFER
+	if(t485_queue.tail != t485_queue.head) {
+		/* there's work to do first */
+		sei();
+		return;
+	}
+#endif
+
+	if(power_down && T485_STATE == T485_STATE_IDLE) {
+		set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+		T485_FLAGS |= T485_FLAG_WAKE;
+		t485_data.wake_bytes = 0;
+	} else {
+		set_sleep_mode(SLEEP_MODE_IDLE);
 	}
+
+	sleep_enable();
+	sei();		/* takes effect after the next instruction: no wake-up can be missed */
+	sleep_cpu();
+	sleep_disable();
+}
+
+uint8_t t485_wake_latency() {
+	return t485_data.wake_latency;
+}
+
+uint8_t hw_lock() {
+	uint8_t sreg = SREG;
+
+	cli();
+	return sreg;
 }
+
+void hw_unlock(uint8_t sreg) {
+	SREG = sreg;
+}
+
+void hw_get_stats(struct hw_stats *stats) {
+	uint8_t sreg = SREG;
+
+	cli();
+	*stats = t485_data.stats;
+	stats->bytes_in += t485_data.bytes_in;
+	stats->bytes_out += t485_data.bytes_out;
+	SREG = sreg;
+}
+
+#ifdef T485_TRACE
+uint8_t *hw_trace_freeze(uint16_t *length) {
+	t485_trace_frozen = 1;
+
+	*length = sizeof(t485_trace);
+	return t485_trace;
+}
+
+void hw_trace_resume() {
+	t485_trace_frozen = 0;
+}
+#endif
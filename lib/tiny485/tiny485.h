@@ -7,5 +7,35 @@
 /** initialise the tiny485 layer */
 void tiny485_init();
 
+/** sleep until an interrupt. Call with interrupts disabled; they are enabled again.
+ * With T485_DEFER, it returns straight away if there are events for hw_poll().
+ * With power_down set, and no byte being sent or received, the MCU powers
+ * down and the next pin change wakes it up. Only ask for that between
+ * frames (see sblp_idle()): everything up to the next sync is dropped.
+ */
+void t485_sleep(uint8_t power_down);
+
+/** bit times from the last wake-up from power-down until the next sync
+ * came in, in steps of a byte. Up to T485_PREAMBLE + 1 bytes means the
+ * frame that woke us was received.
+ */
+uint8_t t485_wake_latency();
+
+/* event trace
+ * Built with T485_TRACE set to a number of entries (at most 84), the
+ * interrupt handlers record what they see into a ring buffer. Each entry
+ * is three bytes: the event in the high nibble and the state the handler
+ * found in the low one (the order of the states in tiny485.c), then a
+ * data byte and TCNT0 as the handler started. The buffer is sent as is,
+ * preceded by the offset of the oldest entry, in answer to
+ * SBLP_TYPE_TRACE_QUERY by an sblp built with SBLP_TRACE.
+ */
+#define T485_TRACE_ENTRY	3	/**< bytes per trace entry */
+
+#define T485_TRACE_PCINT	1	/**< pin change, data is USI_PIN */
+#define T485_TRACE_TIM0		2	/**< bit timer at the stop bit of a received byte, data is USI_PIN */
+#define T485_TRACE_USI		3	/**< USI overflow, data is USIBR */
+#define T485_TRACE_XMIT		4	/**< a byte or sync handed to the USI, data is the byte */
+
 #define _TINY485_C
 #endif
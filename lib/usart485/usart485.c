@@ -0,0 +1,279 @@
+/** \file usart485.c
+ * \brief An SBLP hardware-side implementation for AVRs with a hardware USART.
+ *
+ * This is the same layer as tiny485, for parts like the ATMega328P and
+ * ATTiny2313/4313 that have a real UART: gateways and arbiters that see
+ * every frame on the bus and need the cycles for other things. On the
+ * wire, nothing tells the two apart.
+ *
+ * Responsibilities of this layer:
+ *	\li Interfacing to the bus via a MAX485-style transceiver
+ *	\li Converting between the USART's bit order and the bus' (see below)
+ *	\li Escaping the synchronisation and escape bytes
+ *	\li Resynchronising on a break
+ *
+ * tiny485 shifts bytes out MSB first, a UART sends LSB first, so every
+ * byte is bit-reversed on its way in and out, like host485 does.
+ *
+ * The USART checks the stop bit and takes three samples of every bit by
+ * itself. A low stop bit is a framing error, reported to the layer above
+ * with framing_error() as tiny485 does; a zero byte with a low stop bit
+ * is a break and counts as a sync. The USART keeps reporting zero bytes
+ * for as long as the break lasts, so only the first one counts.
+ *
+ * Bytes are handed to the USART as soon as its buffer has room, so the
+ * next one is ready while the last one is still being shifted out, and
+ * the layer above hears about it then. The data enable line is only
+ * dropped at the end of a transmission, once the transmit complete
+ * interrupt says the last stop bit is out.
+ *
+ * The layer above is called from the interrupts with interrupts enabled
+ * again, as tiny485 does without T485_DEFER; hw_poll() has nothing to do.
+ */
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+#include "../interop.h"
+#include "usart485_pin.h"
+
+#ifndef F_CPU
+#define F_CPU		1000000UL	/**< clock the baud rate is derived from */
+#endif
+#ifndef U485_BAUD
+#define U485_BAUD	1190		/**< the bus' bit rate: tiny485's 840 cycle bit at 1 MHz */
+#endif
+#define U485_UBRR	((F_CPU / 8 + U485_BAUD / 2) / U485_BAUD - 1)	/**< with U2X, so 1 MHz can match tiny485 exactly */
+
+#ifndef U485_PREAMBLE
+#define U485_PREAMBLE	0	/**< extra syncs sent before each frame to wake up sleeping tiny485 nodes */
+#endif
+
+/* data bytes with special meanings -- must match tiny485.c */
+#define U485_SYNC_BYTE		((uint8_t) 0xFF)		/**< The synchronisation byte */
+#define U485_ESCAPE_BYTE	((uint8_t) 0x55)		/**< Escape byte for syncs in messages */
+
+#define U485_ESCAPED_SYNC	((uint8_t) 0x00)		/**< A synchronisation byte when escaped */
+#define U485_ESCAPED_ESCAPE	((uint8_t) 0x01)		/**< An escape byte when escaped */
+
+/* flags for field below */
+#define U485_FLAG_ESCAPE	((uint8_t) 0x01)	/**< the last byte received was an escape */
+#define U485_FLAG_BREAK		((uint8_t) 0x02)	/**< in a break, no good byte since */
+#define U485_FLAG_PENDING	((uint8_t) 0x04)	/**< the second half of an escape is waiting to be sent */
+
+static struct {
+	uint8_t flags;
+	uint8_t pending;		/**< the second half of an escape */
+	uint8_t preamble;		/**< syncs still to be sent before the one that starts the frame */
+
+	struct hw_stats stats;
+} u485_data;
+
+/** the bits of a nibble in reverse order */
+static const uint8_t u485_reverse[16] = {
+	0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE,
+	0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF
+};
+
+/** convert between wire and USART bit order */
+static inline uint8_t u485_reversed(uint8_t b) {
+	return (u485_reverse[b & 0x0F] << 4) | u485_reverse[b >> 4];
+}
+
+/** hand a byte to the USART, as is */
+static inline void u485_xmit(uint8_t b) {
+	/* forget an earlier transmit complete, so it only fires once this byte is out */
+	U485_UCSRA = (U485_UCSRA & U485_UCSRA_KEEP) | _BV(U485_TXC);
+	U485_UDR = u485_reversed(b);
+	U485_UCSRB |= _BV(U485_UDRIE);
+}
+
+void begin_transmission() {
+	/* a release still waiting for the last frame's stop bit is off */
+	U485_UCSRB &= ~(_BV(U485_TXCIE) | _BV(U485_RXEN) | _BV(U485_RXCIE));	/* don't hear ourselves */
+	DEN_PORT |= _BV(DEN);
+}
+
+void end_transmission() {
+	/* the last byte is still being shifted out: release the line once it's done */
+	U485_UCSRB |= _BV(U485_TXCIE);
+}
+
+void send_byte(uint8_t b) {
+	switch(b) {
+		case U485_SYNC_BYTE:
+			u485_data.flags |= U485_FLAG_PENDING;
+			u485_data.pending = U485_ESCAPED_SYNC;
+			u485_data.stats.escapes_out++;
+			b = U485_ESCAPE_BYTE;
+			break;
+
+		case U485_ESCAPE_BYTE:
+			u485_data.flags |= U485_FLAG_PENDING;
+			u485_data.pending = U485_ESCAPED_ESCAPE;
+			u485_data.stats.escapes_out++;
+			break;
+
+		default:
+			break;
+	}
+
+	u485_xmit(b);
+}
+
+void send_sync() {
+	u485_data.preamble = U485_PREAMBLE;
+	u485_xmit(U485_SYNC_BYTE);
+}
+
+void hw_init() {
+	u485_data.flags = 0;
+	u485_data.preamble = 0;
+
+	DEN_DDR |= _BV(DEN);	/* DEN = output */
+	DEN_PORT &= ~_BV(DEN);
+
+	U485_UBRRH = U485_UBRR >> 8;
+	U485_UBRRL = U485_UBRR & 0xFF;
+	U485_UCSRA = _BV(U485_U2X);
+	U485_UCSRC = U485_8N1;
+	U485_UCSRB = _BV(U485_RXEN) | _BV(U485_TXEN) | _BV(U485_RXCIE);
+
+	sei();			/* turn on interrupts */
+}
+
+/* interrupt vectors */
+/** Receive complete. Undo the escaping like tiny485 does. */
+ISR(U485_RX_vect) {
+	uint8_t status = U485_UCSRA;
+	uint8_t b = u485_reversed(U485_UDR);
+
+	u485_data.stats.bytes_in++;
+
+	if(status & _BV(U485_FE)) {
+		u485_data.flags &= ~U485_FLAG_ESCAPE;
+
+		if(b == 0x00) {
+			/* a break: the first zero byte of it is a sync, the rest is more of the same */
+			if(!(u485_data.flags & U485_FLAG_BREAK)) {
+				u485_data.flags |= U485_FLAG_BREAK;
+				u485_data.stats.syncs++;
+				sei();
+				sync_received();
+			}
+			return;
+		}
+
+		/* out of step with the sender, or noise. The byte is garbage, so the frame is lost. */
+		u485_data.stats.framing_errors++;
+		sei();
+		framing_error();
+		return;
+	}
+
+	u485_data.flags &= ~U485_FLAG_BREAK;
+
+	if(status & _BV(U485_DOR)) {
+		/* a byte before this one was lost */
+		u485_data.flags &= ~U485_FLAG_ESCAPE;
+		u485_data.stats.overflows++;
+		sei();
+		framing_error();
+		return;
+	}
+
+	/* handle received byte */
+	switch(b) {
+		case U485_SYNC_BYTE:
+			/* it's a sync, so pass it on as one */
+			u485_data.flags &= ~U485_FLAG_ESCAPE;
+			u485_data.stats.syncs++;
+			sei();
+			sync_received();
+			break;
+
+		case U485_ESCAPE_BYTE:
+			/* escape byte - set escape flag */
+			u485_data.flags |= U485_FLAG_ESCAPE;
+			break;
+
+		default:
+			if(u485_data.flags & U485_FLAG_ESCAPE) {
+				/* we're in escape mode, determine which byte to send up */
+				u485_data.flags &= ~U485_FLAG_ESCAPE;
+				switch(b) {
+					case U485_ESCAPED_SYNC:
+						u485_data.stats.escapes_in++;
+						sei();
+						byte_received(U485_SYNC_BYTE);
+						break;
+
+					case U485_ESCAPED_ESCAPE:
+						u485_data.stats.escapes_in++;
+						sei();
+						byte_received(U485_ESCAPE_BYTE);
+						break;
+
+					default:
+						/* no sender escapes anything else -- we've missed something */
+						u485_data.stats.framing_errors++;
+						sei();
+						framing_error();
+						break;
+				}
+			} else {
+				/* no escape, regular data - notify higher layer */
+				sei();
+				byte_received(b);
+			}
+			break;
+	}
+}
+
+/** Transmit buffer empty. Send the rest of an escape or the preamble, or ask for the next byte. */
+ISR(U485_UDRE_vect) {
+	U485_UCSRB &= ~_BV(U485_UDRIE);
+	u485_data.stats.bytes_out++;
+
+	if(u485_data.flags & U485_FLAG_PENDING) {
+		u485_data.flags &= ~U485_FLAG_PENDING;
+		u485_xmit(u485_data.pending);
+	} else if(u485_data.preamble) {
+		/* a preamble sync is out -- the layer above only knows about the last one */
+		u485_data.preamble--;
+		u485_xmit(U485_SYNC_BYTE);
+	} else {
+		sei();
+		byte_sent();
+	}
+}
+
+/** Transmit complete -- the frame is out, release the bus. */
+ISR(U485_TX_vect) {
+	U485_UCSRB &= ~_BV(U485_TXCIE);
+	DEN_PORT &= ~_BV(DEN);
+	U485_UCSRB |= _BV(U485_RXEN) | _BV(U485_RXCIE);
+}
+
+uint8_t hw_poll() {
+	return 0;
+}
+
+uint8_t hw_lock() {
+	uint8_t sreg = SREG;
+
+	cli();
+	return sreg;
+}
+
+void hw_unlock(uint8_t sreg) {
+	SREG = sreg;
+}
+
+void hw_get_stats(struct hw_stats *stats) {
+	uint8_t sreg = SREG;
+
+	cli();
+	*stats = u485_data.stats;
+	SREG = sreg;
+}
@@ -0,0 +1,74 @@
+/** \file usart485_pin.h
+ * Register and pin names for the USART hardware layer.
+ */
+
+#ifndef _USART485_PIN_H
+
+/*************************
+ * 	ATMEGA328P
+ *************************/
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__) || defined(__AVR_ATmega88__)
+#define U485_UDR	UDR0
+#define U485_UCSRA	UCSR0A
+#define U485_UCSRB	UCSR0B
+#define U485_UCSRC	UCSR0C
+#define U485_UBRRH	UBRR0H
+#define U485_UBRRL	UBRR0L
+
+#define U485_RX_vect	USART_RX_vect	/**< receive complete */
+#define U485_UDRE_vect	USART_UDRE_vect	/**< transmit buffer empty */
+#define U485_TX_vect	USART_TX_vect	/**< transmit complete */
+
+#define DEN_PORT	PORTD	/**< the port the data enable pin is on */
+#define DEN_DDR		DDRD
+#define DEN		PD2	/**< the data enable pin on the DEN_PORT */
+
+#define AVR_SUPPORTED
+#endif
+
+/*************************
+ * 	ATTINY2313/4313
+ *************************/
+#ifndef AVR_SUPPORTED
+#if defined(__AVR_ATtiny2313__) || defined(__AVR_ATtiny2313A__) || defined(__AVR_ATtiny4313__)
+#define U485_UDR	UDR
+#define U485_UCSRA	UCSRA
+#define U485_UCSRB	UCSRB
+#define U485_UCSRC	UCSRC
+#define U485_UBRRH	UBRRH
+#define U485_UBRRL	UBRRL
+
+#define U485_RX_vect	USART_RX_vect
+#define U485_UDRE_vect	USART_UDRE_vect
+#define U485_TX_vect	USART_TX_vect
+
+#define DEN_PORT	PORTD
+#define DEN_DDR		DDRD
+#define DEN		PD2
+
+#define AVR_SUPPORTED
+#endif
+#endif
+
+#ifndef AVR_SUPPORTED
+#error "unsupported avr architecture"
+#endif
+
+/* control and status bits -- in the same places on every AVR USART */
+#define U485_RXC	7	/**< UCSRA: receive complete */
+#define U485_TXC	6	/**< UCSRA: transmit complete */
+#define U485_FE		4	/**< UCSRA: framing error, the stop bit was low */
+#define U485_DOR	3	/**< UCSRA: data overrun, a byte was lost */
+#define U485_U2X	1	/**< UCSRA: double speed, 8 clocks per bit and UBRR step */
+#define U485_UCSRA_KEEP	0x03	/* 0b00000011 */	/**< UCSRA: U2X and MPCM, the bits that are settings rather than flags */
+
+#define U485_RXCIE	7	/**< UCSRB: receive complete interrupt */
+#define U485_TXCIE	6	/**< UCSRB: transmit complete interrupt */
+#define U485_UDRIE	5	/**< UCSRB: transmit buffer empty interrupt */
+#define U485_RXEN	4	/**< UCSRB: receiver */
+#define U485_TXEN	3	/**< UCSRB: transmitter */
+
+#define U485_8N1	0x06	/* 0b00000110 */	/**< UCSRC: asynchronous, 8 data bits, no parity, 1 stop bit */
+
+#define _USART485_PIN_H
+#endif
@@ -0,0 +1,237 @@
+/** \file bench485.c
+ * \brief Throughput benchmark for the host485 decoder.
+ *
+ * Decodes a buffer of bus traffic with every scan method the CPU supports
+ * and reports the throughput of each. The frames each method produces are
+ * checksummed and compared with those of the bytewise reference path,
+ * which follows the tiny485 receive logic one byte at a time; any
+ * difference is an error.
+ *
+ * The traffic is either generated (frames with random payloads, so escapes
+ * turn up at their natural rate, plus some line noise) or read from a raw
+ * capture file as written by `cat /dev/ttyUSB0 > file`.
+ *
+ * Before that, every method decodes a few hand-made frames whose outcome
+ * is known, such as a frame dropped for a bad escape as tiny485 drops it.
+ *
+ * usage: bench485 [-r capture] [-m megabytes] [-n rounds]
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+
+#define BENCH_CHUNK	4093		/**< decode in chunks, like a reader would; odd so frames straddle them */
+#define BENCH_MAX_LEN	200		/**< largest generated payload */
+
+/** summary of the frames a run produced */
+struct bench_result {
+	unsigned long	frames;
+	unsigned long	truncated;
+	unsigned long	bad_escapes;
+	unsigned long	overruns;
+	uint64_t	digest;
+};
+
+static uint8_t bench_payload[H485_MAX_PAYLOAD];
+
+static const char *bench_names[] = { "bytewise", "scalar", "sse2", "avx2" };
+
+/** fold a frame into the digest (FNV-1a) */
+static void bench_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	struct bench_result *r = ctx;
+	uint8_t head[HEADER_LENGTH];
+	uint16_t i;
+
+	h485_pack_header(header, head);
+	for(i=0; i<HEADER_LENGTH; i++)
+		r->digest = (r->digest ^ head[i]) * 0x100000001b3ULL;
+	for(i=0; i<header->length; i++)
+		r->digest = (r->digest ^ payload[i]) * 0x100000001b3ULL;
+
+	r->frames++;
+}
+
+/** fill buf with generated traffic, returning its length */
+static size_t bench_generate(uint8_t *buf, size_t size) {
+	uint8_t payload[BENCH_MAX_LEN];
+	struct sblp_header header;
+	size_t len = 0, n;
+	uint16_t i;
+
+	while(len + H485_ENCODED_SIZE(BENCH_MAX_LEN) + 1 <= size) {
+		header.type   = rand();
+		header.length = rand() % (BENCH_MAX_LEN + 1);
+		header.dest   = rand();
+		header.src    = rand();
+		for(i=0; i<header.length; i++)
+			payload[i] = rand();
+
+		n = h485_encode(&header, payload, buf + len);
+
+		/* now and then, a frame gets cut short or there's noise on the line */
+		if(rand() % 100 == 0)
+			n = rand() % n;
+		len += n;
+		if(rand() % 100 == 0)
+			buf[len++] = rand();
+		if(rand() % 100 == 0) {
+			/* an escape with the wrong byte after it */
+			buf[len++] = H485_ESCAPE_BYTE;
+			buf[len++] = 0x02 + rand() % 0x50;
+		}
+	}
+
+	return len;
+}
+
+/** decode buf with the current scan method */
+static void bench_run(const uint8_t *buf, size_t len, struct bench_result *r) {
+	struct h485_decoder d;
+	size_t i, n;
+
+	memset(r, 0, sizeof(*r));
+	r->digest = 0xcbf29ce484222325ULL;
+	h485_decoder_init(&d, bench_payload, sizeof(bench_payload), bench_frame, r);
+
+	for(i=0; i<len; i+=n) {
+		n = len - i < BENCH_CHUNK ? len - i : BENCH_CHUNK;
+		h485_decode(&d, buf + i, n);
+	}
+
+	r->truncated   = d.truncated;
+	r->bad_escapes = d.bad_escapes;
+	r->overruns    = d.overruns;
+}
+
+/** decode frames with a known outcome, returning 0 if the current scan method gets it wrong */
+static int bench_check() {
+	static const uint8_t good[] = { 0x12, H485_SYNC_BYTE, H485_ESCAPE_BYTE, 0x34 };
+	uint8_t buf[128], *p = buf;
+	struct sblp_header header = { 0x01, sizeof(good), 0x10, 0x20 };
+	struct bench_result r;
+	size_t n;
+
+	/* a good frame, one with a bad escape in its payload, and another good one */
+	p += h485_encode(&header, good, p);
+	n = h485_encode(&header, good, p);
+	p[n - 2] = 0x33;		/* the 0x01 after the escape becomes 0x33 */
+	p += n;
+	p += h485_encode(&header, good, p);
+
+	bench_run(buf, p - buf, &r);
+	return r.frames == 2 && r.bad_escapes == 1 && r.truncated == 0;
+}
+
+static double bench_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s [-r capture] [-m megabytes] [-n rounds]\n"
+		"\t-r  decode a raw capture file instead of generated traffic\n"
+		"\t-m  amount of traffic to generate (default 64)\n"
+		"\t-n  rounds per method, the best one counts (default 3)\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct bench_result ref, r;
+	const char *capture = NULL;
+	unsigned long mb = 64, rounds = 3, k;
+	enum h485_scan mode, best;
+	double t, fastest;
+	uint8_t *buf;
+	size_t len = 0, size;
+	FILE *f;
+	int opt, failed = 0;
+
+	while((opt = getopt(argc, argv, "r:m:n:")) != -1) {
+		switch(opt) {
+			case 'r':	capture = optarg;			break;
+			case 'm':	mb = strtoul(optarg, NULL, 0);		break;
+			case 'n':	rounds = strtoul(optarg, NULL, 0);	break;
+			default:	usage(argv[0]);
+		}
+	}
+
+	if(!mb || !rounds)
+		usage(argv[0]);
+
+	if(capture) {
+		if(!(f = fopen(capture, "rb"))) {
+			perror(capture);
+			return 1;
+		}
+
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		if(!(buf = malloc(size ? size : 1)) || fread(buf, 1, size, f) != size) {
+			perror(capture);
+			return 1;
+		}
+		fclose(f);
+
+		len = size;
+		h485_wire_order(buf, len);
+	} else {
+		size = mb << 20;
+		if(!(buf = malloc(size))) {
+			perror("malloc");
+			return 1;
+		}
+
+		srand(1);
+		len = bench_generate(buf, size);
+	}
+
+	best = h485_best_scan();
+	printf("%zu bytes, best scan method on this CPU: %s\n", len, bench_names[best]);
+
+	for(mode=H485_SCAN_BYTEWISE; mode<=best; mode++) {
+		h485_set_scan(mode);
+
+		if(!bench_check()) {
+			printf("%-8s  wrong result for the known frames\n", bench_names[mode]);
+			failed = 1;
+		}
+
+		fastest = 0;
+		for(k=0; k<rounds; k++) {
+			t = bench_now();
+			bench_run(buf, len, &r);
+			t = bench_now() - t;
+
+			if(!k || t < fastest)
+				fastest = t;
+		}
+
+		if(mode == H485_SCAN_BYTEWISE)
+			ref = r;
+
+		printf("%-8s  %8.1f MB/s  %lu frames, %lu truncated, %lu bad escapes, %lu too large, digest %016llx%s\n",
+			bench_names[mode], len / fastest / (1 << 20), r.frames, r.truncated, r.bad_escapes, r.overruns,
+			(unsigned long long) r.digest,
+			memcmp(&r, &ref, sizeof(r)) ? "  MISMATCH" : "");
+
+		if(memcmp(&r, &ref, sizeof(r)))
+			failed = 1;
+	}
+
+	free(buf);
+	return failed;
+}
@@ -0,0 +1,436 @@
+/** \file flash485.c
+ * \brief Uploads an application to a node running the bus bootloader.
+ *
+ * Reads an Intel hex file linked for LOADER_APP_START, announces it to
+ * the nodes with BOOT_TYPE_START (repeating it until they answer, so a
+ * node that first has to reset into its bootloader is caught in its
+ * window), then sends the pages back-to-back with only the nodes'
+ * programming time in between, and finally asks the nodes to check the
+ * image with BOOT_TYPE_DONE.
+ *
+ * With more than one node, or a group address given, the image goes out
+ * once to the group (or to everyone). Each node is then asked for the
+ * pages it missed, and the pages any of them missed are sent again, until
+ * all nodes have everything. Nodes that reported a complete image aren't
+ * asked again. A node that answers a query with LOADER_NO_IMAGE missed
+ * the START, or was reset since, and is sent one of its own.
+ *
+ * usage: flash485 -d tty[@baud] -a address [-a address ...] [-g group] [-s source] file.hex
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+#include "../../application/bootloader/loader.h"
+
+#define FL_START_TRIES	20		/**< BOOT_TYPE_START attempts before giving up */
+#define FL_START_WAIT	300		/**< ms to wait for an answer to each */
+#define FL_QUERY_TRIES	3
+#define FL_QUERY_WAIT	300
+#define FL_DONE_TRIES	3
+#define FL_DONE_WAIT	3000		/**< ms to wait for the node to check the image */
+#define FL_MAX_ROUNDS	20		/**< times the missing pages are sent again before giving up */
+
+static uint8_t	fl_image[LOADER_FLASH_END];
+static int	fl_fd;
+static unsigned int fl_baud = H485_DEFAULT_BAUD;
+static uint8_t	fl_src = 0x01;
+static uint8_t	fl_start[4];		/**< BOOT_TYPE_START payload: image length, CRC */
+
+/** the nodes being updated */
+static struct {
+	uint8_t	address;
+	uint8_t	ready;			/**< answered and in its bootloader */
+	uint8_t	complete;		/**< reported no missing pages */
+	int	status;			/**< last status it reported, -1 if none */
+} fl_nodes[256];
+static int	fl_nnodes = 0;
+
+static struct h485_decoder fl_dec;
+static uint8_t	fl_payload[H485_MAX_PAYLOAD];
+static uint8_t	fl_peer;		/**< node a reply is expected from */
+static int	fl_status;		/**< status in the last reply from it, -1 if none */
+static uint16_t	fl_crc;			/**< CRC in that reply */
+static int	fl_got_missing;		/**< set when it sent its missing pages */
+static uint8_t	fl_missing[LOADER_MAP_SIZE];
+
+/** CRC-16 as in avr-libc's _crc16_update(), which the bootloader uses */
+static uint16_t fl_crc16(uint16_t crc, uint8_t b) {
+	int i;
+
+	crc ^= b;
+	for(i=0; i<8; i++)
+		crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+
+	return crc;
+}
+
+static int fl_hex(const char *s, int n) {
+	char buf[5];
+
+	memcpy(buf, s, n);
+	buf[n] = '\0';
+	return strtol(buf, NULL, 16);
+}
+
+/** read an Intel hex file into fl_image, returning the end address or -1 */
+static long fl_read_hex(const char *path) {
+	char line[600];
+	long end = 0, base = 0, addr;
+	int n, type, i;
+	FILE *f;
+
+	if(!(f = fopen(path, "r"))) {
+		perror(path);
+		return -1;
+	}
+
+	memset(fl_image, 0xFF, sizeof(fl_image));
+
+	while(fgets(line, sizeof(line), f)) {
+		if(line[0] != ':' || strlen(line) < 11)
+			continue;
+
+		n    = fl_hex(line + 1, 2);
+		addr = base + fl_hex(line + 3, 4);
+		type = fl_hex(line + 7, 2);
+
+		if(type == 1)
+			break;
+		if(type == 2) {
+			base = fl_hex(line + 9, 4) << 4;
+			continue;
+		}
+		if(type != 0)
+			continue;
+
+		if(addr < LOADER_APP_START || addr + n > LOADER_FLASH_END) {
+			fprintf(stderr, "%s: data at %04lx is outside the application area %04x-%04x; is it linked for the bootloader?\n",
+				path, addr, LOADER_APP_START, LOADER_FLASH_END);
+			fclose(f);
+			return -1;
+		}
+
+		for(i=0; i<n; i++)
+			fl_image[addr + i] = fl_hex(line + 9 + 2*i, 2);
+		if(addr + n > end)
+			end = addr + n;
+	}
+
+	fclose(f);
+	return end;
+}
+
+static void fl_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	(void) ctx;
+
+	if(header->src != fl_peer)
+		return;
+
+	if(header->type == BOOT_TYPE_STATUS && header->length >= 3) {
+		fl_status = payload[0];
+		fl_crc = (payload[1] << 8) | payload[2];
+	}
+
+	if(header->type == BOOT_TYPE_MISSING && header->length == LOADER_MAP_SIZE) {
+		memcpy(fl_missing, payload, LOADER_MAP_SIZE);
+		fl_got_missing = 1;
+	}
+}
+
+/** send a frame and wait until it has left the UART */
+static int fl_send(uint8_t dest, uint8_t type, uint8_t *payload, uint16_t length) {
+	uint8_t buf[H485_ENCODED_SIZE(2 + LOADER_PAGE_SIZE)];
+	struct sblp_header header;
+	struct pollfd pfd;
+	size_t len, off = 0;
+	ssize_t n;
+
+	header.type	= type;
+	header.length	= length;
+	header.dest	= dest;
+	header.src	= fl_src;
+
+	len = h485_encode(&header, payload, buf);
+	h485_wire_order(buf, len);
+
+	pfd.fd = fl_fd;
+	pfd.events = POLLOUT;
+
+	while(off < len) {
+		if((n = write(fl_fd, buf + off, len - off)) < 0) {
+			if(errno != EAGAIN && errno != EINTR)
+				return -1;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		off += n;
+	}
+
+	return tcdrain(fl_fd);
+}
+
+/** read replies for up to ms milliseconds, or until the peer answers */
+static void fl_wait(uint8_t peer, int ms) {
+	uint8_t buf[256];
+	struct pollfd pfd;
+	ssize_t n;
+
+	pfd.fd = fl_fd;
+	pfd.events = POLLIN;
+
+	fl_peer = peer;
+	fl_status = -1;
+	fl_got_missing = 0;
+	while(fl_status < 0 && !fl_got_missing && poll(&pfd, 1, ms) > 0) {
+		if((n = read(fl_fd, buf, sizeof(buf))) <= 0)
+			continue;
+
+		h485_wire_order(buf, n);
+		h485_decode(&fl_dec, buf, n);
+	}
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s -d tty[@baud] -a address [-a address ...] [-g group] [-s source] file.hex\n"
+		"\t-d  serial port on the bus (default %d baud)\n"
+		"\t-a  address of a node to update\n"
+		"\t-g  send the image to this group (default: the node, or everyone when there are several)\n"
+		"\t-s  our address on the bus (default 0x01)\n",
+		argv0, H485_DEFAULT_BAUD);
+	exit(1);
+}
+
+/** ask a node once which pages it's missing; returns 0 unless it sent its bitmap */
+static int fl_ask(int n) {
+	fl_send(fl_nodes[n].address, BOOT_TYPE_QUERY, NULL, 0);
+	fl_wait(fl_nodes[n].address, FL_QUERY_WAIT);
+	if(fl_got_missing)
+		return 1;
+
+	if(fl_status == LOADER_NO_IMAGE) {
+		/* it has no image announced -- the next query gets its bitmap */
+		fl_send(fl_nodes[n].address, BOOT_TYPE_START, fl_start, sizeof(fl_start));
+		fl_wait(fl_nodes[n].address, FL_START_WAIT);
+	}
+
+	return 0;
+}
+
+/** ask a node which pages it's missing; returns 0 if it doesn't answer */
+static int fl_query(int n) {
+	int i;
+
+	for(i=0; i<FL_QUERY_TRIES; i++)
+		if(fl_ask(n))
+			return 1;
+
+	return 0;
+}
+
+/** ask a node for the result of checking its image */
+static void fl_done(int n) {
+	int i;
+
+	for(i=0; i<FL_DONE_TRIES; i++) {
+		fl_send(fl_nodes[n].address, BOOT_TYPE_DONE, NULL, 0);
+		fl_wait(fl_nodes[n].address, FL_DONE_WAIT);
+		if(fl_status >= 0)
+			break;
+	}
+
+	fl_nodes[n].status = fl_status;
+}
+
+int main(int argc, char **argv) {
+	uint8_t buf[2 + LOADER_PAGE_SIZE], send[LOADER_MAP_SIZE];
+	const char *tty = NULL;
+	uint16_t length, crc = 0xFFFF, page, pages;
+	long end, addr;
+	int opt, i, n, round, any, ready, good = 0, dest = -1;
+	char *at;
+
+	while((opt = getopt(argc, argv, "d:a:g:s:")) != -1) {
+		switch(opt) {
+			case 'd':
+				tty = optarg;
+				if((at = strchr(optarg, '@'))) {
+					*at = '\0';
+					fl_baud = strtoul(at + 1, NULL, 10);
+				}
+				break;
+
+			case 'a':
+				if(fl_nnodes == 256)
+					usage(argv[0]);
+				fl_nodes[fl_nnodes].address = strtoul(optarg, NULL, 0);
+				fl_nodes[fl_nnodes].ready = 0;
+				fl_nodes[fl_nnodes].complete = 0;
+				fl_nodes[fl_nnodes].status = -1;
+				fl_nnodes++;
+				break;
+
+			case 'g':
+				dest = strtoul(optarg, NULL, 0);
+				break;
+
+			case 's':
+				fl_src = strtoul(optarg, NULL, 0);
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(!tty || !fl_nnodes || optind != argc - 1)
+		usage(argv[0]);
+
+	if(dest < 0)
+		dest = fl_nnodes == 1 ? fl_nodes[0].address : SBLP_BROADCAST;
+
+	if((end = fl_read_hex(argv[optind])) < 0)
+		return 1;
+	if(end <= LOADER_APP_START) {
+		fprintf(stderr, "%s: no data\n", argv[optind]);
+		return 1;
+	}
+
+	length = end - LOADER_APP_START;
+	pages = (length + LOADER_PAGE_SIZE - 1) / LOADER_PAGE_SIZE;
+	for(addr=LOADER_APP_START; addr<end; addr++)
+		crc = fl_crc16(crc, fl_image[addr]);
+
+	if((fl_fd = h485_open_tty(tty, fl_baud)) < 0) {
+		perror(tty);
+		return 1;
+	}
+
+	h485_decoder_init(&fl_dec, fl_payload, sizeof(fl_payload), fl_frame, NULL);
+
+	/* get the nodes into their bootloader */
+	fl_start[0] = length >> 8;
+	fl_start[1] = length & 0xFF;
+	fl_start[2] = crc >> 8;
+	fl_start[3] = crc & 0xFF;
+
+	for(i=0, ready=0; i<FL_START_TRIES && ready<fl_nnodes; i++) {
+		fl_send(dest, BOOT_TYPE_START, fl_start, sizeof(fl_start));
+		fl_wait(dest, FL_START_WAIT);
+
+		for(n=0; n<fl_nnodes; n++) {
+			if(fl_nodes[n].ready)
+				continue;
+
+			if(fl_ask(n)) {
+				fl_nodes[n].ready = 1;
+				ready++;
+			}
+		}
+	}
+
+	for(n=0; n<fl_nnodes; n++)
+		if(!fl_nodes[n].ready)
+			fprintf(stderr, "node %02x doesn't answer, skipping it\n", fl_nodes[n].address);
+	if(!ready)
+		return 1;
+
+	printf("%d node%s ready, sending %u bytes to %02x\n", ready, ready == 1 ? "" : "s", length, dest);
+
+	memset(send, 0, sizeof(send));
+	for(page=0; page<pages; page++)
+		send[page >> 3] |= 1 << (page & 7);
+
+	for(round=0; round<FL_MAX_ROUNDS; round++) {
+		/* no acknowledgements: each page just gets the time it takes to program */
+		for(page=0; page<pages; page++) {
+			if(!(send[page >> 3] & (1 << (page & 7))))
+				continue;
+
+			addr = LOADER_APP_START + page * LOADER_PAGE_SIZE;
+			buf[0] = addr >> 8;
+			buf[1] = addr & 0xFF;
+			memcpy(buf + 2, fl_image + addr, LOADER_PAGE_SIZE);
+
+			if(fl_send(dest, BOOT_TYPE_PAGE, buf, sizeof(buf)) < 0) {
+				perror(tty);
+				return 1;
+			}
+			usleep(LOADER_PROG_TIME + 1000000 / fl_baud);
+
+			printf("\rround %d: page %u/%u", round + 1, page + 1, pages);
+			fflush(stdout);
+		}
+		printf("\n");
+
+		/* collect what's still missing */
+		memset(send, 0, sizeof(send));
+		for(n=0, any=0; n<fl_nnodes; n++) {
+			if(!fl_nodes[n].ready || fl_nodes[n].complete)
+				continue;
+
+			if(!fl_query(n)) {
+				fprintf(stderr, "node %02x stopped answering, skipping it\n", fl_nodes[n].address);
+				fl_nodes[n].ready = 0;
+				continue;
+			}
+
+			fl_nodes[n].complete = 1;
+			for(i=0; i<LOADER_MAP_SIZE; i++) {
+				send[i] |= fl_missing[i];
+				if(fl_missing[i])
+					fl_nodes[n].complete = 0;
+			}
+			any |= !fl_nodes[n].complete;
+		}
+
+		if(!any)
+			break;
+	}
+
+	/* have everyone check at once, then collect the results */
+	if(fl_nnodes > 1 || dest != fl_nodes[0].address) {
+		fl_send(dest, BOOT_TYPE_DONE, NULL, 0);
+		fl_wait(dest, FL_DONE_WAIT);
+	}
+
+	for(n=0; n<fl_nnodes; n++) {
+		if(!fl_nodes[n].ready)
+			continue;
+
+		fl_done(n);
+
+		switch(fl_nodes[n].status) {
+			case LOADER_OK:
+				printf("node %02x: image verified, started it\n", fl_nodes[n].address);
+				good++;
+				break;
+
+			case LOADER_BAD_CRC:
+				fprintf(stderr, "node %02x: CRC mismatch, node has %04x, image is %04x\n",
+					fl_nodes[n].address, fl_crc, crc);
+				break;
+
+			case LOADER_INCOMPLETE:
+				fprintf(stderr, "node %02x: still missing pages\n", fl_nodes[n].address);
+				break;
+
+			default:
+				fprintf(stderr, "node %02x %s\n", fl_nodes[n].address,
+					fl_nodes[n].status < 0 ? "doesn't answer" : "lost the image");
+		}
+	}
+
+	printf("%d of %d node%s updated\n", good, fl_nnodes, fl_nnodes == 1 ? "" : "s");
+	return good == fl_nnodes ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+/** \file sniffer.c
+ * \brief Bus sniffer with pcap output.
+ *
+ * Reads raw bus bytes from a serial port or from a capture file (as
+ * written by `cat /dev/ttyUSB0 > file`), undoes the tiny485 escaping,
+ * splits the stream into frames on the sync byte and decodes the SBLP
+ * header. Frames are printed, written to a pcap file, or both.
+ *
+ * Each pcap record holds the unescaped frame: the 5 header bytes followed
+ * by the payload, with link type DLT_USER0. Frames are timestamped at
+ * their sync byte: from the clock when reading a serial port, from the
+ * byte offset at the given baud rate when reading a file.
+ *
+ * Memory use is bounded: the input is processed in fixed chunks and only
+ * one frame is buffered at a time.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+
+#define SN_CHUNK	4096		/**< bytes read at a time */
+#define SN_DLT_USER0	147		/**< pcap link type for private use */
+
+/** pcap file header */
+struct sn_pcap_hdr {
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	network;
+};
+
+/** pcap record header */
+struct sn_pcap_rec {
+	uint32_t	ts_sec;
+	uint32_t	ts_usec;
+	uint32_t	incl_len;
+	uint32_t	orig_len;
+};
+
+static struct h485_decoder sn_dec;
+static uint8_t	sn_payload[H485_MAX_PAYLOAD];
+
+static FILE	*sn_pcap = NULL;
+static int	 sn_print = 0;
+static unsigned int sn_baud = H485_DEFAULT_BAUD;
+
+/** time of the first byte of the current chunk, in microseconds */
+static unsigned long long sn_chunk_time;
+static unsigned long long sn_chunk_pos;
+
+static volatile sig_atomic_t sn_stop = 0;
+
+/** time one byte takes on the wire, in microseconds: start + 8 data + stop */
+static unsigned long long sn_byte_time() {
+	return 10000000ULL / sn_baud;
+}
+
+static void sn_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	struct sn_pcap_rec rec;
+	uint8_t head[HEADER_LENGTH];
+	unsigned long long ts;
+	uint16_t i;
+
+	(void) ctx;
+
+	/* the sync may have been in an earlier chunk */
+	if(sn_dec.start >= sn_chunk_pos)
+		ts = sn_chunk_time + (sn_dec.start - sn_chunk_pos) * sn_byte_time();
+	else
+		ts = sn_chunk_time - (sn_chunk_pos - sn_dec.start) * sn_byte_time();
+
+	if(sn_print) {
+		printf("%llu.%06llu %02x -> %02x type %02x length %u:",
+			ts / 1000000, ts % 1000000, header->src, header->dest, header->type, header->length);
+		for(i=0; i<header->length; i++)
+			printf(" %02x", payload[i]);
+		printf("\n");
+	}
+
+	if(sn_pcap) {
+		rec.ts_sec   = ts / 1000000;
+		rec.ts_usec  = ts % 1000000;
+		rec.incl_len = rec.orig_len = HEADER_LENGTH + header->length;
+
+		h485_pack_header(header, head);
+		fwrite(&rec, sizeof(rec), 1, sn_pcap);
+		fwrite(head, HEADER_LENGTH, 1, sn_pcap);
+		fwrite(payload, header->length, 1, sn_pcap);
+	}
+}
+
+static void sn_signal(int sig) {
+	(void) sig;
+	sn_stop = 1;
+}
+
+/** feed a chunk to the decoder, starting at the given time */
+static void sn_feed(uint8_t *buf, size_t len, unsigned long long time) {
+	sn_chunk_time = time;
+	sn_chunk_pos = sn_dec.pos;
+
+	h485_wire_order(buf, len);
+	h485_decode(&sn_dec, buf, len);
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s (-i tty[@baud] | -r capture[@baud]) [-w file.pcap] [-p]\n"
+		"\t-i  read from a serial port\n"
+		"\t-r  read from a raw capture file; the baud rate (default %d) sets the timestamps\n"
+		"\t-w  write frames to a pcap file (link type DLT_USER0)\n"
+		"\t-p  print frames (default when not writing a pcap file)\n",
+		argv0, H485_DEFAULT_BAUD);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct sn_pcap_hdr hdr;
+	struct sigaction sa;
+	struct pollfd pfd;
+	struct timeval tv;
+	uint8_t buf[SN_CHUNK];
+	const char *input = NULL, *output = NULL;
+	unsigned long long now;
+	char *at;
+	ssize_t n;
+	int opt, fd, tty = 0;
+
+	while((opt = getopt(argc, argv, "i:r:w:p")) != -1) {
+		switch(opt) {
+			case 'i':
+			case 'r':
+				input = optarg;
+				tty = opt == 'i';
+				if((at = strchr(optarg, '@'))) {
+					*at = '\0';
+					sn_baud = strtoul(at + 1, NULL, 10);
+				}
+				break;
+
+			case 'w':
+				output = optarg;
+				break;
+
+			case 'p':
+				sn_print = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(!input || !sn_baud)
+		usage(argv[0]);
+	if(!output)
+		sn_print = 1;
+
+	if(tty)
+		fd = h485_open_tty(input, sn_baud);
+	else
+		fd = open(input, O_RDONLY);
+
+	if(fd < 0) {
+		perror(input);
+		return 1;
+	}
+
+	if(output) {
+		if(!(sn_pcap = fopen(output, "wb"))) {
+			perror(output);
+			return 1;
+		}
+
+		hdr.magic		= 0xa1b2c3d4;
+		hdr.version_major	= 2;
+		hdr.version_minor	= 4;
+		hdr.thiszone		= 0;
+		hdr.sigfigs		= 0;
+		hdr.snaplen		= HEADER_LENGTH + H485_MAX_PAYLOAD;
+		hdr.network		= SN_DLT_USER0;
+		fwrite(&hdr, sizeof(hdr), 1, sn_pcap);
+	}
+
+	/* stop cleanly so the pcap file is complete */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sn_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	h485_decoder_init(&sn_dec, sn_payload, sizeof(sn_payload), sn_frame, NULL);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while(!sn_stop) {
+		if(tty && poll(&pfd, 1, -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		n = read(fd, buf, sizeof(buf));
+		if(n < 0) {
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			perror(input);
+			break;
+		}
+		if(n == 0)
+			break;
+
+		if(tty) {
+			/* the chunk ends now; work back to its first byte */
+			gettimeofday(&tv, NULL);
+			now = tv.tv_sec * 1000000ULL + tv.tv_usec;
+			sn_feed(buf, n, now - (n - 1) * sn_byte_time());
+		} else {
+			sn_feed(buf, n, sn_dec.pos * sn_byte_time());
+		}
+
+		if(sn_pcap && tty)
+			fflush(sn_pcap);
+	}
+
+	fprintf(stderr, "%llu bytes, %lu syncs, %lu frames, %lu truncated, %lu bad escapes, %lu too large\n",
+		sn_dec.pos, sn_dec.syncs, sn_dec.frames, sn_dec.truncated, sn_dec.bad_escapes, sn_dec.overruns);
+
+	if(sn_pcap)
+		fclose(sn_pcap);
+
+	return 0;
+}
@@ -0,0 +1,355 @@
+/** \file stats485.c
+ * \brief Reads the link counters of nodes on the bus.
+ *
+ * Sends SBLP_TYPE_STATS_QUERY to each node in turn and prints the
+ * counters it sends back. With -i, it keeps polling every so many
+ * seconds and prints how much each counter has gone up since the last
+ * answer instead; the counters wrap around on the nodes, so that is what
+ * is worth watching.
+ *
+ * With -t, it asks for the tiny485 event trace instead (nodes built with
+ * T485_TRACE and SBLP_TRACE) and lists it oldest first, marking the
+ * entries where the PHY's state differs from the one before.
+ *
+ * With -l, it reads the nodes' ping histograms (nodes built with
+ * SBLP_PING), giving the median and 99th percentile round trip to the
+ * node each of them pings, in the ticks of that node's sblp_clock().
+ * Adding -p has each node ping the given node -n times per round first.
+ *
+ * usage: stats485 -d tty[@baud] [-s source] [-i seconds] [-t | -l [-p node [-n count]]] address ...
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../lib/interop.h"
+#include "../../lib/host485/host485.h"
+#include "../../lib/tiny485/tiny485.h"
+
+#define ST_TRIES	2		/**< queries per node before giving up on it */
+#define ST_WAIT		100		/**< ms to wait for an answer on top of the time it takes to send */
+#define ST_PING_WAIT	20		/**< ms of silence after which a ping we asked for is over */
+
+static int	st_fd;
+static unsigned int st_baud = H485_DEFAULT_BAUD;
+static uint8_t	st_src = 0x01;
+
+/** the nodes being polled */
+static struct {
+	uint8_t			address;
+	int			have;		/**< last is valid */
+	struct h485_node_stats	last;
+} st_nodes[256];
+static int	st_nnodes = 0;
+
+static struct h485_decoder st_dec;
+static uint8_t	st_payload[H485_MAX_PAYLOAD];
+static uint8_t	st_peer;		/**< node an answer is expected from */
+static uint8_t	st_want;		/**< type of the answer */
+static int	st_got;			/**< set when it answered */
+static struct h485_node_stats st_stats;	/**< with these counters */
+static uint8_t	st_trace[256];		/**< or this trace */
+static uint16_t	st_trace_len;
+static struct h485_latency st_latency;	/**< or this histogram */
+
+/** tiny485's states, in the order of its enum */
+static const char *st_states[] = { "idle", "recv", "stop", "break", "xmit1", "xmit2" };
+static const char *st_events[] = { "?", "pcint", "tim0", "usi", "xmit" };
+
+static void st_frame(void *ctx, struct sblp_header *header, uint8_t *payload) {
+	(void) ctx;
+
+	if(header->type != st_want || header->src != st_peer || header->dest != st_src)
+		return;
+
+	if(header->type == SBLP_TYPE_STATS && !h485_unpack_stats(&st_stats, payload, header->length))
+		st_got = 1;
+
+	if(header->type == SBLP_TYPE_LATENCY && !h485_unpack_latency(&st_latency, payload, header->length))
+		st_got = 1;
+
+	if(header->type == SBLP_TYPE_TRACE && header->length <= sizeof(st_trace)) {
+		memcpy(st_trace, payload, header->length);
+		st_trace_len = header->length;
+		st_got = 1;
+	}
+}
+
+/** send a query and wait until it has left the UART */
+static int st_send(uint8_t dest, uint8_t type, uint8_t *payload, uint16_t length) {
+	uint8_t buf[H485_ENCODED_SIZE(1)];
+	struct sblp_header header;
+	size_t len;
+
+	header.type	= type;
+	header.length	= length;
+	header.dest	= dest;
+	header.src	= st_src;
+
+	len = h485_encode(&header, payload, buf);
+	h485_wire_order(buf, len);
+
+	/* a handful of bytes always fits in the UART's buffer */
+	if(write(st_fd, buf, len) != (ssize_t) len)
+		return -1;
+
+	return tcdrain(st_fd);
+}
+
+/** ask a node for its counters or trace; returns 0 if it doesn't answer */
+static int st_query(uint8_t address, uint8_t type) {
+	int ms = ST_WAIT + H485_ENCODED_SIZE(sizeof(st_trace)) * 10000 / st_baud;
+	uint8_t buf[256];
+	struct pollfd pfd;
+	ssize_t n;
+	int i;
+
+	pfd.fd = st_fd;
+	pfd.events = POLLIN;
+
+	st_peer = address;
+	st_want = type + 1;	/* the reply follows the query */
+	st_got = 0;
+	for(i=0; i<ST_TRIES && !st_got; i++) {
+		if(st_send(address, type, NULL, 0) < 0)
+			return 0;
+
+		while(!st_got && poll(&pfd, 1, ms) > 0) {
+			if((n = read(st_fd, buf, sizeof(buf))) <= 0)
+				continue;
+
+			h485_wire_order(buf, n);
+			h485_decode(&st_dec, buf, n);
+		}
+	}
+
+	return st_got;
+}
+
+/** have a node ping another one, and wait for the line to go quiet */
+static void st_ping(uint8_t address, uint8_t target) {
+	uint8_t buf[256];
+	struct pollfd pfd;
+
+	pfd.fd = st_fd;
+	pfd.events = POLLIN;
+
+	if(st_send(address, SBLP_TYPE_PING_REQUEST, &target, 1) < 0)
+		return;
+
+	/* the ping and its echo */
+	while(poll(&pfd, 1, ST_PING_WAIT + 2 * H485_ENCODED_SIZE(SBLP_PING_LENGTH) * 10000 / st_baud) > 0)
+		if(read(st_fd, buf, sizeof(buf)) <= 0)
+			break;
+}
+
+/** print a ping histogram */
+static void st_print_latency(uint8_t address) {
+	const struct h485_latency *l = &st_latency;
+	long p50 = h485_latency_percentile(l, 0.5), p99 = h485_latency_percentile(l, 0.99);
+	int i;
+
+	if(l->dest >= SBLP_GROUP_FIRST) {
+		printf("0x%02x: hasn't pinged anyone\n", address);
+		return;
+	}
+
+	printf("0x%02x -> 0x%02x: %u pings, %u lost", address, l->dest, l->pings, l->lost);
+	if(p50 >= 0)
+		printf(", p50 <= %ld", p50);
+	if(p99 >= 0)
+		printf(", p99 <= %ld", p99);
+	printf(" ticks\n");
+
+	for(i=0; i<SBLP_LATENCY_BUCKETS; i++) {
+		if(!l->buckets[i])
+			continue;
+
+		if(i == SBLP_LATENCY_BUCKETS - 1)
+			printf("\t>= %6ld: %u\n", 1L << (i - 1), l->buckets[i]);
+		else
+			printf("\t<= %6ld: %u\n", (1L << i) - 1, l->buckets[i]);
+	}
+}
+
+/** print counters; with last given, print how far they got since then */
+static void st_print(uint8_t address, const struct h485_node_stats *s, const struct h485_node_stats *last) {
+	struct h485_node_stats d = *s;
+
+	/* unsigned arithmetic in the counters' own width takes care of wrapping */
+	if(last) {
+		d.hw.bytes_in		-= last->hw.bytes_in;
+		d.hw.bytes_out		-= last->hw.bytes_out;
+		d.hw.syncs		-= last->hw.syncs;
+		d.hw.escapes_in		-= last->hw.escapes_in;
+		d.hw.escapes_out	-= last->hw.escapes_out;
+		d.hw.framing_errors	-= last->hw.framing_errors;
+		d.hw.overflows		-= last->hw.overflows;
+
+		d.sblp.frames_in	-= last->sblp.frames_in;
+		d.sblp.frames_out	-= last->sblp.frames_out;
+		d.sblp.dropped		-= last->sblp.dropped;
+		d.sblp.overruns		-= last->sblp.overruns;
+	}
+
+	printf("0x%02x: bytes %lu in, %lu out, %u syncs, escapes %u in, %u out, %u framing errors, %u overflows; "
+		"frames %u in, %u out, %u dropped, %u overruns\n",
+		address, (unsigned long) d.hw.bytes_in, (unsigned long) d.hw.bytes_out, d.hw.syncs,
+		d.hw.escapes_in, d.hw.escapes_out, d.hw.framing_errors, d.hw.overflows,
+		d.sblp.frames_in, d.sblp.frames_out, d.sblp.dropped, d.sblp.overruns);
+}
+
+/** list a trace: the offset of the oldest entry, then the entries */
+static void st_print_trace(uint8_t address) {
+	unsigned int entries, i, n = 0, last = ~0u;
+	const uint8_t *e;
+
+	if(st_trace_len < 1 + T485_TRACE_ENTRY || (st_trace_len - 1) % T485_TRACE_ENTRY || st_trace[0] >= st_trace_len - 1) {
+		printf("0x%02x: bad trace\n", address);
+		return;
+	}
+
+	entries = (st_trace_len - 1) / T485_TRACE_ENTRY;
+	printf("0x%02x: %u entries, oldest first\n", address, entries);
+	printf("   # event  state  data  tcnt0\n");
+
+	for(i=0; i<entries; i++) {
+		e = st_trace + 1 + (st_trace[0] + i * T485_TRACE_ENTRY) % (st_trace_len - 1);
+
+		/* never written */
+		if(!(e[0] >> 4))
+			continue;
+
+		printf("%4u %-6s %-6s%c 0x%02x  %5u\n", n++,
+			(e[0] >> 4) < sizeof(st_events) / sizeof(*st_events) ? st_events[e[0] >> 4] : "?",
+			(e[0] & 15) < sizeof(st_states) / sizeof(*st_states) ? st_states[e[0] & 15] : "?",
+			last != ~0u && (e[0] & 15) != last ? '*' : ' ', e[1], e[2]);
+		last = e[0] & 15;
+	}
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"usage: %s -d tty[@baud] [-s source] [-i seconds] [-t | -l [-p node [-n count]]] address ...\n"
+		"\t-d  serial port on the bus (default %d baud)\n"
+		"\t-s  our address on the bus (default 0x01)\n"
+		"\t-i  keep polling at this interval, printing the change since the last answer\n"
+		"\t-t  read the nodes' PHY event trace instead of their counters\n"
+		"\t-l  read the nodes' ping round trip histograms instead of their counters\n"
+		"\t-p  first have each node ping this node\n"
+		"\t-n  that many times per round (default 10)\n",
+		argv0, H485_DEFAULT_BAUD);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *tty = NULL;
+	unsigned int interval = 0;
+	int trace = 0, latency = 0, target = -1, count = 10, i;
+	struct timespec next;
+	int opt, n;
+	char *at;
+
+	while((opt = getopt(argc, argv, "d:s:i:tlp:n:")) != -1) {
+		switch(opt) {
+			case 'd':
+				tty = optarg;
+				if((at = strchr(optarg, '@'))) {
+					*at = '\0';
+					st_baud = strtoul(at + 1, NULL, 10);
+				}
+				break;
+
+			case 's':
+				st_src = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'i':
+				interval = strtoul(optarg, NULL, 0);
+				break;
+
+			case 't':
+				trace = 1;
+				break;
+
+			case 'l':
+				latency = 1;
+				break;
+
+			case 'p':
+				target = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'n':
+				count = strtoul(optarg, NULL, 0);
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(!tty || optind == argc || argc - optind > 256 || (trace && latency) || (target >= 0 && !latency))
+		usage(argv[0]);
+
+	for(; optind<argc; optind++) {
+		st_nodes[st_nnodes].address = strtoul(argv[optind], NULL, 0);
+		st_nodes[st_nnodes].have = 0;
+		st_nnodes++;
+	}
+
+	if((st_fd = h485_open_tty(tty, st_baud)) < 0) {
+		perror(tty);
+		return 1;
+	}
+
+	h485_decoder_init(&st_dec, st_payload, sizeof(st_payload), st_frame, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(1) {
+		for(n=0; n<st_nnodes; n++) {
+			if(latency) {
+				for(i=0; target >= 0 && i<count; i++)
+					st_ping(st_nodes[n].address, target);
+
+				if(!st_query(st_nodes[n].address, SBLP_TYPE_LATENCY_QUERY))
+					printf("0x%02x: no answer\n", st_nodes[n].address);
+				else
+					st_print_latency(st_nodes[n].address);
+				continue;
+			}
+
+			if(!st_query(st_nodes[n].address, trace ? SBLP_TYPE_TRACE_QUERY : SBLP_TYPE_STATS_QUERY)) {
+				printf("0x%02x: no answer\n", st_nodes[n].address);
+				continue;
+			}
+
+			if(trace) {
+				st_print_trace(st_nodes[n].address);
+				continue;
+			}
+
+			st_print(st_nodes[n].address, &st_stats, st_nodes[n].have ? &st_nodes[n].last : NULL);
+			st_nodes[n].last = st_stats;
+			st_nodes[n].have = 1;
+		}
+
+		if(!interval)
+			break;
+
+		fflush(stdout);
+		next.tv_sec += interval;
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+			;
+	}
+
+	return 0;
+}